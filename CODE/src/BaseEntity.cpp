@@ -8,10 +8,14 @@ BaseEntity::BaseEntity()
 	
 	this->visible = true;
 	this->type = BASE_NODE;
+	this->hasMoved = true;
+	this->is_static = false;
+	this->tree_proxy = -1;
 }
 
 void BaseEntity::setPosition(int x, int y, int z) {
 	this->model.translate(x, y, z);
+	this->hasMoved = true;
 }
 
 BaseEntity::~BaseEntity()
@@ -18,7 +18,9 @@ public:
 	Matrix44 model;
 	bool visible;
 	char type;
-	bool hasMoved;
+	bool hasMoved; //model changed this frame, cleared at the end of the frame
+	bool is_static; //not expected to move, used to cache its shadows
+	int tree_proxy; //leaf of the entity in the tree of the scene, -1 if it is not in one
 
 	BaseEntity();
 	void setPosition(int x, int y, int z);
@@ -23,9 +23,19 @@ Light::Light(Vector3 colour, Vector3 position, Vector2 rotation, LightType type,
 	this->model.rotate(DEG2RAD * rotation.y, Vector3(1, 0, 0));
 	this->yaw = rotation.x;
 	this->pitch = rotation.y;
-	this->shadow_fbo = nullptr;
+	this->shadow_tile_x = this->shadow_tile_y = this->shadow_tile_size = 0;
+	this->shadow_importance = 0;
+	this->shadow_dirty = true;
+	this->shadow_casters = 0;
+	this->shadow_culled = 0;
+	this->buffer_index = -1;
 	//this->shadow_fbo->create(fbo_w, fbo_h);
 	this->camera = new Camera();
+	this->num_cascades = MAX_CASCADES;
+	for (int i = 0; i < MAX_CASCADES; i++) {
+		this->cascade_cameras[i] = new Camera();
+		this->cascade_splits[i] = 0;
+	}
 	this->shadow_bias = 0.02;
 	this->spotCosineAngle = 0.0;
 	this->cfar = 1000;
@@ -72,6 +82,31 @@ Camera* Light::getCamera() {
 	return this->camera;
 }
 
+void Light::fillShaderData(sLightData& data, bool use_cascades) {
+	float type = light_type == DIRECTIONAL ? 0.0f : (light_type == OMNI ? 1.0f : 2.0f);
+	Vector3 pos = model.getTranslation();
+	Vector3 dir = model.frontVector();
+	data.position_type = Vector4(pos.x, pos.y, pos.z, type);
+	data.color_intensity = Vector4(color.x, color.y, color.z, intensity);
+	data.direction_maxdist = Vector4(dir.x, dir.y, dir.z, max_dist);
+	data.spot_shadow = Vector4(spotCosineAngle, spotExponent, shadow_bias * 0.1f, use_cascades ? 1.0f : 0.0f);
+
+	//a directional light without cascades has no valid shadow camera
+	bool shadows = shadow_tile_size && (light_type != DIRECTIONAL || use_cascades);
+	data.shadow_tile = shadows ? shadow_tile : Vector4(0, 0, 0, 0);
+	data.shadow_viewproj = camera->viewprojection_matrix;
+}
+
+int Light::getNumShadowViews() {
+	return this->light_type == DIRECTIONAL ? this->num_cascades : 1;
+}
+
+Camera* Light::getShadowCamera(int view) {
+	if (this->light_type == DIRECTIONAL)
+		return this->cascade_cameras[view];
+	return this->camera;
+}
+
 void Light::setNearFar(float near_p, float far_p) {
 	this->camera->far_plane = far_p;
 	this->camera->near_plane = near_p;
@@ -94,6 +129,8 @@ float Light::getSpotAngle() {
 
 Light::~Light()
 {
+	for (int i = 0; i < MAX_CASCADES; i++)
+		delete this->cascade_cameras[i];
 }
 
 void Light::setSpotExponent(float exp) {
@@ -165,7 +202,8 @@ void Light::renderinMenu() {
 		
 		ImGui::DragFloat("near", &this->cnear, 0.5);
 		ImGui::DragFloat("far", &this->cfar, 0.5);
-		ImGui::DragFloat("frustrum", &this->frustrum, 1);
+		if (this->light_type == DIRECTIONAL && ImGui::SliderInt("Cascades", &this->num_cascades, 1, MAX_CASCADES))
+			this->shadow_dirty = true;
 		
 		ImGui::TreePop();
 	}
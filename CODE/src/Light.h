@@ -6,12 +6,24 @@
 #include "camera.h"
 #include "utils.h"
 
+#define MAX_CASCADES 4
+
 enum LightType{
 	OMNI,
 	SPOT,
 	DIRECTIONAL
 };
 
+//one light as the shaders read it (uniform buffer or texture rows), std140 layout so everything is packed in vec4
+struct sLightData {
+	Vector4 position_type;		//xyz position, w type (0 directional, 1 omni, 2 spot)
+	Vector4 color_intensity;	//rgb color, a intensity
+	Vector4 direction_maxdist;	//xyz direction, w max distance
+	Vector4 spot_shadow;		//x spot cosine cutoff, y spot exponent, z shadow bias, w 1 if it uses the cascades
+	Vector4 shadow_tile;		//tile in the atlas, all 0 if it has no shadowmap
+	Matrix44 shadow_viewproj;
+};
+
 class Light : public BaseEntity
 {
 private:
@@ -50,8 +62,28 @@ public:
 	void renderinMenu();
 	void Light::renderSphere(Camera* camera);
 
-	FBO* shadow_fbo;
 	float shadow_bias;
+
+	//tile of the shadow atlas, size 0 if the light has no shadowmap
+	int shadow_tile_x, shadow_tile_y, shadow_tile_size;
+	Vector4 shadow_tile;			//same tile in uvs, offset in xy and scale in zw
+	float shadow_importance;		//how much the shadow is seen, decides the size of the tile
+
+	//cascaded shadows of the directional lights, every cascade covers a slice of the view
+	int num_cascades;
+	Camera* cascade_cameras[MAX_CASCADES];
+	float cascade_splits[MAX_CASCADES];	//view distance where every cascade ends
+	int getNumShadowViews();			//the cascades for directional lights, one for spots
+	void fillShaderData(sLightData& data, bool use_cascades);
+	Camera* getShadowCamera(int view);
+
+	//shadow cache
+	Matrix44 shadow_cached_viewproj[MAX_CASCADES];	//light viewprojection of every view when the shadowmap was rendered
+	bool shadow_dirty;				//forces the shadowmap to be rendered again
+	int shadow_casters;				//meshes drawn in the shadowmap the last time it was rendered
+	int shadow_culled;				//meshes or whole entities skipped by the culling
+
+	int buffer_index;				//position in the lights buffer of the forward pass this frame, -1 if it is not there
 	virtual ~Light();
 };
 
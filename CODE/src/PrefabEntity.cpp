@@ -1,9 +1,12 @@
 #include "PrefabEntity.h"
 
 #include "Scene.h"
+#include "mesh.h"
 
 PrefabEntity::PrefabEntity()
 {
+	this->prefab = NULL;
+	this->prefab_version = 0;
 	this->type = PREFAB;
 	this->visible = true;
 	this->model.setIdentity();
@@ -16,6 +19,8 @@ PrefabEntity::PrefabEntity()
 
 PrefabEntity::PrefabEntity(GTR::Prefab *p, Matrix44 model)
 {
+	this->prefab = NULL;
+	this->prefab_version = 0;
 	this->type = PREFAB;
 	this->visible = true;
 	this->model.setIdentity();
@@ -31,6 +36,7 @@ PrefabEntity::PrefabEntity(GTR::Prefab *p, Matrix44 model)
 void PrefabEntity::setPrefab(GTR::Prefab* p)
 {
 	this->prefab = p;
+	this->hasMoved = true;
 }
 
 GTR::Prefab* PrefabEntity::getPrefab() {
@@ -41,6 +47,57 @@ void PrefabEntity::setPos(Vector3 position) {
 	this->setPosition(position.x, position.y, position.z);
 }
 
+void PrefabEntity::setModel(const Matrix44& m) {
+	this->model = m;
+	this->hasMoved = true;
+}
+
+void PrefabEntity::updateWorldCache() {
+	if (!prefab)
+		return;
+
+	if (prefab->flat_nodes.empty())
+		prefab->flatten();
+	prefab->updateGlobalMatrices();
+
+	int num = (int)prefab->flat_nodes.size();
+	//the matrix is compared instead of trusting hasMoved, so it is only rebuilt once per change
+	if (prefab_version == prefab->version && world_models.size() == num && memcmp(cached_model.m, model.m, sizeof(Matrix44)) == 0)
+		return;
+
+	bool first = world_models.empty();
+	BoundingBox world_bounding_new(Vector3(0, 0, 0), Vector3(0, 0, 0));
+	world_models.resize(num);
+	world_boxes.resize(num);
+	world_subtree_boxes.resize(num);
+	subtree_has_mesh.assign(num, 0);
+	bool has_bounding = false;
+	for (int i = 0; i < num; ++i) {
+		world_models[i] = prefab->flat_global[i] * model;
+		GTR::Node* node = prefab->flat_nodes[i];
+		if (!node->mesh)
+			continue;
+		world_boxes[i] = transformBoundingBox(world_models[i], node->mesh->box);
+		world_subtree_boxes[i] = world_boxes[i];
+		subtree_has_mesh[i] = 1;
+		world_bounding_new = has_bounding ? mergeBoundingBoxes(world_bounding_new, world_boxes[i]) : world_boxes[i];
+		has_bounding = true;
+	}
+	//children are after their parents, going backwards every subtree is complete before it is merged up
+	for (int i = num - 1; i > 0; --i) {
+		int parent = prefab->flat_parents[i];
+		if (!subtree_has_mesh[i] || parent == -1)
+			continue;
+		world_subtree_boxes[parent] = subtree_has_mesh[parent] ? mergeBoundingBoxes(world_subtree_boxes[parent], world_subtree_boxes[i]) : world_subtree_boxes[i];
+		subtree_has_mesh[parent] = 1;
+	}
+	prev_world_bounding = first ? world_bounding_new : world_bounding;
+	world_bounding = world_bounding_new;
+	prefab_version = prefab->version;
+	cached_model = model;
+	hasMoved = true; //world transforms changed this frame
+}
+
 PrefabEntity::~PrefabEntity()
 {
 }
@@ -52,10 +109,15 @@ void PrefabEntity::renderinMenu() {
 	if (ImGui::TreeNode(aux)) {
 		float matrixTranslation[3], matrixRotation[3], matrixScale[3];
 		ImGuizmo::DecomposeMatrixToComponents(this->model.m, matrixTranslation, matrixRotation, matrixScale);
-		ImGui::DragFloat3("Position l", matrixTranslation, 0.5f);
-		ImGui::DragFloat3("Rotation l", matrixRotation, 0.5f);
-		ImGui::DragFloat3("Scale l", matrixScale, 0.2f);
-		ImGuizmo::RecomposeMatrixFromComponents(matrixTranslation, matrixRotation, matrixScale, this->model.m);
+		bool changed = false;
+		changed |= ImGui::DragFloat3("Position l", matrixTranslation, 0.5f);
+		changed |= ImGui::DragFloat3("Rotation l", matrixRotation, 0.5f);
+		changed |= ImGui::DragFloat3("Scale l", matrixScale, 0.2f);
+		ImGui::Checkbox("Static", &this->is_static);
+		if (changed) {
+			ImGuizmo::RecomposeMatrixFromComponents(matrixTranslation, matrixRotation, matrixScale, this->model.m);
+			this->hasMoved = true;
+		}
 
 		this->prefab->root.renderInMenu();
 		ImGui::TreePop();
@@ -15,12 +15,25 @@ class PrefabEntity : public BaseEntity
 {
 private:
 	GTR::Prefab* prefab;
+	unsigned int prefab_version; //version of the prefab matrices used to build the world cache
+	Matrix44 cached_model;		 //model used to build the world cache
 public:
+	//world space info of every flattened node of the prefab, same order as prefab->flat_nodes
+	std::vector<Matrix44> world_models;
+	std::vector<BoundingBox> world_boxes; //only valid for nodes with mesh
+	std::vector<BoundingBox> world_subtree_boxes; //meshes of the node and all its descendants
+	std::vector<char> subtree_has_mesh;	//0 if there is nothing to draw in the subtree, its box is not valid
+	BoundingBox world_bounding;		//all the meshes in world space
+	BoundingBox prev_world_bounding;	//before the last change, to know the area it left
+
 	PrefabEntity();
 	PrefabEntity(GTR::Prefab* p, Matrix44 model);
 	void setPrefab(GTR::Prefab* p);
 	GTR::Prefab* getPrefab();
 	void setPos(Vector3 position);
+	void setModel(const Matrix44& m);
+	//rebuilds the world cache only if the entity moved or the prefab changed
+	void updateWorldCache();
 	void renderinMenu();
 	virtual ~PrefabEntity();
 };
@@ -3,6 +3,8 @@
 #include "mesh.h"
 #include "PrefabEntity.h"
 
+#include <algorithm>
+
 Scene* Scene::instance = NULL;
 
 
@@ -19,6 +21,97 @@ void Scene::addLight(Light* l) {
 	this->lights.push_back(l);
 }
 
+void Scene::removeEntity(BaseEntity* be)
+{
+	std::vector<BaseEntity*>::iterator it = std::find(entities.begin(), entities.end(), be);
+	if (it != entities.end())
+		entities.erase(it);
+	if (be->tree_proxy != AABB_NULL) {
+		entity_tree.remove(be->tree_proxy);
+		be->tree_proxy = AABB_NULL;
+	}
+}
+
+void Scene::removeLight(Light* l)
+{
+	std::vector<Light*>::iterator it = std::find(lights.begin(), lights.end(), l);
+	if (it != lights.end())
+		lights.erase(it);
+	if (l->tree_proxy != AABB_NULL) {
+		light_tree.remove(l->tree_proxy);
+		l->tree_proxy = AABB_NULL;
+	}
+}
+
+//the world caches are checked here for the whole frame, an entity that did not move costs a compare
+void Scene::updateTrees()
+{
+	moved_entities.clear();
+	for (int i = 0; i < entities.size(); i++) {
+		if (entities[i]->type != PREFAB)
+			continue;
+		PrefabEntity* p = (PrefabEntity*)entities[i];
+		if (!p->getPrefab())
+			continue;
+		p->updateWorldCache();
+		if (!p->hasMoved && p->tree_proxy != AABB_NULL)
+			continue;
+		moved_entities.push_back(p);
+		if (p->tree_proxy == AABB_NULL)
+			p->tree_proxy = entity_tree.insert(p->world_bounding, p);
+		else
+			entity_tree.update(p->tree_proxy, p->world_bounding);
+	}
+
+	//the range can change from the menu without moving the light, they are few so all are refitted
+	for (int i = 0; i < lights.size(); i++) {
+		Light* l = lights[i];
+		if (l->getType() == DIRECTIONAL) {
+			if (l->tree_proxy != AABB_NULL) {
+				light_tree.remove(l->tree_proxy);
+				l->tree_proxy = AABB_NULL;
+			}
+			continue;
+		}
+		float range = l->getMaxDist();
+		BoundingBox box(l->model.getTranslation(), Vector3(range, range, range));
+		if (l->tree_proxy == AABB_NULL)
+			l->tree_proxy = light_tree.insert(box, l);
+		else
+			light_tree.update(l->tree_proxy, box);
+	}
+}
+
+//distance to the nearest box of a visible mesh of the entity
+static float rayPrefabEntity(BaseEntity* entity, const Vector3& origin, const Vector3& dir, void* data)
+{
+	PrefabEntity* p = (PrefabEntity*)entity;
+	GTR::Prefab* prefab = p->getPrefab();
+	if (!p->visible || !prefab)
+		return -1;
+	float nearest = -1;
+	for (int i = 0; i < prefab->flat_nodes.size(); ) {
+		GTR::Node* node = prefab->flat_nodes[i];
+		if (!node->visible) {
+			i = prefab->flat_subtree_end[i];
+			continue;
+		}
+		Vector3 coll;
+		if (node->mesh && RayBoundingBoxCollision(p->world_boxes[i], origin, dir, coll)) {
+			float dist = (coll - origin).length();
+			if (nearest < 0 || dist < nearest)
+				nearest = dist;
+		}
+		++i;
+	}
+	return nearest;
+}
+
+BaseEntity* Scene::pick(const Vector3& origin, const Vector3& dir, float* distance)
+{
+	return entity_tree.raycast(origin, dir, 1e30f, rayPrefabEntity, NULL, distance);
+}
+
 void Scene::createFloor(int size) {
 	GTR::Prefab* prefab_floor = new GTR::Prefab();
 	GTR::Node aux = GTR::Node();
@@ -35,12 +128,21 @@ void Scene::createFloor(int size) {
 	Matrix44 model;
 	aux.model = model;
 	prefab_floor->root = aux;
+	prefab_floor->flatten();
 
 	PrefabEntity* floor = new PrefabEntity(prefab_floor, model);
+	floor->is_static = true;
 
 	addEntity(floor);
 }
 
+void Scene::resetMovedFlags() {
+	for (int i = 0; i < entities.size(); i++)
+		entities[i]->hasMoved = false;
+	for (int i = 0; i < lights.size(); i++)
+		lights[i]->hasMoved = false;
+}
+
 Scene::~Scene()
 {
 }
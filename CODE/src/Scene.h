@@ -8,6 +8,7 @@
 #include "BaseEntity.h"
 #include "Light.h"
 #include "sphericalharmonics.h"
+#include "aabbtree.h"
 
 
 
@@ -37,9 +38,20 @@ public:
 	float ambient_light;
 	Vector4 background;
 
+	//bounding volume hierarchies so the passes only visit what they can see
+	AABBTree entity_tree;	//world bounds of the prefab entities
+	AABBTree light_tree;	//range of the omni and spot lights, the directional ones reach everything
+	std::vector<BaseEntity*> moved_entities; //entities whose bounds changed this frame
+
 	void addEntity(BaseEntity* be);
 	void addLight(Light* l);
+	void removeEntity(BaseEntity* be);
+	void removeLight(Light* l);
+	void updateTrees(); //inserts the new entities and refits the moved ones, once per frame before rendering
+	//nearest prefab entity whose meshes are hit by the ray
+	BaseEntity* pick(const Vector3& origin, const Vector3& dir, float* distance = NULL);
 	void createFloor(int size);
+	void resetMovedFlags();
 	//MY FUNCTIONS
 
 };
@@ -0,0 +1,461 @@
+#include "aabbtree.h"
+
+#include "camera.h"
+
+#include <cassert>
+
+static inline Vector3 minVector(const Vector3& a, const Vector3& b) { return Vector3(fmin(a.x, b.x), fmin(a.y, b.y), fmin(a.z, b.z)); }
+static inline Vector3 maxVector(const Vector3& a, const Vector3& b) { return Vector3(fmax(a.x, b.x), fmax(a.y, b.y), fmax(a.z, b.z)); }
+
+//the cost of a node is its surface, the chance of a random ray or box to touch it
+static inline float surface(const Vector3& min, const Vector3& max)
+{
+	Vector3 d = max - min;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static inline float mergedSurface(const sAABBNode& a, const sAABBNode& b)
+{
+	return surface(minVector(a.min, b.min), maxVector(a.max, b.max));
+}
+
+static inline void mergeInto(sAABBNode& node, const sAABBNode& a, const sAABBNode& b)
+{
+	node.min = minVector(a.min, b.min);
+	node.max = maxVector(a.max, b.max);
+}
+
+static inline bool overlaps(const sAABBNode& node, const Vector3& min, const Vector3& max)
+{
+	return node.min.x <= max.x && node.max.x >= min.x && node.min.y <= max.y && node.max.y >= min.y && node.min.z <= max.z && node.max.z >= min.z;
+}
+
+AABBTree::AABBTree()
+{
+	root = AABB_NULL;
+	free_list = AABB_NULL;
+	num_leaves = 0;
+	num_frustum_tests = 0;
+}
+
+int AABBTree::allocateNode()
+{
+	int id;
+	if (free_list == AABB_NULL)
+	{
+		id = (int)nodes.size();
+		nodes.push_back(sAABBNode());
+	}
+	else
+	{
+		id = free_list;
+		free_list = nodes[id].parent;
+	}
+	sAABBNode& node = nodes[id];
+	node.entity = NULL;
+	node.parent = node.child1 = node.child2 = AABB_NULL;
+	node.height = 0;
+	return id;
+}
+
+void AABBTree::freeNode(int id)
+{
+	nodes[id].parent = free_list;
+	nodes[id].height = -1;
+	free_list = id;
+}
+
+void AABBTree::clear()
+{
+	nodes.clear();
+	root = AABB_NULL;
+	free_list = AABB_NULL;
+	num_leaves = 0;
+}
+
+int AABBTree::insert(const BoundingBox& box, BaseEntity* entity)
+{
+	int proxy = allocateNode();
+	sAABBNode& leaf = nodes[proxy];
+	Vector3 margin = box.halfsize * AABB_MARGIN_SCALE + Vector3(AABB_MARGIN, AABB_MARGIN, AABB_MARGIN);
+	leaf.min = box.center - box.halfsize - margin;
+	leaf.max = box.center + box.halfsize + margin;
+	leaf.entity = entity;
+	insertLeaf(proxy);
+	num_leaves++;
+	return proxy;
+}
+
+void AABBTree::remove(int proxy)
+{
+	assert(proxy >= 0 && proxy < (int)nodes.size() && nodes[proxy].height == 0);
+	removeLeaf(proxy);
+	freeNode(proxy);
+	num_leaves--;
+}
+
+bool AABBTree::update(int proxy, const BoundingBox& box)
+{
+	assert(proxy >= 0 && proxy < (int)nodes.size() && nodes[proxy].height == 0);
+	sAABBNode& leaf = nodes[proxy];
+	Vector3 min = box.center - box.halfsize;
+	Vector3 max = box.center + box.halfsize;
+	if (leaf.min.x <= min.x && leaf.min.y <= min.y && leaf.min.z <= min.z && leaf.max.x >= max.x && leaf.max.y >= max.y && leaf.max.z >= max.z)
+		return false;
+
+	removeLeaf(proxy);
+	Vector3 margin = box.halfsize * AABB_MARGIN_SCALE + Vector3(AABB_MARGIN, AABB_MARGIN, AABB_MARGIN);
+	leaf.min = min - margin;
+	leaf.max = max + margin;
+	insertLeaf(proxy);
+	return true;
+}
+
+void AABBTree::insertLeaf(int leaf)
+{
+	if (root == AABB_NULL)
+	{
+		root = leaf;
+		nodes[root].parent = AABB_NULL;
+		return;
+	}
+
+	//go down to the sibling that makes the tree grow less
+	int index = root;
+	while (nodes[index].child1 != AABB_NULL)
+	{
+		const sAABBNode& node = nodes[index];
+		int child1 = node.child1;
+		int child2 = node.child2;
+
+		float area = surface(node.min, node.max);
+		float combined_area = mergedSurface(node, nodes[leaf]);
+		//a new parent for this node and the leaf
+		float cost = 2.0f * combined_area;
+		//every level below pays the growth of this node
+		float inheritance_cost = 2.0f * (combined_area - area);
+
+		float cost1 = mergedSurface(nodes[child1], nodes[leaf]) + inheritance_cost;
+		if (nodes[child1].child1 != AABB_NULL)
+			cost1 -= surface(nodes[child1].min, nodes[child1].max);
+		float cost2 = mergedSurface(nodes[child2], nodes[leaf]) + inheritance_cost;
+		if (nodes[child2].child1 != AABB_NULL)
+			cost2 -= surface(nodes[child2].min, nodes[child2].max);
+
+		if (cost < cost1 && cost < cost2)
+			break;
+		index = cost1 < cost2 ? child1 : child2;
+	}
+
+	int sibling = index;
+	int old_parent = nodes[sibling].parent;
+	int new_parent = allocateNode(); //the vector can grow, no references before this
+	sAABBNode& parent = nodes[new_parent];
+	parent.parent = old_parent;
+	mergeInto(parent, nodes[leaf], nodes[sibling]);
+	parent.height = nodes[sibling].height + 1;
+	parent.child1 = sibling;
+	parent.child2 = leaf;
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+
+	if (old_parent == AABB_NULL)
+		root = new_parent;
+	else if (nodes[old_parent].child1 == sibling)
+		nodes[old_parent].child1 = new_parent;
+	else
+		nodes[old_parent].child2 = new_parent;
+
+	fixUpwards(nodes[leaf].parent);
+}
+
+void AABBTree::removeLeaf(int leaf)
+{
+	if (leaf == root)
+	{
+		root = AABB_NULL;
+		return;
+	}
+
+	//the sibling takes the place of the parent
+	int parent = nodes[leaf].parent;
+	int grand_parent = nodes[parent].parent;
+	int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+	freeNode(parent);
+
+	if (grand_parent == AABB_NULL)
+	{
+		root = sibling;
+		nodes[sibling].parent = AABB_NULL;
+		return;
+	}
+	if (nodes[grand_parent].child1 == parent)
+		nodes[grand_parent].child1 = sibling;
+	else
+		nodes[grand_parent].child2 = sibling;
+	nodes[sibling].parent = grand_parent;
+	fixUpwards(grand_parent);
+}
+
+//rebalances and refits the ancestors
+void AABBTree::fixUpwards(int index)
+{
+	while (index != AABB_NULL)
+	{
+		index = balance(index);
+		sAABBNode& node = nodes[index];
+		const sAABBNode& child1 = nodes[node.child1];
+		const sAABBNode& child2 = nodes[node.child2];
+		node.height = 1 + (child1.height > child2.height ? child1.height : child2.height);
+		mergeInto(node, child1, child2);
+		index = node.parent;
+	}
+}
+
+//if a child is two levels taller than the other, the taller one goes up, returns the new root of the subtree
+int AABBTree::balance(int iA)
+{
+	sAABBNode& A = nodes[iA];
+	if (A.child1 == AABB_NULL || A.height < 2)
+		return iA;
+
+	int iB = A.child1;
+	int iC = A.child2;
+	sAABBNode& B = nodes[iB];
+	sAABBNode& C = nodes[iC];
+	int diff = C.height - B.height;
+
+	if (diff > 1)
+	{
+		//C goes up
+		int iF = C.child1;
+		int iG = C.child2;
+		sAABBNode& F = nodes[iF];
+		sAABBNode& G = nodes[iG];
+
+		C.child1 = iA;
+		C.parent = A.parent;
+		A.parent = iC;
+		if (C.parent == AABB_NULL)
+			root = iC;
+		else if (nodes[C.parent].child1 == iA)
+			nodes[C.parent].child1 = iC;
+		else
+			nodes[C.parent].child2 = iC;
+
+		//the taller grandchild stays with C
+		if (F.height > G.height)
+		{
+			C.child2 = iF;
+			A.child2 = iG;
+			G.parent = iA;
+			mergeInto(A, B, G);
+			mergeInto(C, A, F);
+			A.height = 1 + (B.height > G.height ? B.height : G.height);
+			C.height = 1 + (A.height > F.height ? A.height : F.height);
+		}
+		else
+		{
+			C.child2 = iG;
+			A.child2 = iF;
+			F.parent = iA;
+			mergeInto(A, B, F);
+			mergeInto(C, A, G);
+			A.height = 1 + (B.height > F.height ? B.height : F.height);
+			C.height = 1 + (A.height > G.height ? A.height : G.height);
+		}
+		return iC;
+	}
+
+	if (diff < -1)
+	{
+		//B goes up
+		int iD = B.child1;
+		int iE = B.child2;
+		sAABBNode& D = nodes[iD];
+		sAABBNode& E = nodes[iE];
+
+		B.child1 = iA;
+		B.parent = A.parent;
+		A.parent = iB;
+		if (B.parent == AABB_NULL)
+			root = iB;
+		else if (nodes[B.parent].child1 == iA)
+			nodes[B.parent].child1 = iB;
+		else
+			nodes[B.parent].child2 = iB;
+
+		if (D.height > E.height)
+		{
+			B.child2 = iD;
+			A.child1 = iE;
+			E.parent = iA;
+			mergeInto(A, C, E);
+			mergeInto(B, A, D);
+			A.height = 1 + (C.height > E.height ? C.height : E.height);
+			B.height = 1 + (A.height > D.height ? A.height : D.height);
+		}
+		else
+		{
+			B.child2 = iE;
+			A.child1 = iD;
+			D.parent = iA;
+			mergeInto(A, C, D);
+			mergeInto(B, A, E);
+			A.height = 1 + (C.height > D.height ? C.height : D.height);
+			B.height = 1 + (A.height > E.height ? A.height : E.height);
+		}
+		return iB;
+	}
+
+	return iA;
+}
+
+void AABBTree::addSubtree(int id, std::vector<BaseEntity*>& results) const
+{
+	int stack[AABB_STACK_SIZE];
+	int count = 0;
+	stack[count++] = id;
+	while (count)
+	{
+		const sAABBNode& node = nodes[stack[--count]];
+		if (node.child1 == AABB_NULL)
+		{
+			results.push_back(node.entity);
+			continue;
+		}
+		assert(count + 2 <= AABB_STACK_SIZE);
+		stack[count++] = node.child1;
+		stack[count++] = node.child2;
+	}
+}
+
+void AABBTree::queryBox(const BoundingBox& box, std::vector<BaseEntity*>& results) const
+{
+	if (root == AABB_NULL)
+		return;
+	Vector3 min = box.center - box.halfsize;
+	Vector3 max = box.center + box.halfsize;
+	int stack[AABB_STACK_SIZE];
+	int count = 0;
+	stack[count++] = root;
+	while (count)
+	{
+		const sAABBNode& node = nodes[stack[--count]];
+		if (!overlaps(node, min, max))
+			continue;
+		if (node.child1 == AABB_NULL)
+		{
+			results.push_back(node.entity);
+			continue;
+		}
+		assert(count + 2 <= AABB_STACK_SIZE);
+		stack[count++] = node.child1;
+		stack[count++] = node.child2;
+	}
+}
+
+void AABBTree::querySphere(const Vector3& center, float radius, std::vector<BaseEntity*>& results) const
+{
+	if (root == AABB_NULL)
+		return;
+	float radius2 = radius * radius;
+	int stack[AABB_STACK_SIZE];
+	int count = 0;
+	stack[count++] = root;
+	while (count)
+	{
+		const sAABBNode& node = nodes[stack[--count]];
+		//distance from the center to the closest point of the box
+		float dx = (float)fmax(fmax(node.min.x - center.x, center.x - node.max.x), 0.0);
+		float dy = (float)fmax(fmax(node.min.y - center.y, center.y - node.max.y), 0.0);
+		float dz = (float)fmax(fmax(node.min.z - center.z, center.z - node.max.z), 0.0);
+		if (dx * dx + dy * dy + dz * dz > radius2)
+			continue;
+		if (node.child1 == AABB_NULL)
+		{
+			results.push_back(node.entity);
+			continue;
+		}
+		assert(count + 2 <= AABB_STACK_SIZE);
+		stack[count++] = node.child1;
+		stack[count++] = node.child2;
+	}
+}
+
+void AABBTree::queryFrustum(Camera* camera, std::vector<BaseEntity*>& results) const
+{
+	num_frustum_tests = 0;
+	if (root == AABB_NULL)
+		return;
+	int stack[AABB_STACK_SIZE];
+	int count = 0;
+	stack[count++] = root;
+	while (count)
+	{
+		int id = stack[--count];
+		const sAABBNode& node = nodes[id];
+		char clip = camera->testBoxInFrustum((node.min + node.max) * 0.5f, (node.max - node.min) * 0.5f);
+		num_frustum_tests++;
+		if (clip == CLIP_OUTSIDE)
+			continue;
+		if (clip == CLIP_INSIDE || node.child1 == AABB_NULL)
+		{
+			addSubtree(id, results);
+			continue;
+		}
+		assert(count + 2 <= AABB_STACK_SIZE);
+		stack[count++] = node.child1;
+		stack[count++] = node.child2;
+	}
+}
+
+BaseEntity* AABBTree::raycast(const Vector3& origin, const Vector3& dir, float max_dist, RayFunc func, void* data, float* distance) const
+{
+	if (root == AABB_NULL)
+		return NULL;
+
+	Vector3 inv_dir;
+	for (int i = 0; i < 3; ++i)
+		inv_dir.v[i] = fabs(dir.v[i]) > 1e-12f ? 1.0f / dir.v[i] : 1e30f;
+
+	BaseEntity* hit = NULL;
+	float nearest = max_dist;
+	int stack[AABB_STACK_SIZE];
+	int count = 0;
+	stack[count++] = root;
+	while (count)
+	{
+		const sAABBNode& node = nodes[stack[--count]];
+
+		//slabs, the node is skipped if the ray enters it further than the nearest hit
+		float t_min = 0.0f, t_max = nearest;
+		for (int i = 0; i < 3 && t_min <= t_max; ++i)
+		{
+			float t1 = (node.min.v[i] - origin.v[i]) * inv_dir.v[i];
+			float t2 = (node.max.v[i] - origin.v[i]) * inv_dir.v[i];
+			t_min = (float)fmax(t_min, fmin(t1, t2));
+			t_max = (float)fmin(t_max, fmax(t1, t2));
+		}
+		if (t_min > t_max)
+			continue;
+
+		if (node.child1 == AABB_NULL)
+		{
+			float t = func(node.entity, origin, dir, data);
+			if (t >= 0.0f && t < nearest)
+			{
+				nearest = t;
+				hit = node.entity;
+			}
+			continue;
+		}
+		assert(count + 2 <= AABB_STACK_SIZE);
+		stack[count++] = node.child1;
+		stack[count++] = node.child2;
+	}
+
+	if (hit && distance)
+		*distance = nearest;
+	return hit;
+}
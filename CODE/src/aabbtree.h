@@ -0,0 +1,67 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+#define AABB_NULL -1
+#define AABB_MARGIN_SCALE 0.1f	//the leaves are enlarged by this part of their size
+#define AABB_MARGIN 1.0f		//plus this, so small objects can move a bit too
+#define AABB_STACK_SIZE 256		//traversal stack, the tree is balanced so it never gets close
+
+class Camera;
+class BaseEntity;
+
+struct sAABBNode {
+	Vector3 min;
+	Vector3 max;
+	BaseEntity* entity;	//only the leaves
+	int parent;			//next free node when the node is not used
+	int child1;
+	int child2;			//AABB_NULL in the leaves
+	int height;			//0 in the leaves, -1 when free
+};
+
+// Dynamic bounding volume hierarchy, the same idea as the tree of Box2D.
+// Every leaf keeps the box of one entity enlarged with a margin, so while the entity moves inside it
+// nothing changes; when it leaves it is taken out and inserted again, the insertion goes down the side
+// that grows the surface less and the tree is rebalanced with rotations on the way up.
+// The nodes live in a vector and are reused from a free list, the ids of the leaves are the proxies.
+class AABBTree
+{
+public:
+	std::vector<sAABBNode> nodes;
+	int root;
+	int num_leaves;
+	mutable int num_frustum_tests; //nodes tested by the last queryFrustum, for stats
+
+	//leaf callback of the raycast, distance along the ray of the nearest hit or < 0 if it misses
+	typedef float (*RayFunc)(BaseEntity* entity, const Vector3& origin, const Vector3& dir, void* data);
+
+	AABBTree();
+
+	int insert(const BoundingBox& box, BaseEntity* entity);
+	void remove(int proxy);
+	//true if the leaf had to be moved, false if the box is still inside the enlarged one
+	bool update(int proxy, const BoundingBox& box);
+	void clear();
+
+	//all these add the entities of the leaves that touch the volume, the results are not cleared
+	void queryBox(const BoundingBox& box, std::vector<BaseEntity*>& results) const;
+	void querySphere(const Vector3& center, float radius, std::vector<BaseEntity*>& results) const;
+	void queryFrustum(Camera* camera, std::vector<BaseEntity*>& results) const; //whole subtrees inside are added without tests
+	//nearest entity hit by the ray before max_dist, the callback tests the entities of the leaves the ray touches
+	BaseEntity* raycast(const Vector3& origin, const Vector3& dir, float max_dist, RayFunc func, void* data, float* distance = NULL) const;
+
+	int getHeight() const { return root == AABB_NULL ? 0 : nodes[root].height; }
+
+private:
+	int free_list;
+
+	int allocateNode();
+	void freeNode(int id);
+	void insertLeaf(int leaf);
+	void removeLeaf(int leaf);
+	int balance(int id);
+	void fixUpwards(int id);
+	void addSubtree(int id, std::vector<BaseEntity*>& results) const;
+};
@@ -5,6 +5,8 @@
  
 #include "fbo.h"
 #include "shader.h"
+#include "glstate.h"
+#include "geometrypool.h"
 #include "input.h"
 #include "includes.h"
 #include "prefab.h"
@@ -14,6 +16,7 @@
 #include "BaseEntity.h"
 #include "Light.h"
 #include "Scene.h"
+#include "arena.h"
 
 #include <time.h> 
 
@@ -29,6 +32,7 @@ Mesh floor_plane;
 GTR::Material floor_material;
 
 PrefabEntity* prefab = nullptr;
+BaseEntity* selected_entity = nullptr; //picked with the mouse, edited with the gizmo
 Light* white_light = nullptr, * red_light = nullptr, * blue_light = nullptr, *green_light = nullptr;
 
 GTR::Renderer* renderer = nullptr;
@@ -57,10 +61,17 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	t = 0.0f;
 	elapsed_time = 0.0f;
 	mouse_locked = false;
+
+	#ifdef _DEBUG
+	testSimdMath(); //the SIMD math against the scalar code
+	OcclusionCuller::test();
+	#endif
+
 	//loads and compiles several shaders from one single file
     //change to "data/shader_atlas_osx.txt" if you are in XCODE
 	if(!Shader::LoadAtlas("data/shader_atlas.txt"))
         exit(1);
+	Shader::WarmUp(); //all the variants now, better a slower start than hitches later
     checkGLErrors();
 
 	// Create camera
@@ -78,11 +89,14 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	model.setTranslation(0, 20, 0);
 	//model.rotate(45*DEG2RAD, Vector3(0,1,0));
 	model.scale(100, 100, 100);
-	Scene::getInstance()->addEntity(new PrefabEntity(prefab_house, model));
+	PrefabEntity* house = new PrefabEntity(prefab_house, model);
+	house->is_static = true;
+	Scene::getInstance()->addEntity(house);
 
 	GTR::Prefab* prefab_car = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
 	GTR::Node* aa = prefab_car->root.children.at(2);
 	prefab_car->root.children.pop_back(); //delete floor plane
+	prefab_car->flatten(); //the tree changed
 	Matrix44 model1;
 	model1.setTranslation(450, 0, -50);
 	model1.rotate(45*DEG2RAD, Vector3(0,1,0));
@@ -139,16 +153,19 @@ void Application::render(void)
 {
 	//be sure no errors present in opengl before start
 	checkGLErrors();
+	GLState::beginFrame();
+	GeometryPool::update();
+	Scene::getInstance()->updateTrees();
 	
     
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
 	//set default flags
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
     
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 	if(render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
@@ -167,28 +184,14 @@ void Application::render(void)
 	}
 
     //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDisable(GL_DEPTH_TEST);
+    GLState::disable(GL_DEPTH_TEST);
     //render anything in the gui after this
 	#ifndef _DEBUG
 	if (rendertype == FORWARD) {
-		if (Scene::getInstance()->lights.size() != 0) {
-			for (int i = 0; i < Scene::getInstance()->lights.size(); i++) {
-				Light* l = Scene::getInstance()->lights[i];
-				glViewport((i * 250) + (i * 10), 0, 250, 250);
-				FBO* fbo;
-				fbo = l->shadow_fbo;
-				if (Scene::getInstance()->lights[i]->getType() == DIRECTIONAL) {
-					fbo->depth_texture->toViewport();
-				}
-				else if (Scene::getInstance()->lights[i]->getType() == SPOT) {
-					Shader* s = Shader::Get("depth");
-					s->setUniform("u_camera_nearfar", Vector2(l->cnear, l->cfar));
-					s->setUniform("u_alpha_cutoff", 0.0f);
-					s->setUniform("u_color", Vector4(1.0, 1.0, 1.0, 1.0));
-					fbo->depth_texture->toViewport(s);
-				}
-			}
-
+		//all the shadowmaps are in the atlas
+		if (renderer->shadow_atlas.fbo) {
+			glViewport(0, 0, 500, 500);
+			renderer->shadow_atlas.fbo->depth_texture->toViewport();
 		}
 	}
 	else {
@@ -196,15 +199,15 @@ void Application::render(void)
 
 		if (show_fbo) {
 			Light* light = Scene::getInstance()->lights[0];
-			if (light->shadow_fbo) {
-				glDisable(GL_DEPTH_TEST);
+			if (light->shadow_tile_size) {
+				GLState::disable(GL_DEPTH_TEST);
 				glViewport(0, 0, 250, 250);
 				Shader* sh = Shader::Get("depth");
 				sh->enable();
 				sh->setUniform("u_camera_nearfar", Vector2(light->cnear, light->cfar));
 				sh->setUniform("u_alpha_cutoff", 0.0f);
 				sh->setUniform("u_color", Vector4(1.0, 1.0, 1.0, 1.0));
-				light->shadow_fbo->depth_texture->toViewport(sh);
+				renderer->shadow_atlas.fbo->depth_texture->toViewport(sh);
 				sh->disable();
 			}
 			if (renderer->irr_fbo) {
@@ -228,9 +231,15 @@ void Application::render(void)
 			}
 		}
 	}
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_DEPTH_TEST);
 	
 	#endif
+
+	//movement has been consumed by all the passes of this frame
+	Scene::getInstance()->resetMovedFlags();
+
+	//release the per frame scratch memory
+	FrameArena::endFrame();
 }
 
 void Application::update(double seconds_elapsed)
@@ -290,8 +299,9 @@ void Application::renderDebugGizmo()
 	if (!prefab)
 		return;
 
-	//example of matrix we want to edit, change this to the matrix of your entity
-	Matrix44& matrix = Scene::getInstance()->entities[0]->model;
+	//the picked entity, or the first one
+	BaseEntity* entity = selected_entity ? selected_entity : Scene::getInstance()->entities[0];
+	Matrix44& matrix = entity->model;
 
 	#ifndef SKIP_IMGUI
 
@@ -350,6 +360,8 @@ void Application::renderDebugGizmo()
 	ImGuiIO& io = ImGui::GetIO();
 	ImGuizmo::SetRect(0, 0, io.DisplaySize.x, io.DisplaySize.y);
 	ImGuizmo::Manipulate(camera->view_matrix.m, camera->projection_matrix.m, mCurrentGizmoOperation, mCurrentGizmoMode, matrix.m, NULL, useSnap ? &snap.x : NULL);
+	if (ImGuizmo::IsUsing())
+		entity->hasMoved = true;
 	#endif
 }
 
@@ -362,6 +374,11 @@ void Application::renderDebugGUI(void)
 	//System stats
 	
 	ImGui::Text(getGPUStats().c_str());					   // Display some text (you can use a format strings too)
+#ifdef TRACK_ALLOCATIONS
+	ImGui::Text("Heap allocs last frame: %d  Frame arena: %d/%d KB", (int)FrameArena::allocs_last_frame, (int)(FrameArena::frame->last_used / 1024), (int)(FrameArena::frame->capacity / 1024));
+#else
+	ImGui::Text("Heap allocs last frame: n/a  Frame arena: %d/%d KB", (int)(FrameArena::frame->last_used / 1024), (int)(FrameArena::frame->capacity / 1024));
+#endif
 	ImGui::ColorEdit4("BG color", Scene::getInstance()->background.v);
 
 	if (ImGui::TreeNode("Render options")) {
@@ -381,7 +398,8 @@ void Application::renderDebugGUI(void)
 
 	// RENDER PREFABS AND ENTITIES INFO
 	if (ImGui::TreeNode("Entities")) {
-		
+		if (selected_entity)
+			ImGui::Text("Selected: %d (click to pick)", selected_entity->id);
 		for (std::vector<BaseEntity*>::iterator it = Scene::getInstance()->entities.begin(); it < Scene::getInstance()->entities.end(); it++) {
 			if ((*it)->type == PREFAB)
 				((PrefabEntity*)(*it))->renderinMenu();
@@ -460,6 +478,18 @@ void Application::onMouseButtonDown( SDL_MouseButtonEvent event )
 		mouse_locked = !mouse_locked;
 		SDL_ShowCursor(!mouse_locked);
 	}
+	else if (event.button == SDL_BUTTON_LEFT && !mouse_locked)
+	{
+		#ifndef SKIP_IMGUI
+		if (ImGui::IsAnyWindowHovered() || ImGuizmo::IsOver())
+			return;
+		#endif
+		//the ray goes through the tree of the scene, clicking on nothing keeps the selection
+		Vector3 dir = camera->getRayDirection(event.x, event.y, (float)window_width, (float)window_height);
+		BaseEntity* picked = Scene::getInstance()->pick(camera->eye, dir);
+		if (picked)
+			selected_entity = picked;
+	}
 }
 
 void Application::onMouseButtonUp(SDL_MouseButtonEvent event)
@@ -0,0 +1,112 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <new>
+#include <atomic>
+
+FrameArena* FrameArena::frame = new FrameArena(4 * 1024 * 1024);
+size_t FrameArena::allocs_last_frame = 0;
+
+static std::atomic<size_t> s_num_allocations(0);
+static size_t s_allocations_at_frame_start = 0;
+
+FrameArena::FrameArena(size_t capacity)
+{
+	this->capacity = capacity;
+	data = (char*)malloc(capacity);
+	used = 0;
+	peak = 0;
+	last_used = 0;
+	frame_id = 0;
+}
+
+FrameArena::~FrameArena()
+{
+	reset();
+	free(data);
+}
+
+void* FrameArena::alloc(size_t size, size_t align)
+{
+	size_t start = (used + align - 1) & ~(align - 1);
+	if (start + size > peak)
+		peak = start + size;
+
+	//full, use the heap until the next reset
+	if (start + size > capacity)
+	{
+		void* ptr = malloc(size);
+		overflow.push_back(ptr);
+		used = start + size;
+		return ptr;
+	}
+
+	used = start + size;
+	return data + start;
+}
+
+void FrameArena::reset()
+{
+	for (int i = 0; i < (int)overflow.size(); ++i)
+		free(overflow[i]);
+	overflow.clear();
+
+	//grow to fit the biggest frame so the heap is not used again
+	if (peak > capacity)
+	{
+		free(data);
+		capacity = peak + peak / 2;
+		data = (char*)malloc(capacity);
+	}
+
+	last_used = used;
+	used = 0;
+	peak = 0;
+	frame_id++;
+}
+
+size_t FrameArena::getNumAllocations()
+{
+	return s_num_allocations;
+}
+
+void FrameArena::endFrame()
+{
+	size_t num = s_num_allocations;
+	allocs_last_frame = num - s_allocations_at_frame_start;
+	s_allocations_at_frame_start = num;
+	frame->reset();
+}
+
+#ifdef TRACK_ALLOCATIONS
+
+//replace the global allocation functions to count them
+void* operator new(size_t size)
+{
+	s_num_allocations++;
+	void* ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size)
+{
+	s_num_allocations++;
+	void* ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	free(ptr);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+//counts every call to the global operator new, used to find heap allocations inside the frame.
+//only in debug builds, define it in the project settings to count them in release too
+#if defined(_DEBUG) && !defined(TRACK_ALLOCATIONS)
+	#define TRACK_ALLOCATIONS
+#endif
+
+// Linear allocator for the scratch data of one frame (visible lists, sort buffers, ...).
+// Allocating is just moving a pointer and everything is released at once with reset().
+// Nothing allocated here gets its destructor called, use it only for plain data.
+// If the block runs out it falls back to the heap, and the next reset grows the block to the peak
+// so in steady state there are no heap allocations.
+class FrameArena
+{
+public:
+	static FrameArena* frame; //the arena reset at the end of every frame
+
+	char* data;
+	size_t capacity;
+	size_t used;
+	size_t peak;			//max bytes requested in one frame
+	size_t last_used;		//bytes used in the previous frame, for stats
+	unsigned int frame_id;	//increased on every reset, to know if a block is still valid
+	std::vector<void*> overflow; //heap blocks used when the arena was full
+
+	FrameArena(size_t capacity);
+	~FrameArena();
+
+	void* alloc(size_t size, size_t align = 16);
+	void reset();
+
+	template<typename T> T* allocArray(size_t num) { return (T*)alloc(sizeof(T) * num, alignof(T) > 16 ? alignof(T) : 16); }
+
+	//allocations counter
+	static size_t getNumAllocations();	//total calls to operator new since the app started, 0 without TRACK_ALLOCATIONS
+	static size_t allocs_last_frame;	//calls to operator new during the last frame
+	static void endFrame();				//computes allocs_last_frame and resets the frame arena
+};
@@ -384,6 +384,6 @@ char Camera::testBoxInFrustum(const Vector3& center, const Vector3& halfsize)
 	if (flag == CLIP_OUTSIDE)
 		return CLIP_OUTSIDE;
 	o += flag;
-	return o == 0 ? CLIP_INSIDE : CLIP_OVERLAP;
+	return o == 6 * CLIP_INSIDE ? CLIP_INSIDE : CLIP_OVERLAP; //inside only if it is inside all the planes
 }
 
@@ -0,0 +1,214 @@
+#include "clusters.h"
+
+#include "camera.h"
+#include "shader.h"
+#include "texture.h"
+#include "arena.h"
+#include "glstate.h"
+
+using namespace GTR;
+
+static_assert(sizeof(sLightData) == 9 * sizeof(Vector4), "the lights texture expects 9 texels per light");
+
+LightClusters::LightClusters()
+{
+	lights_texture = NULL;
+	clusters_texture = NULL;
+	indices_texture = NULL;
+	near_plane = 1.0f;
+	far_plane = 1000.0f;
+	max_distance = 5000.0f;
+	num_lights = 0;
+	num_indices = 0;
+	max_per_cluster = 0;
+	overflows = 0;
+}
+
+LightClusters::~LightClusters()
+{
+	delete lights_texture;
+	delete clusters_texture;
+	delete indices_texture;
+}
+
+//integer and data textures cannot be filtered
+static void setNearest(Texture* texture)
+{
+	texture->bind();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	GLState::bindTexture(GL_TEXTURE_2D, 0);
+}
+
+void LightClusters::createTextures()
+{
+	lights_texture = new Texture(9, MAX_CLUSTERED_LIGHTS, GL_RGBA, GL_FLOAT, false, NULL, GL_RGBA32F);
+	clusters_texture = new Texture(CLUSTERS_X * CLUSTERS_Y, CLUSTERS_Z, GL_RG_INTEGER, GL_INT, false, NULL, GL_RG32I);
+	indices_texture = new Texture(CLUSTER_INDICES_WIDTH, CLUSTER_INDICES_HEIGHT, GL_RED_INTEGER, GL_INT, false, NULL, GL_R32I);
+	setNearest(lights_texture);
+	setNearest(clusters_texture);
+	setNearest(indices_texture);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+//exponential slices, the same formula is used in the shader
+int LightClusters::getSlice(float depth)
+{
+	if (depth <= near_plane)
+		return 0;
+	int slice = (int)(log(depth / near_plane) / log(far_plane / near_plane) * CLUSTERS_Z);
+	return slice < CLUSTERS_Z ? slice : CLUSTERS_Z - 1;
+}
+
+void LightClusters::build(const sLightData* lights, int num, Camera* camera)
+{
+	if (!lights_texture)
+		createTextures();
+
+	if (num > MAX_CLUSTERED_LIGHTS)
+	{
+		std::cout << "Too many clustered lights: " << num << ", only " << MAX_CLUSTERED_LIGHTS << " are used" << std::endl;
+		num = MAX_CLUSTERED_LIGHTS;
+	}
+
+	near_plane = camera->near_plane;
+	far_plane = (float)fmin(camera->far_plane, max_distance);
+	camera_front = (camera->center - camera->eye).normalize();
+
+	const int num_clusters = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+	int* counts = FrameArena::frame->allocArray<int>(num_clusters * 2); //count and offset
+	int* ranges = FrameArena::frame->allocArray<int>(num * 6); //min and max cluster of every light in xyz
+	memset(counts, 0, sizeof(int) * num_clusters * 2);
+
+	//first pass, the cluster range of every light and how many lights end in every cluster
+	for (int i = 0; i < num; ++i)
+	{
+		const sLightData& light = lights[i];
+		int* r = ranges + i * 6;
+		r[0] = r[1] = r[2] = 0;
+		r[3] = r[4] = r[5] = -1; //empty
+
+		Vector3 pos(light.position_type.x, light.position_type.y, light.position_type.z);
+		float radius = light.direction_maxdist.w;
+		float depth = (pos - camera->eye).dot(camera_front);
+		if (depth + radius < near_plane || depth - radius > far_plane)
+			continue;
+		r[2] = getSlice(depth - radius);
+		r[5] = getSlice(depth + radius);
+
+		//screen rect of the box around the sphere, the whole screen if it crosses the camera plane
+		r[0] = 0; r[1] = 0;
+		r[3] = CLUSTERS_X - 1; r[4] = CLUSTERS_Y - 1;
+		if (depth - radius > 0.0f)
+		{
+			float min_x = 1.0f, min_y = 1.0f, max_x = -1.0f, max_y = -1.0f;
+			for (int j = 0; j < 8; ++j)
+			{
+				Vector3 corner = pos + Vector3(j & 1 ? radius : -radius, j & 2 ? radius : -radius, j & 4 ? radius : -radius);
+				Vector4 clip = camera->viewprojection_matrix * Vector4(corner, 1.0f);
+				if (clip.w <= 0.0f)
+				{
+					min_x = min_y = -1.0f;
+					max_x = max_y = 1.0f;
+					break;
+				}
+				float x = clip.x / clip.w;
+				float y = clip.y / clip.w;
+				min_x = (float)fmin(min_x, x); max_x = (float)fmax(max_x, x);
+				min_y = (float)fmin(min_y, y); max_y = (float)fmax(max_y, y);
+			}
+			if (max_x < -1.0f || min_x > 1.0f || max_y < -1.0f || min_y > 1.0f)
+			{
+				r[3] = -1; //out of the screen
+				continue;
+			}
+			r[0] = (int)clamp((min_x * 0.5f + 0.5f) * CLUSTERS_X, 0.0f, CLUSTERS_X - 1.0f);
+			r[1] = (int)clamp((min_y * 0.5f + 0.5f) * CLUSTERS_Y, 0.0f, CLUSTERS_Y - 1.0f);
+			r[3] = (int)clamp((max_x * 0.5f + 0.5f) * CLUSTERS_X, 0.0f, CLUSTERS_X - 1.0f);
+			r[4] = (int)clamp((max_y * 0.5f + 0.5f) * CLUSTERS_Y, 0.0f, CLUSTERS_Y - 1.0f);
+		}
+
+		for (int z = r[2]; z <= r[5]; ++z)
+			for (int y = r[1]; y <= r[4]; ++y)
+				for (int x = r[0]; x <= r[3]; ++x)
+					counts[(z * CLUSTERS_Y + y) * CLUSTERS_X + x]++;
+	}
+
+	//prefix sum, every cluster gets its offset in the indices
+	const int max_indices = CLUSTER_INDICES_WIDTH * CLUSTER_INDICES_HEIGHT;
+	int* offsets = counts + num_clusters;
+	int total = 0;
+	max_per_cluster = 0;
+	overflows = 0;
+	for (int i = 0; i < num_clusters; ++i)
+	{
+		if (total + counts[i] > max_indices)
+		{
+			overflows += counts[i] - (max_indices - total);
+			counts[i] = max_indices - total;
+		}
+		offsets[i] = total;
+		total += counts[i];
+		if (counts[i] > max_per_cluster)
+			max_per_cluster = counts[i];
+	}
+
+	//second pass, fill the indices using the offsets as cursors
+	int* indices = FrameArena::frame->allocArray<int>(total ? total : 1);
+	int* cursors = FrameArena::frame->allocArray<int>(num_clusters);
+	memcpy(cursors, offsets, sizeof(int) * num_clusters);
+	for (int i = 0; i < num; ++i)
+	{
+		const int* r = ranges + i * 6;
+		for (int z = r[2]; z <= r[5]; ++z)
+			for (int y = r[1]; y <= r[4]; ++y)
+				for (int x = r[0]; x <= r[3]; ++x)
+				{
+					int cluster = (z * CLUSTERS_Y + y) * CLUSTERS_X + x;
+					if (cursors[cluster] < offsets[cluster] + counts[cluster])
+						indices[cursors[cluster]++] = i;
+				}
+	}
+
+	//offset and count interleaved, as the RG texture expects
+	int* cluster_data = FrameArena::frame->allocArray<int>(num_clusters * 2);
+	for (int i = 0; i < num_clusters; ++i)
+	{
+		cluster_data[i * 2] = offsets[i];
+		cluster_data[i * 2 + 1] = counts[i];
+	}
+
+	num_lights = num;
+	num_indices = total;
+
+	//upload only the rows used
+	if (num)
+	{
+		lights_texture->bind();
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 9, num, GL_RGBA, GL_FLOAT, lights);
+	}
+	clusters_texture->bind();
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTERS_X * CLUSTERS_Y, CLUSTERS_Z, GL_RG_INTEGER, GL_INT, cluster_data);
+	if (total)
+	{
+		indices_texture->bind();
+		int rows = (total + CLUSTER_INDICES_WIDTH - 1) / CLUSTER_INDICES_WIDTH;
+		int full_rows = total / CLUSTER_INDICES_WIDTH;
+		if (full_rows)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_INDICES_WIDTH, full_rows, GL_RED_INTEGER, GL_INT, indices);
+		if (rows > full_rows) //last row partially filled
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, full_rows, total % CLUSTER_INDICES_WIDTH, 1, GL_RED_INTEGER, GL_INT, indices + full_rows * CLUSTER_INDICES_WIDTH);
+	}
+	GLState::bindTexture(GL_TEXTURE_2D, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void LightClusters::setUniforms(Shader* shader, int first_slot)
+{
+	shader->setUniform("u_cluster_lights", lights_texture, first_slot);
+	shader->setUniform("u_cluster_grid", clusters_texture, first_slot + 1);
+	shader->setUniform("u_cluster_indices", indices_texture, first_slot + 2);
+	shader->setUniform("u_cluster_near", near_plane);
+	shader->setUniform("u_cluster_far", far_plane);
+	shader->setUniform("u_camera_front", camera_front);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "framework.h"
+#include "Light.h"
+
+//forward declarations
+class Camera;
+class Shader;
+class Texture;
+
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+#define MAX_CLUSTERED_LIGHTS 1024
+#define CLUSTER_INDICES_WIDTH 4096
+#define CLUSTER_INDICES_HEIGHT 32	//up to 128k light references per frame
+
+namespace GTR {
+
+	// Light lists of the view frustum split in cells (froxels), so one fullscreen pass
+	// can shade any number of local lights reading only the ones that touch every pixel.
+	// The screen is split in CLUSTERS_X x CLUSTERS_Y tiles and the depth in CLUSTERS_Z
+	// exponential slices. The binning is done in the CPU every frame and uploaded in three textures:
+	// the light data (one row of 9 texels per light), the offset and count of every cluster,
+	// and the indices of the lights of all the clusters one after another.
+	class LightClusters
+	{
+	public:
+		Texture* lights_texture;	//RGBA32F, sLightData rows, the matrix stored by columns
+		Texture* clusters_texture;	//RG32I, CLUSTERS_X*CLUSTERS_Y wide and CLUSTERS_Z high, offset and count
+		Texture* indices_texture;	//R32I, light indices of every cluster
+
+		float near_plane;	//depth range split in slices, taken from the camera
+		float far_plane;
+		float max_distance;	//the slices stop here even if the camera sees further
+		Vector3 camera_front;	//the depth of the slices is measured along it
+
+		//stats of the last build
+		int num_lights;
+		int num_indices;
+		int max_per_cluster;
+		int overflows;	//references lost because the indices texture was full
+
+		LightClusters();
+		~LightClusters();
+
+		//bins the lights in the clusters of the camera and uploads everything
+		void build(const sLightData* lights, int num, Camera* camera);
+		void setUniforms(Shader* shader, int first_slot); //uses three texture slots
+
+		int getSlice(float depth);
+
+	private:
+		void createTextures();
+	};
+
+};
@@ -0,0 +1,246 @@
+#include "culling.h"
+
+#include "camera.h"
+
+#ifdef CULLING_SIMD
+	#include <xmmintrin.h>
+	#ifdef __AVX__
+		#include <immintrin.h>
+	#endif
+#endif
+#include <cassert>
+#include <cstdlib>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <cmath>
+#include <vector>
+
+#ifdef CULLING_SIMD
+	static const int bits_set[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+	#define alignedAlloc(size) _mm_malloc(size, 32)
+	#define alignedFree(ptr) _mm_free(ptr)
+#else
+	#define alignedAlloc(size) malloc(size) //the scalar path needs no alignment
+	#define alignedFree(ptr) free(ptr)
+#endif
+
+static float elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+CullingBoxes::CullingBoxes()
+{
+	center_x = center_y = center_z = NULL;
+	halfsize_x = halfsize_y = halfsize_z = NULL;
+	num = capacity = 0;
+}
+
+CullingBoxes::~CullingBoxes()
+{
+	if (center_x)
+		alignedFree(center_x);
+}
+
+//one block for the six arrays, the padding is zeroed so the boxes after the last one are valid floats
+void CullingBoxes::reserve(int max)
+{
+	if (max <= capacity)
+		return;
+	int new_capacity = (max + CULLING_WIDTH - 1) / CULLING_WIDTH * CULLING_WIDTH;
+	if (new_capacity < capacity * 2)
+		new_capacity = capacity * 2;
+	float* data = (float*)alignedAlloc(new_capacity * 6 * sizeof(float));
+	memset(data, 0, new_capacity * 6 * sizeof(float));
+	float* old[6] = { center_x, center_y, center_z, halfsize_x, halfsize_y, halfsize_z };
+	float** arrays[6] = { &center_x, &center_y, &center_z, &halfsize_x, &halfsize_y, &halfsize_z };
+	for (int i = 0; i < 6; ++i)
+	{
+		*arrays[i] = data + i * new_capacity;
+		if (num)
+			memcpy(*arrays[i], old[i], num * sizeof(float));
+	}
+	if (old[0])
+		alignedFree(old[0]);
+	capacity = new_capacity;
+}
+
+void CullingBoxes::add(const BoundingBox& box)
+{
+	if (num == capacity)
+		reserve(num + 1);
+	center_x[num] = box.center.x;
+	center_y[num] = box.center.y;
+	center_z[num] = box.center.z;
+	halfsize_x[num] = box.halfsize.x;
+	halfsize_y[num] = box.halfsize.y;
+	halfsize_z[num] = box.halfsize.z;
+	num++;
+}
+
+int CullingBoxes::cull(Camera* camera, uint32_t* mask) const
+{
+	return cull(camera->frustum, mask);
+}
+
+//same operations in the same order as planeBoxOverlap, so both paths agree on the boxes that touch a plane
+int CullingBoxes::cullScalar(const float planes[6][4], uint32_t* mask) const
+{
+	memset(mask, 0, getMaskWords(num) * sizeof(uint32_t));
+	int visible = 0;
+	for (int i = 0; i < num; ++i)
+	{
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; ++p)
+		{
+			const float* plane = planes[p];
+			float radius = fabs(halfsize_x[i] * plane[0]) + fabs(halfsize_y[i] * plane[1]) + fabs(halfsize_z[i] * plane[2]);
+			float distance = plane[0] * center_x[i] + plane[1] * center_y[i] + plane[2] * center_z[i] + plane[3];
+			inside = distance > -radius;
+		}
+		if (!inside)
+			continue;
+		mask[i >> 5] |= 1u << (i & 31);
+		visible++;
+	}
+	return visible;
+}
+
+int CullingBoxes::cull(const float planes[6][4], uint32_t* mask) const
+{
+#ifndef CULLING_SIMD
+	return cullScalar(planes, mask);
+#else
+	memset(mask, 0, getMaskWords(num) * sizeof(uint32_t));
+	int visible = 0;
+
+#ifdef __AVX__
+	__m256 nx[6], ny[6], nz[6], nd[6], ax[6], ay[6], az[6];
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	for (int p = 0; p < 6; ++p)
+	{
+		nx[p] = _mm256_set1_ps(planes[p][0]);
+		ny[p] = _mm256_set1_ps(planes[p][1]);
+		nz[p] = _mm256_set1_ps(planes[p][2]);
+		nd[p] = _mm256_set1_ps(planes[p][3]);
+		ax[p] = _mm256_andnot_ps(sign, nx[p]);
+		ay[p] = _mm256_andnot_ps(sign, ny[p]);
+		az[p] = _mm256_andnot_ps(sign, nz[p]);
+	}
+	for (int i = 0; i < num; i += 8)
+	{
+		__m256 cx = _mm256_load_ps(center_x + i);
+		__m256 cy = _mm256_load_ps(center_y + i);
+		__m256 cz = _mm256_load_ps(center_z + i);
+		__m256 hx = _mm256_load_ps(halfsize_x + i);
+		__m256 hy = _mm256_load_ps(halfsize_y + i);
+		__m256 hz = _mm256_load_ps(halfsize_z + i);
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p)
+		{
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(hx, ax[p]), _mm256_mul_ps(hy, ay[p])), _mm256_mul_ps(hz, az[p]));
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx[p], cx), _mm256_mul_ps(ny[p], cy)), _mm256_mul_ps(nz[p], cz)), nd[p]);
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_xor_ps(radius, sign), _CMP_GT_OQ));
+		}
+		unsigned int bits = (unsigned int)_mm256_movemask_ps(inside);
+		if (num - i < 8)
+			bits &= (1u << (num - i)) - 1;
+		mask[i >> 5] |= bits << (i & 31);
+		visible += bits_set[bits & 15] + bits_set[bits >> 4];
+	}
+#else
+	__m128 nx[6], ny[6], nz[6], nd[6], ax[6], ay[6], az[6];
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	for (int p = 0; p < 6; ++p)
+	{
+		nx[p] = _mm_set1_ps(planes[p][0]);
+		ny[p] = _mm_set1_ps(planes[p][1]);
+		nz[p] = _mm_set1_ps(planes[p][2]);
+		nd[p] = _mm_set1_ps(planes[p][3]);
+		ax[p] = _mm_andnot_ps(sign, nx[p]);
+		ay[p] = _mm_andnot_ps(sign, ny[p]);
+		az[p] = _mm_andnot_ps(sign, nz[p]);
+	}
+	for (int i = 0; i < num; i += 4)
+	{
+		__m128 cx = _mm_load_ps(center_x + i);
+		__m128 cy = _mm_load_ps(center_y + i);
+		__m128 cz = _mm_load_ps(center_z + i);
+		__m128 hx = _mm_load_ps(halfsize_x + i);
+		__m128 hy = _mm_load_ps(halfsize_y + i);
+		__m128 hz = _mm_load_ps(halfsize_z + i);
+		__m128 inside = _mm_cmpeq_ps(cx, cx); //all ones, the padding always holds valid floats
+		for (int p = 0; p < 6; ++p)
+		{
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(hx, ax[p]), _mm_mul_ps(hy, ay[p])), _mm_mul_ps(hz, az[p]));
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], cx), _mm_mul_ps(ny[p], cy)), _mm_mul_ps(nz[p], cz)), nd[p]);
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, _mm_xor_ps(radius, sign)));
+		}
+		unsigned int bits = (unsigned int)_mm_movemask_ps(inside);
+		if (num - i < 4)
+			bits &= (1u << (num - i)) - 1;
+		mask[i >> 5] |= bits << (i & 31);
+		visible += bits_set[bits];
+	}
+#endif
+	return visible;
+#endif
+}
+
+//boxes spread around the camera so roughly a quarter is visible, like a big open scene
+void CullingBoxes::benchmark(int num_boxes)
+{
+	Camera camera;
+	camera.lookAt(Vector3(0, 100, 0), Vector3(100, 100, 100), Vector3(0, 1, 0));
+	camera.setPerspective(70.0f, 16.0f / 9.0f, 1.0f, 5000.0f);
+
+	CullingBoxes boxes;
+	boxes.reserve(num_boxes);
+	std::vector<BoundingBox> list(num_boxes);
+	for (int i = 0; i < num_boxes; ++i)
+	{
+		list[i] = BoundingBox(Vector3(random(8000.0f, -4000), random(400.0f, -100), random(8000.0f, -4000)), Vector3(random(50.0f, 1), random(50.0f, 1), random(50.0f, 1)));
+		boxes.add(list[i]);
+	}
+
+	std::vector<uint32_t> mask(getMaskWords(num_boxes)), scalar_mask(getMaskWords(num_boxes));
+	const int runs = 20;
+	int visible = 0, scalar_visible = 0, camera_visible = 0;
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < runs; ++r)
+		visible = boxes.cull(&camera, &mask[0]);
+	float batch_ms = elapsedMs(start) / runs;
+
+	start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < runs; ++r)
+		scalar_visible = boxes.cullScalar(camera.frustum, &scalar_mask[0]);
+	float scalar_ms = elapsedMs(start) / runs;
+
+	start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < runs; ++r)
+	{
+		camera_visible = 0;
+		for (int i = 0; i < num_boxes; ++i)
+			if (camera.testBoxInFrustum(list[i].center, list[i].halfsize) != CLIP_OUTSIDE)
+				camera_visible++;
+	}
+	float camera_ms = elapsedMs(start) / runs;
+
+	int mismatches = 0;
+	for (int i = 0; i < num_boxes; ++i)
+		if (isVisible(&mask[0], i) != isVisible(&scalar_mask[0], i))
+			mismatches++;
+
+#ifdef CULLING_SIMD
+	const char* mode = CULLING_WIDTH == 8 ? "AVX" : "SSE";
+#else
+	const char* mode = "no SIMD";
+#endif
+	std::cout << "Culling benchmark: " << num_boxes << " boxes, " << visible << " visible. "
+		<< mode << ": " << batch_ms << " ms, scalar SoA: " << scalar_ms << " ms, testBoxInFrustum: " << camera_ms << " ms";
+	if (mismatches || visible != scalar_visible || visible != camera_visible)
+		std::cout << " [ERROR] " << mismatches << " boxes differ (" << scalar_visible << " scalar, " << camera_visible << " camera)";
+	std::cout << std::endl;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "framework.h"
+#include <stdint.h>
+
+//SSE, or AVX when the build enables it. Without them cull() uses the scalar path
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define CULLING_SIMD
+#endif
+
+#if defined(CULLING_SIMD) && defined(__AVX__)
+	#define CULLING_WIDTH 8	//boxes per iteration
+#else
+	#define CULLING_WIDTH 4
+#endif
+
+class Camera;
+
+// Boxes in SoA layout for the batch frustum culling: all the center x together, then all the y...
+// Every iteration tests CULLING_WIDTH boxes against the six planes with SSE (AVX when the build
+// enables it) and writes one bit per box, set when the box touches the frustum. The test is the same
+// as Camera::testBoxInFrustum != CLIP_OUTSIDE, but without the early exit, which does not pay off
+// when the boxes go in groups. The arrays are aligned and padded so the last group needs no special case.
+// Targets without SSE use cullScalar, which gives the same results one box at a time.
+class CullingBoxes
+{
+public:
+	float* center_x, *center_y, *center_z;
+	float* halfsize_x, *halfsize_y, *halfsize_z;
+	int num;
+	int capacity;
+
+	CullingBoxes();
+	~CullingBoxes();
+
+	void clear() { num = 0; }
+	void reserve(int max); //keeps the boxes already added
+	void add(const BoundingBox& box);
+
+	//the mask needs getMaskWords(num) words, returns the number of visible boxes
+	int cull(const float planes[6][4], uint32_t* mask) const;
+	int cull(Camera* camera, uint32_t* mask) const;
+	int cullScalar(const float planes[6][4], uint32_t* mask) const; //reference, one box at a time
+
+	static int getMaskWords(int num) { return (num + 31) / 32; }
+	static bool isVisible(const uint32_t* mask, int i) { return (mask[i >> 5] >> (i & 31)) & 1; }
+
+	//random boxes around a camera, prints the cost of the batch, the scalar path and Camera::testBoxInFrustum. Needs no GL
+	static void benchmark(int num_boxes);
+};
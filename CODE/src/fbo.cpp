@@ -1,6 +1,7 @@
 #include "fbo.h"
 #include <cassert>
 #include "utils.h"
+#include "glstate.h"
 
 FBO::FBO()
 {
@@ -51,7 +52,7 @@ void FBO::freeTextures()
 	owns_textures = false;
 }
 
-bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture)
+bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture, bool use_stencil)
 {
 	assert(glGetError() == GL_NO_ERROR);
 	assert(width && height);
@@ -64,7 +65,7 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 	for (int i = 0; i < num_textures; ++i)
 	{
 		Texture* colortex = textures[i] = new Texture(width, height, format, type, false); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
-		glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
+		GLState::bindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -74,7 +75,9 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 	//is using a depth_texture slower than using a renderbuffer?
 	//https://stackoverflow.com/questions/45320836/why-is-depth-buffers-faster-than-depth-textures
 	Texture* depth_texture = NULL;
-	if(use_depth_texture)
+	if (use_depth_texture && use_stencil) //stencil packed with the depth, for the light volumes
+		depth_texture = new Texture(width, height, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, false, NULL, GL_DEPTH24_STENCIL8);
+	else if(use_depth_texture)
 		depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false);
 	owns_textures = true;
 	return setTextures(textures, depth_texture);
@@ -121,7 +124,8 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 
 	if (depth_texture)
 	{
-		glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, 0);
+		GLenum attachment = depth_texture->format == GL_DEPTH_STENCIL ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+		glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, attachment, GL_TEXTURE_2D, depth_texture->texture_id, 0);
 		this->depth_texture = depth_texture;
 	}
 	else
@@ -198,19 +202,21 @@ bool FBO::setDepthOnly(int width, int height)
 	memset(bufs, 0, sizeof(bufs));
 	num_color_textures = 0;
 
-	glGenFramebuffersEXT(1, &fbo_id);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
-
-	glGenRenderbuffersEXT(1, &renderbuffer_color);
-	glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, renderbuffer_color);
+	this->width = width;
+	this->height = height;
 
-	glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA, width, height);
-	glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER_EXT, renderbuffer_color);
+	if (fbo_id == 0)
+		glGenFramebuffersEXT(1, &fbo_id);
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
 
 	//create texture
 	depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false);
 	glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, 0);
 
+	//no color attachment, nothing is written or read from color
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+
 	GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
 	if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
 	{
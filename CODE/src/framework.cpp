@@ -4,6 +4,10 @@
 #include <cassert>
 #include <cmath> //for sqrt (square root) function
 #include <math.h> //atan2
+#include <iostream>
+#ifdef USE_SIMD_MATH
+	#include <xmmintrin.h>
+#endif
 
 
 #define M_PI_2 1.57079632679489661923
@@ -68,6 +72,18 @@ Vector2 operator - (const Vector2& a, const Vector2& b) { return Vector2(a.x - b
 
 // **************************************
 
+#ifdef USE_SIMD_MATH
+//the double result is kept for the callers, the math is in float
+double Vector3::length() 
+{
+	return sqrtf(x*x + y*y + z*z);
+}
+
+double Vector3::length() const
+{
+	return sqrtf(x*x + y*y + z*z);
+}
+#else
 double Vector3::length() 
 {
 	return sqrt(x*x + y*y + z*z);
@@ -77,6 +93,7 @@ double Vector3::length() const
 {
 	return sqrt(x*x + y*y + z*z);
 }
+#endif
 
 Vector3& Vector3::normalize()
 {
@@ -422,7 +439,7 @@ Vector3 Matrix44::project(const Vector3& v)
 
 
 //Multiply a matrix by another and returns the result
-Matrix44 Matrix44::operator*(const Matrix44& matrix) const
+Matrix44 multiplyMatricesScalar(const Matrix44& a, const Matrix44& b)
 {
 	Matrix44 ret;
 
@@ -433,7 +450,7 @@ Matrix44 Matrix44::operator*(const Matrix44& matrix) const
 		{
 			ret.M[i][j]=0.0;
 			for (k=0;k<4;k++) 
-				ret.M[i][j] += M[i][k] * matrix.M[k][j];
+				ret.M[i][j] += a.M[i][k] * b.M[k][j];
 		}
 	}
 
@@ -441,7 +458,7 @@ Matrix44 Matrix44::operator*(const Matrix44& matrix) const
 }
 
 //Multiplies a vector by a matrix and returns the new vector
-Vector3 operator * (const Matrix44& matrix, const Vector3& v) 
+Vector3 transformPointScalar(const Matrix44& matrix, const Vector3& v)
 {   
    float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + matrix.m[12]; 
    float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + matrix.m[13]; 
@@ -450,7 +467,7 @@ Vector3 operator * (const Matrix44& matrix, const Vector3& v)
 }
 
 //Multiplies a vector by a matrix and returns the new vector
-Vector4 operator * (const Matrix44& matrix, const Vector4& v)
+Vector4 transformVectorScalar(const Matrix44& matrix, const Vector4& v)
 {
 	float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + v.w * matrix.m[12];
 	float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + v.w * matrix.m[13];
@@ -459,6 +476,66 @@ Vector4 operator * (const Matrix44& matrix, const Vector4& v)
 	return Vector4(x, y, z, w);
 }
 
+#ifdef USE_SIMD_MATH
+//the rows are not aligned, the matrices live anywhere
+#define LOAD_ROWS(matrix) __m128 row0 = _mm_loadu_ps(matrix.m), row1 = _mm_loadu_ps(matrix.m + 4), row2 = _mm_loadu_ps(matrix.m + 8), row3 = _mm_loadu_ps(matrix.m + 12)
+
+//x * row0 + y * row1 + z * row2 + w * row3, the rows are in the order of the vector components
+static inline __m128 combineRows(float x, float y, float z, __m128 row0, __m128 row1, __m128 row2, __m128 last)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(x), row0), _mm_mul_ps(_mm_set1_ps(y), row1)), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(z), row2), last));
+}
+
+static inline __m128 cross(__m128 a, __m128 b)
+{
+	__m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+	return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+#endif
+
+//every row of the result is the rows of the second matrix combined with the row of the first one
+Matrix44 Matrix44::operator*(const Matrix44& matrix) const
+{
+#ifdef USE_SIMD_MATH
+	Matrix44 ret;
+	LOAD_ROWS(matrix);
+	for (int i = 0; i < 4; i++)
+	{
+		const float* a = m + i * 4;
+		_mm_storeu_ps(ret.m + i * 4, combineRows(a[0], a[1], a[2], row0, row1, row2, _mm_mul_ps(_mm_set1_ps(a[3]), row3)));
+	}
+	return ret;
+#else
+	return multiplyMatricesScalar(*this, matrix);
+#endif
+}
+
+Vector3 operator * (const Matrix44& matrix, const Vector3& v) 
+{
+#ifdef USE_SIMD_MATH
+	LOAD_ROWS(matrix);
+	float r[4];
+	_mm_storeu_ps(r, combineRows(v.x, v.y, v.z, row0, row1, row2, row3));
+	return Vector3(r[0], r[1], r[2]);
+#else
+	return transformPointScalar(matrix, v);
+#endif
+}
+
+Vector4 operator * (const Matrix44& matrix, const Vector4& v)
+{
+#ifdef USE_SIMD_MATH
+	LOAD_ROWS(matrix);
+	Vector4 ret;
+	_mm_storeu_ps(ret.v, combineRows(v.x, v.y, v.z, row0, row1, row2, _mm_mul_ps(_mm_set1_ps(v.w), row3)));
+	return ret;
+#else
+	return transformVectorScalar(matrix, v);
+#endif
+}
+
 void Matrix44::setUpAndOrthonormalize(Vector3 up)
 {
 	up.normalize();
@@ -533,6 +610,50 @@ void Matrix44::setFrontAndOrthonormalize(Vector3 front)
 }
 
 bool Matrix44::inverse()
+{
+#ifdef USE_SIMD_MATH
+	if (m[3] == 0.0f && m[7] == 0.0f && m[11] == 0.0f && m[15] == 1.0f)
+		return inverseAffine();
+#endif
+	return inverseGeneral();
+}
+
+#ifdef USE_SIMD_MATH
+//the 3x3 part is inverted with the cross products of its rows, the translation goes back through it
+bool Matrix44::inverseAffine()
+{
+	__m128 a = _mm_loadu_ps(m), b = _mm_loadu_ps(m + 4), c = _mm_loadu_ps(m + 8);
+	__m128 t = _mm_loadu_ps(m + 12);
+	//the w of the rows is 0, so it stays 0 in the cross products
+	__m128 bc = cross(b, c), ca = cross(c, a), ab = cross(a, b);
+
+	float d[4];
+	_mm_storeu_ps(d, _mm_mul_ps(a, bc));
+	float det = d[0] + d[1] + d[2];
+	if (fabsf(det) <= 1e-20f)
+		return false;
+
+	//the inverse has the cross products as columns
+	__m128 w = _mm_setzero_ps();
+	_MM_TRANSPOSE4_PS(bc, ca, ab, w);
+	__m128 inv_det = _mm_set1_ps(1.0f / det);
+	bc = _mm_mul_ps(bc, inv_det);
+	ca = _mm_mul_ps(ca, inv_det);
+	ab = _mm_mul_ps(ab, inv_det);
+
+	float tr[4];
+	_mm_storeu_ps(tr, t);
+	__m128 translation = _mm_sub_ps(_mm_setzero_ps(), combineRows(tr[0], tr[1], tr[2], bc, ca, ab, _mm_setzero_ps()));
+	_mm_storeu_ps(m, bc);
+	_mm_storeu_ps(m + 4, ca);
+	_mm_storeu_ps(m + 8, ab);
+	_mm_storeu_ps(m + 12, translation);
+	m[15] = 1.0f;
+	return true;
+}
+#endif
+
+bool Matrix44::inverseGeneral()
 {
    unsigned int i, j, k, swap;
    float t;
@@ -1258,7 +1379,22 @@ float signedDistanceToPlane( const Vector4& plane, const Vector3& point )
 
 const Vector3 corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,1},  {-1,1,-1},  {-1,-1,1},  {-1,-1,-1} };
 
+//Arvo: the center is transformed as a point and the halfsize with the absolute value of the matrix
 BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
+{
+#ifdef USE_SIMD_MATH
+	LOAD_ROWS(m);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	float c[4], h[4];
+	_mm_storeu_ps(c, combineRows(box.center.x, box.center.y, box.center.z, row0, row1, row2, row3));
+	_mm_storeu_ps(h, combineRows(box.halfsize.x, box.halfsize.y, box.halfsize.z, _mm_andnot_ps(sign, row0), _mm_andnot_ps(sign, row1), _mm_andnot_ps(sign, row2), _mm_setzero_ps()));
+	return BoundingBox(Vector3(c[0], c[1], c[2]), Vector3(h[0], h[1], h[2]));
+#else
+	return transformBoundingBoxScalar(m, box);
+#endif
+}
+
+BoundingBox transformBoundingBoxScalar(const Matrix44 m, const BoundingBox& box)
 {
 	Vector3 box_min(10000000.0f,1000000.0f, 1000000.0f);
 	Vector3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
@@ -1268,7 +1404,7 @@ BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 		Vector3 corner = corners[i];
 		corner = box.halfsize * corner;
 		corner = corner + box.center;
-		corner = m * corner;
+		corner = transformPointScalar(m, corner);
 		box_min.setMin(corner);
 		box_max.setMax(corner);
 	}
@@ -1277,6 +1413,86 @@ BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 	return BoundingBox(box_max - halfsize, halfsize );
 }
 
+static float maxAbs(const float* v, int num)
+{
+	float result = 1.0f;
+	for (int i = 0; i < num; ++i)
+		result = (float)fmax(result, fabs(v[i]));
+	return result;
+}
+
+//the error is relative to the size of the terms, a sum that cancels can lose all the digits of its result
+static bool nearlyEqual(const float* a, const float* b, int num, float tolerance, float scale)
+{
+	for (int i = 0; i < num; ++i)
+		if (fabs(a[i] - b[i]) > tolerance * scale)
+			return false;
+	return true;
+}
+
+//rotation, scale and translation, sometimes a random general matrix for the products
+static Matrix44 randomMatrix(bool affine)
+{
+	Matrix44 m;
+	if (!affine)
+	{
+		for (int i = 0; i < 16; ++i)
+			m.m[i] = random(20.0f, -10);
+		return m;
+	}
+	Vector3 axis(random(2.0f, -1), random(2.0f, -1), random(2.0f, -1) + 0.01f);
+	m.setRotation(random(6.28f), axis.normalize());
+	Matrix44 s;
+	s.setScale(random(4.0f) + 0.1f, random(4.0f) + 0.1f, random(4.0f) + 0.1f);
+	m = s * m;
+	m.translateGlobal(random(2000.0f, -1000), random(2000.0f, -1000), random(2000.0f, -1000));
+	return m;
+}
+
+bool testSimdMath(int iterations)
+{
+	int errors[5] = { 0, 0, 0, 0, 0 };
+	for (int i = 0; i < iterations; ++i)
+	{
+		Matrix44 a = randomMatrix(i % 4 != 0), b = randomMatrix(i % 3 != 0);
+		Matrix44 product = a * b, reference = multiplyMatricesScalar(a, b);
+		errors[0] += !nearlyEqual(product.m, reference.m, 16, 1e-5f, maxAbs(a.m, 16) * maxAbs(b.m, 16));
+
+		Vector3 p(random(200.0f, -100), random(200.0f, -100), random(200.0f, -100));
+		Vector3 tp = a * p, tp_reference = transformPointScalar(a, p);
+		Vector4 v(p, random(2.0f, -1)), tv = a * v, tv_reference = transformVectorScalar(a, v);
+		float scale = maxAbs(a.m, 16) * maxAbs(v.v, 4);
+		errors[1] += !nearlyEqual(tp.v, tp_reference.v, 3, 1e-5f, scale) || !nearlyEqual(tv.v, tv_reference.v, 4, 1e-5f, scale);
+
+		Matrix44 affine = randomMatrix(true);
+		BoundingBox box(p, Vector3(random(50.0f), random(50.0f), random(50.0f)));
+		BoundingBox tbox = transformBoundingBox(affine, box), tbox_reference = transformBoundingBoxScalar(affine, box);
+		scale = maxAbs(affine.m, 16) * maxAbs(p.v, 3);
+		errors[2] += !nearlyEqual(tbox.center.v, tbox_reference.center.v, 3, 1e-5f, scale) || !nearlyEqual(tbox.halfsize.v, tbox_reference.halfsize.v, 3, 1e-5f, scale);
+
+		Matrix44 inv = affine, inv_reference = affine;
+		bool ok = inv.inverse(), ok_reference = inv_reference.inverseGeneral(); //inverseAffine with SIMD
+		errors[3] += ok != ok_reference || !nearlyEqual(inv.m, inv_reference.m, 16, 1e-4f, maxAbs(inv_reference.m, 16));
+
+		//back to the identity
+		Matrix44 identity = affine * inv;
+		errors[4] += !nearlyEqual(identity.m, Matrix44::IDENTITY.m, 16, 1e-4f, maxAbs(affine.m, 16) * maxAbs(inv.m, 16));
+	}
+
+	bool passed = !errors[0] && !errors[1] && !errors[2] && !errors[3] && !errors[4];
+#ifdef USE_SIMD_MATH
+	const char* mode = "SIMD";
+#else
+	const char* mode = "scalar";
+#endif
+	if (passed)
+		std::cout << " + Math test (" << mode << "): " << iterations << " iterations OK" << std::endl;
+	else
+		std::cout << "[ERROR]: Math test (" << mode << ") failed. Products: " << errors[0] << ", transforms: " << errors[1]
+			<< ", boxes: " << errors[2] << ", inverses: " << errors[3] << ", identity: " << errors[4] << std::endl;
+	return passed;
+}
+
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b)
 {
 	BoundingBox result;
@@ -14,6 +14,12 @@
 #define DEG2RAD 0.0174532925
 #define RAD2DEG 57.295779513
 
+//matrix products, transforms, affine inverses and box transforms with SSE when the compiler has it,
+//the rest of targets (and builds that remove this block) use the scalar code
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define USE_SIMD_MATH
+#endif
+
 //more standard type definition
 typedef char int8;
 typedef unsigned char uint8;
@@ -228,7 +234,11 @@ class Matrix44
 		Vector3 topVector() { return Vector3(m[4],m[5],m[6]); }
 		Vector3 frontVector() { return Vector3(m[8],m[9],m[10]); }
 
-		bool inverse();
+		bool inverse(); //uses inverseAffine when the last column is (0,0,0,1) and USE_SIMD_MATH is defined
+		bool inverseGeneral(); //any invertible matrix, scalar
+#ifdef USE_SIMD_MATH
+		bool inverseAffine(); //rotation, scale and translation only, SSE
+#endif
 		void setUpAndOrthonormalize(Vector3 up);
 		void setFrontAndOrthonormalize(Vector3 front);
 
@@ -273,6 +283,11 @@ class Matrix44
 Vector3 operator * (const Matrix44& matrix, const Vector3& v);
 Vector4 operator * (const Matrix44& matrix, const Vector4& v); 
 
+//scalar versions of the SIMD math, always compiled to compare with them
+Matrix44 multiplyMatricesScalar(const Matrix44& a, const Matrix44& b);
+Vector3 transformPointScalar(const Matrix44& matrix, const Vector3& v);
+Vector4 transformVectorScalar(const Matrix44& matrix, const Vector4& v);
+
 
 class Quaternion
 {
@@ -366,6 +381,9 @@ public:
 //applies a transform to a AABB from object to world
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b);
 BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box);
+BoundingBox transformBoundingBoxScalar(const Matrix44 m, const BoundingBox& box); //transforms the 8 corners
+//compares the SIMD math with the scalar code on random matrices, prints the errors
+bool testSimdMath(int iterations = 1000);
 
 float signedDistanceToPlane(const Vector4& plane, const Vector3& point);
 int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3& halfsize );
@@ -0,0 +1,286 @@
+#include "geometrypool.h"
+
+#include "glstate.h"
+#include "shader.h"
+
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+
+GeometryPool* GeometryPool::pool = NULL;
+
+GeometryPool::GeometryPool()
+{
+	vertices_vbo_id = indices_vbo_id = vao_id = 0;
+	vertex_capacity = index_capacity = 0;
+	vertex_top = index_top = 0;
+	used_vertices = used_indices = 0;
+	num_defragments = 0;
+	needs_defragment = false;
+	resize(POOL_INITIAL_VERTICES, POOL_INITIAL_INDICES, false);
+}
+
+GeometryPool::~GeometryPool()
+{
+	if (vao_id)
+	{
+		GLState::forgetVertexArray(vao_id);
+		glDeleteVertexArrays(1, &vao_id);
+	}
+	if (vertices_vbo_id)
+		glDeleteBuffers(1, &vertices_vbo_id);
+	if (indices_vbo_id)
+		glDeleteBuffers(1, &indices_vbo_id);
+}
+
+bool GeometryPool::isSupported()
+{
+	//base vertex draws are GL 3.2, the context asks for 3.1 so it has to be checked
+	return glDrawElementsBaseVertex != 0 && glDrawElementsInstancedBaseVertex != 0 && glCopyBufferSubData != 0 && glGenVertexArrays != 0;
+}
+
+GeometryPool* GeometryPool::get()
+{
+	static bool checked = false;
+	if (!pool && !checked)
+	{
+		checked = true;
+		if (isSupported())
+			pool = new GeometryPool();
+		else
+			std::cout << "Geometry pool disabled, no support for glDrawElementsBaseVertex" << std::endl;
+	}
+	return pool;
+}
+
+void GeometryPool::update()
+{
+	if (pool && pool->needs_defragment)
+		pool->defragment();
+}
+
+int GeometryPool::allocate(const Mesh::tInterleaved* vertices, unsigned int num_vertices, const unsigned int* indices, unsigned int num_indices)
+{
+	if (!num_vertices || !num_indices)
+		return -1;
+
+	//grow keeping the offsets, the live ranges do not move
+	sGeometryRange vertex_range, index_range;
+	if (!allocRange(free_vertices, vertex_top, vertex_capacity, num_vertices, vertex_range))
+	{
+		resize(std::max(vertex_capacity * 2, vertex_top + num_vertices), index_capacity, false);
+		allocRange(free_vertices, vertex_top, vertex_capacity, num_vertices, vertex_range);
+	}
+	if (!allocRange(free_indices, index_top, index_capacity, num_indices, index_range))
+	{
+		resize(vertex_capacity, std::max(index_capacity * 2, index_top + num_indices), false);
+		allocRange(free_indices, index_top, index_capacity, num_indices, index_range);
+	}
+
+	//the copy targets do not touch the element buffer of the vertex array bound
+	glBindBuffer(GL_COPY_WRITE_BUFFER, vertices_vbo_id);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, vertex_range.start * sizeof(Mesh::tInterleaved), num_vertices * sizeof(Mesh::tInterleaved), vertices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, indices_vbo_id);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, index_range.start * sizeof(unsigned int), num_indices * sizeof(unsigned int), indices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+
+	int id;
+	if (free_ids.size())
+	{
+		id = free_ids.back();
+		free_ids.pop_back();
+	}
+	else
+	{
+		id = (int)allocations.size();
+		allocations.push_back(sGeometryAllocation());
+	}
+	sGeometryAllocation& allocation = allocations[id];
+	allocation.vertices = vertex_range;
+	allocation.indices = index_range;
+	allocation.used = true;
+	used_vertices += num_vertices;
+	used_indices += num_indices;
+	return id;
+}
+
+void GeometryPool::free(int id)
+{
+	sGeometryAllocation& allocation = allocations[id];
+	assert(allocation.used && "freeing a pool allocation twice");
+	freeRange(free_vertices, vertex_top, allocation.vertices);
+	freeRange(free_indices, index_top, allocation.indices);
+	used_vertices -= allocation.vertices.size;
+	used_indices -= allocation.indices.size;
+	allocation.used = false;
+	free_ids.push_back(id);
+
+	//too many holes or more than a quarter of the used part wasted
+	if (free_vertices.size() > POOL_MAX_FREE_BLOCKS || free_indices.size() > POOL_MAX_FREE_BLOCKS ||
+		(vertex_top - used_vertices) * 4 > vertex_top || (index_top - used_indices) * 4 > index_top)
+		needs_defragment = true;
+}
+
+bool GeometryPool::allocRange(std::vector<sGeometryRange>& free_list, unsigned int& top, unsigned int capacity, unsigned int size, sGeometryRange& range)
+{
+	range.size = size;
+	for (size_t i = 0; i < free_list.size(); ++i)
+	{
+		sGeometryRange& block = free_list[i];
+		if (block.size < size)
+			continue;
+		range.start = block.start;
+		block.start += size;
+		block.size -= size;
+		if (!block.size)
+			free_list.erase(free_list.begin() + i);
+		return true;
+	}
+	if (top + size > capacity)
+		return false;
+	range.start = top;
+	top += size;
+	return true;
+}
+
+void GeometryPool::freeRange(std::vector<sGeometryRange>& free_list, unsigned int& top, sGeometryRange range)
+{
+	size_t i = 0;
+	while (i < free_list.size() && free_list[i].start < range.start)
+		++i;
+
+	//merge with the next block and with the previous one
+	if (i < free_list.size() && range.start + range.size == free_list[i].start)
+	{
+		range.size += free_list[i].size;
+		free_list.erase(free_list.begin() + i);
+	}
+	if (i > 0 && free_list[i - 1].start + free_list[i - 1].size == range.start)
+	{
+		--i;
+		range.start = free_list[i].start;
+		range.size += free_list[i].size;
+		free_list.erase(free_list.begin() + i);
+	}
+
+	//the last block goes back to the top
+	if (range.start + range.size == top)
+		top = range.start;
+	else
+		free_list.insert(free_list.begin() + i, range);
+}
+
+void GeometryPool::defragment()
+{
+	resize(vertex_capacity, index_capacity, true);
+	num_defragments++;
+	needs_defragment = false;
+}
+
+//new buffers, copying the old content in the GPU. When compacting the live ranges are moved
+//one after another, the indices are relative to the base vertex so they do not change
+void GeometryPool::resize(unsigned int new_vertex_capacity, unsigned int new_index_capacity, bool compact)
+{
+	GLuint new_vertices = 0, new_indices = 0;
+	glGenBuffers(1, &new_vertices);
+	glGenBuffers(1, &new_indices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, new_vertices);
+	glBufferData(GL_COPY_WRITE_BUFFER, new_vertex_capacity * sizeof(Mesh::tInterleaved), NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, new_indices);
+	glBufferData(GL_COPY_WRITE_BUFFER, new_index_capacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+
+	if (vertices_vbo_id)
+	{
+		if (compact)
+		{
+			unsigned int vertex_cursor = 0, index_cursor = 0;
+			for (size_t i = 0; i < allocations.size(); ++i)
+			{
+				sGeometryAllocation& allocation = allocations[i];
+				if (!allocation.used)
+					continue;
+				glBindBuffer(GL_COPY_READ_BUFFER, vertices_vbo_id);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, new_vertices);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, allocation.vertices.start * sizeof(Mesh::tInterleaved), vertex_cursor * sizeof(Mesh::tInterleaved), allocation.vertices.size * sizeof(Mesh::tInterleaved));
+				glBindBuffer(GL_COPY_READ_BUFFER, indices_vbo_id);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, new_indices);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, allocation.indices.start * sizeof(unsigned int), index_cursor * sizeof(unsigned int), allocation.indices.size * sizeof(unsigned int));
+				allocation.vertices.start = vertex_cursor;
+				allocation.indices.start = index_cursor;
+				vertex_cursor += allocation.vertices.size;
+				index_cursor += allocation.indices.size;
+			}
+			vertex_top = vertex_cursor;
+			index_top = index_cursor;
+			free_vertices.clear();
+			free_indices.clear();
+		}
+		else
+		{
+			if (vertex_top)
+			{
+				glBindBuffer(GL_COPY_READ_BUFFER, vertices_vbo_id);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, new_vertices);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, vertex_top * sizeof(Mesh::tInterleaved));
+			}
+			if (index_top)
+			{
+				glBindBuffer(GL_COPY_READ_BUFFER, indices_vbo_id);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, new_indices);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, index_top * sizeof(unsigned int));
+			}
+		}
+		glDeleteBuffers(1, &vertices_vbo_id);
+		glDeleteBuffers(1, &indices_vbo_id);
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	vertices_vbo_id = new_vertices;
+	indices_vbo_id = new_indices;
+	vertex_capacity = new_vertex_capacity;
+	index_capacity = new_index_capacity;
+	createVertexArray();
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+//same layout as the interleaved meshes at the fixed attribute locations
+void GeometryPool::createVertexArray()
+{
+	if (vao_id)
+	{
+		GLState::forgetVertexArray(vao_id);
+		glDeleteVertexArrays(1, &vao_id);
+	}
+	glGenVertexArrays(1, &vao_id);
+	GLState::bindVertexArray(vao_id);
+
+	int stride = sizeof(Mesh::tInterleaved);
+	glBindBuffer(GL_ARRAY_BUFFER, vertices_vbo_id);
+	glEnableVertexAttribArray(ATTRIB_a_vertex);
+	glVertexAttribPointer(ATTRIB_a_vertex, 3, GL_FLOAT, GL_FALSE, stride, 0);
+	glEnableVertexAttribArray(ATTRIB_a_normal);
+	glVertexAttribPointer(ATTRIB_a_normal, 3, GL_FLOAT, GL_FALSE, stride, (void*)sizeof(Vector3));
+	glEnableVertexAttribArray(ATTRIB_a_uv);
+	glVertexAttribPointer(ATTRIB_a_uv, 2, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(Vector3) * 2));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void GeometryPool::bind()
+{
+	GLState::bindVertexArray(vao_id);
+}
+
+void GeometryPool::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Vertices: %d used, %d top, %d capacity", used_vertices, vertex_top, vertex_capacity);
+	ImGui::Text("Indices: %d used, %d top, %d capacity", used_indices, index_top, index_capacity);
+	ImGui::Text("Free blocks: %d, defragments: %d", (int)free_vertices.size(), num_defragments);
+	ImGui::Text("Memory: %d KB", (int)((vertex_capacity * sizeof(Mesh::tInterleaved) + index_capacity * sizeof(unsigned int)) / 1024));
+	if (ImGui::Button("Defragment"))
+		defragment();
+#endif
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "includes.h"
+#include "mesh.h"
+
+#include <vector>
+
+#define POOL_INITIAL_VERTICES (1 << 20)	//32MB of vertices
+#define POOL_INITIAL_INDICES (1 << 22)	//16MB of indices
+#define POOL_MAX_FREE_BLOCKS 64
+
+//range of a pool buffer, in vertices or in indices
+struct sGeometryRange {
+	unsigned int start;
+	unsigned int size;
+};
+
+struct sGeometryAllocation {
+	sGeometryRange vertices;
+	sGeometryRange indices;	//relative to the first vertex, drawn with the base vertex
+	bool used;
+};
+
+// Big vertex and index buffers shared by the static meshes, so runs of different meshes
+// are drawn with the same vertex array and no buffer binds, every draw only changes the
+// first index and the base vertex. All the meshes use the interleaved vertex, normal, uv format,
+// meshes with other streams (colors, skinning, second uvs) keep their own buffers.
+// Freed ranges go to a free list and are reused first fit; when there are too many holes
+// the next update() moves the live ranges together. Ids stay valid, only the offsets change.
+class GeometryPool
+{
+public:
+	static GeometryPool* pool; //created on the first use, NULL if the GPU cannot draw with base vertex
+
+	GLuint vertices_vbo_id;
+	GLuint indices_vbo_id;
+	GLuint vao_id;
+
+	unsigned int vertex_capacity;
+	unsigned int index_capacity;
+	unsigned int vertex_top;	//end of the used part, the rest is free
+	unsigned int index_top;
+	unsigned int used_vertices;	//in live allocations
+	unsigned int used_indices;
+	int num_defragments;
+	bool needs_defragment;
+
+	std::vector<sGeometryAllocation> allocations;
+	std::vector<int> free_ids;
+	std::vector<sGeometryRange> free_vertices; //sorted by start
+	std::vector<sGeometryRange> free_indices;
+
+	GeometryPool();
+	~GeometryPool();
+
+	static bool isSupported();
+	static GeometryPool* get(); //creates the pool if it is supported
+	static void update(); //once per frame, defragments if a free asked for it
+
+	//returns the id of the allocation or -1 if it does not fit
+	int allocate(const Mesh::tInterleaved* vertices, unsigned int num_vertices, const unsigned int* indices, unsigned int num_indices);
+	void free(int id);
+	const sGeometryAllocation& getAllocation(int id) { return allocations[id]; }
+
+	void bind(); //the vertex array of the pool, every pooled mesh draws with it
+	void defragment();
+	void renderInMenu();
+
+private:
+	bool allocRange(std::vector<sGeometryRange>& free_list, unsigned int& top, unsigned int capacity, unsigned int size, sGeometryRange& range);
+	void freeRange(std::vector<sGeometryRange>& free_list, unsigned int& top, sGeometryRange range);
+	void resize(unsigned int new_vertex_capacity, unsigned int new_index_capacity, bool compact);
+	void createVertexArray();
+};
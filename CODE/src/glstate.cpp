@@ -0,0 +1,220 @@
+#include "glstate.h"
+
+#include <cassert>
+
+int GLState::issued = 0;
+int GLState::skipped = 0;
+int GLState::issued_last_frame = 0;
+int GLState::skipped_last_frame = 0;
+
+//-1 when unknown, so the next call always goes to GL
+static const GLenum s_caps[] = { GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_SCISSOR_TEST, GL_STENCIL_TEST };
+#define NUM_CAPS (int)(sizeof(s_caps) / sizeof(s_caps[0]))
+static int s_cap_values[NUM_CAPS] = { -1, -1, -1, -1, -1 };
+
+static GLenum s_blend_src = 0;
+static GLenum s_blend_dst = 0;
+static GLenum s_depth_func = 0;
+static int s_depth_mask = -1;
+static GLenum s_cull_face = 0;
+static GLint s_program = -1;
+static int s_active_unit = -1;
+static GLint s_vertex_array = -1;
+
+struct sTextureBinding {
+	GLenum target;
+	GLint id; //-1 unknown
+};
+static sTextureBinding s_textures[GLSTATE_MAX_TEXTURE_UNITS];
+
+static int findCap(GLenum cap)
+{
+	for (int i = 0; i < NUM_CAPS; ++i)
+		if (s_caps[i] == cap)
+			return i;
+	return -1;
+}
+
+void GLState::set(GLenum cap, bool enabled)
+{
+	int index = findCap(cap);
+	if (index != -1)
+	{
+		if (s_cap_values[index] == (int)enabled)
+		{
+			skipped++;
+			return;
+		}
+		s_cap_values[index] = enabled;
+	}
+	issued++;
+	if (enabled)
+		glEnable(cap);
+	else
+		glDisable(cap);
+}
+
+void GLState::enable(GLenum cap)
+{
+	set(cap, true);
+}
+
+void GLState::disable(GLenum cap)
+{
+	set(cap, false);
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst)
+{
+	if (s_blend_src == src && s_blend_dst == dst)
+	{
+		skipped++;
+		return;
+	}
+	s_blend_src = src;
+	s_blend_dst = dst;
+	issued++;
+	glBlendFunc(src, dst);
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (s_depth_func == func)
+	{
+		skipped++;
+		return;
+	}
+	s_depth_func = func;
+	issued++;
+	glDepthFunc(func);
+}
+
+void GLState::depthMask(bool write)
+{
+	if (s_depth_mask == (int)write)
+	{
+		skipped++;
+		return;
+	}
+	s_depth_mask = write;
+	issued++;
+	glDepthMask(write);
+}
+
+void GLState::cullFace(GLenum face)
+{
+	if (s_cull_face == face)
+	{
+		skipped++;
+		return;
+	}
+	s_cull_face = face;
+	issued++;
+	glCullFace(face);
+}
+
+void GLState::useProgram(GLuint program)
+{
+	if (s_program == (GLint)program)
+	{
+		skipped++;
+		return;
+	}
+	s_program = program;
+	issued++;
+	glUseProgram(program);
+}
+
+void GLState::activeTexture(int unit)
+{
+	assert(unit >= 0 && unit < GLSTATE_MAX_TEXTURE_UNITS);
+	if (s_active_unit == unit)
+		return; //not counted, it is part of a bind
+	s_active_unit = unit;
+	glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLState::bindTexture(GLenum target, GLuint id)
+{
+	//the active unit is unknown, whatever is bound there is unknown too
+	if (s_active_unit == -1)
+	{
+		issued++;
+		glBindTexture(target, id);
+		return;
+	}
+	bindTexture(s_active_unit, target, id);
+}
+
+void GLState::bindTexture(int unit, GLenum target, GLuint id)
+{
+	sTextureBinding& binding = s_textures[unit];
+	if (binding.target == target && binding.id == (GLint)id)
+	{
+		skipped++;
+		return;
+	}
+	activeTexture(unit);
+	binding.target = target;
+	binding.id = id;
+	issued++;
+	glBindTexture(target, id);
+}
+
+void GLState::bindVertexArray(GLuint vao)
+{
+	if (s_vertex_array == (GLint)vao)
+	{
+		skipped++;
+		return;
+	}
+	s_vertex_array = vao;
+	issued++;
+	glBindVertexArray(vao);
+}
+
+void GLState::forgetTexture(GLuint id)
+{
+	for (int i = 0; i < GLSTATE_MAX_TEXTURE_UNITS; ++i)
+		if (s_textures[i].id == (GLint)id)
+			s_textures[i].id = -1;
+}
+
+void GLState::forgetProgram(GLuint program)
+{
+	if (s_program == (GLint)program)
+		s_program = -1;
+}
+
+void GLState::forgetVertexArray(GLuint vao)
+{
+	if (s_vertex_array == (GLint)vao)
+		s_vertex_array = -1;
+}
+
+void GLState::invalidate()
+{
+	for (int i = 0; i < NUM_CAPS; ++i)
+		s_cap_values[i] = -1;
+	s_blend_src = s_blend_dst = 0;
+	s_depth_func = 0;
+	s_depth_mask = -1;
+	s_cull_face = 0;
+	s_program = -1;
+	s_active_unit = -1;
+	s_vertex_array = -1;
+	for (int i = 0; i < GLSTATE_MAX_TEXTURE_UNITS; ++i)
+	{
+		s_textures[i].target = 0;
+		s_textures[i].id = -1;
+	}
+}
+
+void GLState::beginFrame()
+{
+	invalidate();
+	issued_last_frame = issued;
+	skipped_last_frame = skipped;
+	issued = 0;
+	skipped = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include "includes.h"
+
+#define GLSTATE_MAX_TEXTURE_UNITS 16
+
+//Shadow copy of the GL state the renderer changes all the time.
+//Every setter compares with the value it knows and only calls GL when it changes,
+//so the passes can set what they need before every draw without paying for it.
+//Raw GL calls behind its back make the copy wrong: invalidate() forgets everything,
+//beginFrame() does it every frame since ImGui and other libraries change the state too.
+
+class GLState {
+public:
+	//caps that are tracked, any other cap goes straight to GL
+	static void enable(GLenum cap);
+	static void disable(GLenum cap);
+	static void set(GLenum cap, bool enabled);
+
+	static void blendFunc(GLenum src, GLenum dst);
+	static void depthFunc(GLenum func);
+	static void depthMask(bool write);
+	static void cullFace(GLenum face);
+
+	static void useProgram(GLuint program);
+	static void activeTexture(int unit);
+	static void bindTexture(GLenum target, GLuint id); //to the active unit
+	static void bindTexture(int unit, GLenum target, GLuint id);
+	static void bindVertexArray(GLuint vao);
+
+	//deleted objects, their ids can be reused by new ones
+	static void forgetTexture(GLuint id);
+	static void forgetProgram(GLuint program);
+	static void forgetVertexArray(GLuint vao);
+
+	static void invalidate();
+	static void beginFrame(); //invalidates and moves the counters to the last frame ones
+
+	//calls issued to GL and calls skipped because nothing changed, this frame and the previous one
+	static int issued;
+	static int skipped;
+	static int issued_last_frame;
+	static int skipped_last_frame;
+
+	//for the uniform caches of the shaders, they count as calls too
+	static void countSkipped() { skipped++; }
+	static void countIssued() { issued++; }
+};
+
+#endif
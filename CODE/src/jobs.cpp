@@ -0,0 +1,113 @@
+#include "jobs.h"
+
+JobPool* JobPool::pool = NULL;
+
+JobPool::JobPool(int num_threads)
+{
+	this->num_threads = num_threads;
+	func = NULL;
+	data = NULL;
+	num_jobs = 0;
+	next_job = 0;
+	pending = 0;
+	active = 0;
+	generation = 0;
+	quit = false;
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(std::thread(&JobPool::workerLoop, this));
+}
+
+JobPool::~JobPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+//one worker less than cores, the main thread works too
+JobPool* JobPool::get()
+{
+	if (!pool)
+	{
+		int cores = (int)std::thread::hardware_concurrency();
+		int workers = cores > 1 ? cores - 1 : 1;
+		pool = new JobPool(workers > 7 ? 7 : workers);
+	}
+	return pool;
+}
+
+void JobPool::run(int num_jobs, JobFunc func, void* data)
+{
+	if (num_jobs <= 0)
+		return;
+	if (num_jobs == 1 || !num_threads)
+	{
+		for (int i = 0; i < num_jobs; ++i)
+			func(i, data);
+		return;
+	}
+
+	{
+		//a worker that woke late for the last batch may still be in work(), it must leave before the counters are reset
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return active == 0; });
+		this->func = func;
+		this->data = data;
+		this->num_jobs = num_jobs;
+		next_job = 0;
+		pending = num_jobs;
+		generation++;
+	}
+	wake.notify_all();
+
+	work(func, data, num_jobs);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return pending == 0 && active == 0; });
+}
+
+void JobPool::work(JobFunc func, void* data, int num_jobs)
+{
+	int job;
+	while ((job = next_job++) < num_jobs)
+	{
+		func(job, data);
+		if (--pending == 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done.notify_all();
+		}
+	}
+}
+
+void JobPool::workerLoop()
+{
+	unsigned int seen = 0;
+	while (true)
+	{
+		JobFunc job_func;
+		void* job_data;
+		int jobs;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+			job_func = func;
+			job_data = data;
+			jobs = num_jobs;
+			active++;
+		}
+
+		work(job_func, job_data, jobs);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		active--;
+		done.notify_all();
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+// Small pool of worker threads for the data parallel stages of the frame (occlusion, culling).
+// run() splits the work in jobs identified by an index, the calling thread takes jobs too
+// and it returns when all of them are done, so the data can live in the stack or the frame arena.
+class JobPool
+{
+public:
+	typedef void (*JobFunc)(int job, void* data);
+
+	static JobPool* pool; //shared by the whole app, created on the first use
+
+	int num_threads; //workers, not counting the thread that calls run
+
+	JobPool(int num_threads);
+	~JobPool();
+
+	static JobPool* get();
+
+	void run(int num_jobs, JobFunc func, void* data);
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	JobFunc func;
+	void* data;
+	int num_jobs;
+	std::atomic<int> next_job;
+	std::atomic<int> pending;
+	int active; //workers inside work(), run waits for them before publishing a batch and before returning
+	unsigned int generation;
+	bool quit;
+
+	void workerLoop();
+	void work(JobFunc func, void* data, int num_jobs);
+};
@@ -3,10 +3,12 @@
 
 #include "includes.h"
 #include "texture.h"
+#include "shader.h"
 
 using namespace GTR;
 
 std::map<std::string, Material*> Material::sMaterials;
+unsigned int Material::s_last_sort_id = 0;
 
 Material* Material::Get(const char* name)
 {
@@ -28,12 +30,15 @@ void Material::renderInMenu()
 	#ifndef SKIP_IMGUI
 	ImGui::Text("Name: %s", name.c_str()); // Show String
 	ImGui::Checkbox("Two sided", &two_sided);
-	ImGui::Combo("AlphaMode", (int*)&alpha_mode,"NO_ALPHA\0MASK\0BLEND",3);
-	ImGui::SliderFloat("Alpha Cutoff", &alpha_cutoff, 0.0f, 1.0f);
-	ImGui::ColorEdit4("Color", color.v); // Edit 4 floats representing a color + alpha
+	//the factors live in a uniform buffer, only upload them again if they change
+	block_dirty |= ImGui::Combo("AlphaMode", (int*)&alpha_mode,"NO_ALPHA\0MASK\0BLEND",3);
+	block_dirty |= ImGui::SliderFloat("Alpha Cutoff", &alpha_cutoff, 0.0f, 1.0f);
+	block_dirty |= ImGui::ColorEdit4("Color", color.v); // Edit 4 floats representing a color + alpha
 	float factor = this->emissive_factor.x;
-	if(ImGui::SliderFloat("Emmisive factor", &factor, 0.0f, 5.0f));
+	if (ImGui::SliderFloat("Emmisive factor", &factor, 0.0f, 5.0f)) {
 		emissive_factor = Vector3(1, 1, 1) * factor;
+		block_dirty = true;
+	}
 
 	if (color_texture && ImGui::TreeNode(color_texture, "Color Texture"))
 	{
@@ -55,3 +60,14 @@ Material::~Material()
 	}
 }
 
+unsigned int Material::getShaderFeatures()
+{
+	unsigned int features = 0;
+	if (normal_texture)
+		features |= FEATURE(NORMALMAP);
+	if (emissive_texture)
+		features |= FEATURE(EMISSIVE);
+	if (alpha_mode == MASK)
+		features |= FEATURE(ALPHA_MASK);
+	return features;
+}
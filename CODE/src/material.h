@@ -26,6 +26,14 @@ namespace GTR {
 		std::string name;
 		void registerMaterial(const char* name);
 
+		//small id used to sort draw calls by material
+		static unsigned int s_last_sort_id;
+		unsigned int sort_id;
+
+		//range of the material in the renderer uniform buffer, -1 until it is first used
+		int block_index;
+		bool block_dirty;	//edited since it was uploaded
+
 		//parameters to control transparency
 		AlphaMode alpha_mode;	//could be NO_ALPHA, MASK (alpha cut) or BLEND (alpha blend)
 		float alpha_cutoff;		//pixels with alpha than this value shouldnt be rendered
@@ -50,11 +58,16 @@ namespace GTR {
 								//ctors
 		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), two_sided(false), roughness_factor(1), metallic_factor(0) {
 			color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL; texture_rep = 1;
+			sort_id = ++s_last_sort_id;
+			block_index = -1; block_dirty = true;
 		}
 		Material(Texture* texture) : Material() { color_texture = texture; }
 		virtual ~Material();
 
 		//render gui info inside the panel
 		void renderInMenu();
+
+		//shader features this material needs, the textures it has and how it handles transparency
+		unsigned int getShaderFeatures();
 	};
 };
\ No newline at end of file
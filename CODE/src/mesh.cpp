@@ -13,15 +13,19 @@
 #include "camera.h"
 #include "texture.h"
 #include "animation.h"
+#include "glstate.h"
+#include "geometrypool.h"
 #include "extra/coldet/coldet.h"
 
 bool Mesh::use_binary = true;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::use_geometry_pool = true;	//shares the buffers of the static meshes so they draw without binds
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+unsigned int Mesh::s_last_sort_id = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -30,8 +34,11 @@ long Mesh::num_triangles_rendered = 0;
 
 Mesh::Mesh()
 {
+	sort_id = ++s_last_sort_id;
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	vao_id = 0;
+	pool_allocation = -1;
 	collision_model = NULL;
 	clear();
 }
@@ -44,6 +51,18 @@ Mesh::~Mesh()
 
 void Mesh::clear()
 {
+	if (pool_allocation != -1)
+	{
+		GeometryPool::pool->free(pool_allocation);
+		pool_allocation = -1;
+	}
+	if (vao_id)
+	{
+		GLState::forgetVertexArray(vao_id);
+		glDeleteVertexArrays(1, &vao_id);
+		vao_id = 0;
+	}
+
 	//Free VBOs
 	if (vertices_vbo_id)
 		glDeleteBuffersARB(1, &vertices_vbo_id);
@@ -232,6 +251,25 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	}
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
+	//pooled meshes share the vertex array, consecutive ones do not bind anything
+	if (pool_allocation != -1)
+	{
+		GeometryPool::pool->bind();
+		drawCall(primitive, submesh_id, num_instances);
+		return;
+	}
+
+	//uploaded meshes keep their attributes in a vertex array, one bind and it is ready
+	if (vao_id || createVertexArray())
+	{
+		GLState::bindVertexArray(vao_id);
+		drawCall(primitive, submesh_id, num_instances);
+		return;
+	}
+
+	//client side arrays only work with the default vertex array
+	GLState::bindVertexArray(0);
+
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 
@@ -260,18 +298,34 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	}
 
 	//DRAW
-	if (indices.size())
+	if (pool_allocation != -1)
+	{
+		//the non indexed meshes got sequential indices, their ranges are in vertices
+		const sGeometryAllocation& allocation = GeometryPool::pool->getAllocation(pool_allocation);
+		int first = indices.size() ? start * 3 : start;
+		int count = indices.size() ? size * 3 : size;
+		void* offset = (void*)((allocation.indices.start + first) * sizeof(unsigned int));
+		if (num_instances > 0)
+			glDrawElementsInstancedBaseVertex(primitive, count, GL_UNSIGNED_INT, offset, num_instances, allocation.vertices.start);
+		else
+			glDrawElementsBaseVertex(primitive, count, GL_UNSIGNED_INT, offset, allocation.vertices.start);
+	}
+	else if (indices.size())
 	{
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3)), num_instances);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			if (!vao_id) //the vertex array has it bound already
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)), num_instances);
+			if (!vao_id)
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
 		{
-			if (indices_vbo_id)
+			if (vao_id)
+				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)));
+			else if (indices_vbo_id)
 			{
 				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)));
@@ -305,6 +359,75 @@ void Mesh::disableBuffers(Shader* shader)
 	glBindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
 }
 
+//the layout does not depend on the shader since all of them use the fixed locations of SHADER_ATTRIBUTES,
+//the streams the shader does not read are ignored and the ones the mesh lacks keep the default value
+bool Mesh::createVertexArray()
+{
+	if ((!vertices_vbo_id && !interleaved_vbo_id) || glGenVertexArrays == 0)
+		return false;
+	if (indices.size() && !indices_vbo_id)
+		return false;
+
+	glGenVertexArrays(1, &vao_id);
+	GLState::bindVertexArray(vao_id);
+
+	int spacing = interleaved_vbo_id ? sizeof(tInterleaved) : 0;
+
+	glEnableVertexAttribArray(ATTRIB_a_vertex);
+	glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
+	glVertexAttribPointer(ATTRIB_a_vertex, 3, GL_FLOAT, GL_FALSE, spacing, 0);
+
+	if (interleaved_vbo_id || normals_vbo_id)
+	{
+		glEnableVertexAttribArray(ATTRIB_a_normal);
+		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
+		glVertexAttribPointer(ATTRIB_a_normal, 3, GL_FLOAT, GL_FALSE, spacing, (void*)(interleaved_vbo_id ? sizeof(Vector3) : 0));
+	}
+
+	if (interleaved_vbo_id || uvs_vbo_id)
+	{
+		glEnableVertexAttribArray(ATTRIB_a_uv);
+		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
+		glVertexAttribPointer(ATTRIB_a_uv, 2, GL_FLOAT, GL_FALSE, spacing, (void*)(interleaved_vbo_id ? sizeof(Vector3) * 2 : 0));
+	}
+
+	if (uvs1_vbo_id)
+	{
+		glEnableVertexAttribArray(ATTRIB_a_uv1);
+		glBindBuffer(GL_ARRAY_BUFFER, uvs1_vbo_id);
+		glVertexAttribPointer(ATTRIB_a_uv1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	}
+
+	if (colors_vbo_id)
+	{
+		glEnableVertexAttribArray(ATTRIB_a_color);
+		glBindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
+		glVertexAttribPointer(ATTRIB_a_color, 4, GL_FLOAT, GL_FALSE, 0, 0);
+	}
+
+	if (bones_vbo_id)
+	{
+		glEnableVertexAttribArray(ATTRIB_a_bones);
+		glBindBuffer(GL_ARRAY_BUFFER, bones_vbo_id);
+		glVertexAttribPointer(ATTRIB_a_bones, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, 0);
+	}
+
+	if (weights_vbo_id)
+	{
+		glEnableVertexAttribArray(ATTRIB_a_weights);
+		glBindBuffer(GL_ARRAY_BUFFER, weights_vbo_id);
+		glVertexAttribPointer(ATTRIB_a_weights, 4, GL_FLOAT, GL_FALSE, 0, 0);
+	}
+
+	//the element buffer is part of the vertex array state, the array buffer is not
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	assert(glGetError() == GL_NO_ERROR);
+	return true;
+}
+
 GLuint instances_buffer_id = 0;
 
 //should be faster but in some system it is slower
@@ -316,6 +439,14 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 	Shader* shader = Shader::current;
 	assert(shader && "shader must be enabled");
 
+	//the instanced attributes go to the vertex array of the mesh, it must be bound before setting them
+	if (pool_allocation != -1)
+		GeometryPool::pool->bind();
+	else if (vao_id || createVertexArray())
+		GLState::bindVertexArray(vao_id);
+	else
+		GLState::bindVertexArray(0);
+
 	if (instances_buffer_id == 0)
 		glGenBuffersARB(1, &instances_buffer_id);
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
@@ -336,8 +467,8 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 		glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
 	}
 
-	//regular render
-	render(primitive, 0, num_instances);
+	//regular render, all the submeshes
+	render(primitive, -1, num_instances);
 
 	//disable instanced attribs
 	for (int k = 0; k < 4; ++k)
@@ -443,6 +574,22 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
+	//binding the element buffer below would change the vertex array bound, and the streams may change
+	GLState::bindVertexArray(0);
+	if (vao_id)
+	{
+		GLState::forgetVertexArray(vao_id);
+		glDeleteVertexArrays(1, &vao_id);
+		vao_id = 0;
+	}
+	if (pool_allocation != -1)
+	{
+		GeometryPool::pool->free(pool_allocation);
+		pool_allocation = -1;
+	}
+	if (use_geometry_pool && uploadToPool())
+		return;
+
 	if (interleaved.size())
 	{
 		// Vertex,Normal,UV
@@ -530,6 +677,46 @@ void Mesh::uploadToVRAM()
 	//clear buffers to save memory
 }
 
+//only the vertex, normal and uv streams, the meshes with more keep their own buffers
+bool Mesh::uploadToPool()
+{
+	if (colors.size() || bones.size() || weights.size() || uvs1.size())
+		return false;
+	if (!GeometryPool::get())
+		return false;
+
+	const tInterleaved* data = interleaved.size() ? &interleaved[0] : NULL;
+	unsigned int num_vertices = (unsigned int)(interleaved.size() ? interleaved.size() : vertices.size());
+	std::vector<tInterleaved> packed;
+	if (!data)
+	{
+		packed.resize(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+		{
+			packed[i].vertex = vertices[i];
+			packed[i].normal = normals.size() ? normals[i] : Vector3(0, 1, 0);
+			packed[i].uv = uvs.size() ? uvs[i] : Vector2(0, 0);
+		}
+		data = &packed[0];
+	}
+
+	//the pool only draws indexed, the rest get 0,1,2...
+	std::vector<unsigned int> sequential;
+	const unsigned int* index_data = indices.size() ? (const unsigned int*)&indices[0] : NULL;
+	unsigned int num_indices = (unsigned int)indices.size() * 3;
+	if (!index_data)
+	{
+		sequential.resize(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+			sequential[i] = i;
+		index_data = &sequential[0];
+		num_indices = num_vertices;
+	}
+
+	pool_allocation = GeometryPool::pool->allocate(data, num_vertices, index_data, num_indices);
+	return pool_allocation != -1;
+}
+
 bool Mesh::createCollisionModel(bool is_static)
 {
 	if (collision_model)
@@ -1262,6 +1449,37 @@ void Mesh::createCube()
 	radius = (float)box.halfsize.length();
 }
 
+void Mesh::createCone(int segments)
+{
+	vertices.clear();
+	normals.clear();
+	uvs.clear();
+	colors.clear();
+
+	//sides and base, counter clockwise seen from outside
+	Vector3 apex(0, 0, 0);
+	Vector3 base_center(0, 0, 1);
+	for (int i = 0; i < segments; ++i)
+	{
+		float a0 = (i / (float)segments) * 2.0f * PI;
+		float a1 = ((i + 1) / (float)segments) * 2.0f * PI;
+		Vector3 p0(cos(a0), sin(a0), 1);
+		Vector3 p1(cos(a1), sin(a1), 1);
+
+		vertices.push_back(apex);
+		vertices.push_back(p1);
+		vertices.push_back(p0);
+
+		vertices.push_back(base_center);
+		vertices.push_back(p0);
+		vertices.push_back(p1);
+	}
+
+	box.center.set(0, 0, 0.5);
+	box.halfsize.set(1, 1, 0.5);
+	radius = (float)box.halfsize.length();
+}
+
 void Mesh::createWireBox()
 {
 	const float _verts[] = { -1,-1,-1,  1,-1,-1,  -1,1,-1,  1,1,-1, -1,-1,1,  1,-1,1, -1,1,1,  1,1,1,    -1,-1,-1, -1,1,-1, 1,-1,-1, 1,1,-1, -1,-1,1, -1,1,1, 1,-1,1, 1,1,1,   -1,-1,-1, -1,-1,1, 1,-1,-1, 1,-1,1, -1,1,-1, -1,1,1, 1,1,-1, 1,1,1 };
@@ -1505,6 +1723,18 @@ Mesh* Mesh::getQuad()
 	return quad;
 }
 
+Mesh* Mesh::getCube()
+{
+	static Mesh* cube = NULL;
+	if (!cube)
+	{
+		cube = new Mesh();
+		cube->createCube();
+		cube->uploadToVRAM();
+	}
+	return cube;
+}
+
 Mesh* Mesh::Get(const char* filename, bool skip_load)
 {
 	assert(filename);
@@ -34,10 +34,13 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool use_geometry_pool; //static meshes are uploaded to the shared buffers of the GeometryPool
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static unsigned int s_last_sort_id;
 
 	std::string name;
+	unsigned int sort_id; //small id used to sort draw calls by mesh
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
 
@@ -80,6 +83,9 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	unsigned int vao_id; //all the streams at the fixed attribute locations, built on the first render
+	int pool_allocation; //in the GeometryPool, -1 if the mesh has its own buffers
+
 	Mesh();
 	~Mesh();
 
@@ -94,6 +100,7 @@ public:
 	void enableBuffers(Shader* shader);
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
 	void disableBuffers(Shader* shader);
+	bool createVertexArray(); //false if the mesh is not in VRAM
 
 	bool readBin(const char* filename);
 	bool writeBin(const char* filename);
@@ -117,15 +124,18 @@ public:
 	void createPlane(float size);
 	void createSubdividedPlane(float size = 1, int subdivisions = 256, bool centered = false);
 	void createCube();
+	void createCone(int segments); //apex in the origin and base of radius 1 at z=1
 	void createWireBox();
 	void createGrid(float dist);
 	void displace(Image* heightmap, float altitude);
 	static Mesh* getQuad(); //get global quad
+	static Mesh* getCube(); //get global cube, from -1 to 1
 
 	void updateBoundingBox();
 
 	//optimize meshes
 	void uploadToVRAM();
+	bool uploadToPool(); //false if the format does not fit the pool
 	bool interleaveBuffers();
 
 private:
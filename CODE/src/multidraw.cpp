@@ -0,0 +1,108 @@
+#include "multidraw.h"
+
+#include "mesh.h"
+#include "shader.h"
+#include "geometrypool.h"
+#include "arena.h"
+
+#include <cassert>
+
+MultiDraw::MultiDraw()
+{
+	commands_buffer_id = models_buffer_id = 0;
+	commands = NULL;
+	num_commands = max_commands = 0;
+	num_multidraws = num_commands_drawn = 0;
+}
+
+MultiDraw::~MultiDraw()
+{
+	if (commands_buffer_id)
+		glDeleteBuffers(1, &commands_buffer_id);
+	if (models_buffer_id)
+		glDeleteBuffers(1, &models_buffer_id);
+}
+
+//the context asks for 3.1, the drivers that give more (Mesa llvmpipe gives 4.5) can use it
+bool MultiDraw::isSupported()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		supported = (major > 4 || (major == 4 && minor >= 3)) && glMultiDrawElementsIndirect != 0 && GeometryPool::get();
+	}
+	return supported == 1;
+}
+
+void MultiDraw::begin(const Matrix44* models, int num_models, int max)
+{
+	if (!commands_buffer_id)
+	{
+		glGenBuffers(1, &commands_buffer_id);
+		glGenBuffers(1, &models_buffer_id);
+	}
+	commands = FrameArena::frame->allocArray<sDrawCommand>(max ? max : 1);
+	max_commands = max;
+	num_commands = 0;
+
+	if (num_models)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, models_buffer_id);
+		glBufferData(GL_ARRAY_BUFFER, num_models * sizeof(Matrix44), models, GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+}
+
+void MultiDraw::add(Mesh* mesh, int first_model, int count)
+{
+	assert(mesh->pool_allocation != -1 && "only pooled meshes can be drawn indirect");
+	assert(num_commands < max_commands);
+	const sGeometryAllocation& allocation = GeometryPool::pool->getAllocation(mesh->pool_allocation);
+	sDrawCommand& command = commands[num_commands++];
+	command.count = allocation.indices.size;
+	command.instance_count = count;
+	command.first_index = allocation.indices.start;
+	command.base_vertex = allocation.vertices.start;
+	command.base_instance = first_model;
+
+	Mesh::num_meshes_rendered++;
+	Mesh::num_triangles_rendered += (allocation.indices.size / 3) * count;
+}
+
+int MultiDraw::flush()
+{
+	if (!num_commands)
+		return 0;
+
+	//the model attribute lives in the vertex array of the pool only while drawing
+	GeometryPool::pool->bind();
+	glBindBuffer(GL_ARRAY_BUFFER, models_buffer_id);
+	for (int k = 0; k < 4; ++k)
+	{
+		glEnableVertexAttribArray(ATTRIB_u_model + k);
+		glVertexAttribPointer(ATTRIB_u_model + k, 4, GL_FLOAT, GL_FALSE, sizeof(Matrix44), (void*)(sizeof(float) * 4 * k));
+		glVertexAttribDivisor(ATTRIB_u_model + k, 1);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commands_buffer_id);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, num_commands * sizeof(sDrawCommand), commands, GL_STREAM_DRAW);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, num_commands, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	for (int k = 0; k < 4; ++k)
+	{
+		glDisableVertexAttribArray(ATTRIB_u_model + k);
+		glVertexAttribDivisor(ATTRIB_u_model + k, 0);
+	}
+	assert(glGetError() == GL_NO_ERROR);
+
+	int drawn = num_commands;
+	num_multidraws++;
+	num_commands_drawn += drawn;
+	num_commands = 0;
+	return drawn;
+}
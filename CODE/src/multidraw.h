@@ -0,0 +1,45 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+
+class Mesh;
+
+//layout fixed by GL for glMultiDrawElementsIndirect
+struct sDrawCommand {
+	GLuint count;
+	GLuint instance_count;
+	GLuint first_index;
+	GLint base_vertex;
+	GLuint base_instance;
+};
+
+// Submits many draws of pooled meshes with one glMultiDrawElementsIndirect.
+// The models of a whole pass are uploaded once at begin() and every command points to its own
+// with the base instance, so the shaders read them as the per instance u_model of the instancing variant.
+// Commands can only be grouped while the shader and the material uniforms stay the same,
+// the renderer calls flush() before changing them.
+class MultiDraw
+{
+public:
+	GLuint commands_buffer_id;
+	GLuint models_buffer_id;
+
+	sDrawCommand* commands; //from the frame arena
+	int num_commands;
+	int max_commands;
+
+	//stats since the last resetStats
+	int num_multidraws;
+	int num_commands_drawn;
+
+	MultiDraw();
+	~MultiDraw();
+
+	static bool isSupported(); //GL 4.3 or ARB_multi_draw_indirect, base instance included
+
+	void begin(const Matrix44* models, int num_models, int max_commands);
+	void add(Mesh* mesh, int first_model, int count); //the mesh must be in the GeometryPool
+	int flush(); //draws the commands added with the current shader, returns how many
+	void resetStats() { num_multidraws = num_commands_drawn = 0; }
+};
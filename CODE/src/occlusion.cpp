@@ -0,0 +1,359 @@
+#include "occlusion.h"
+
+#include "jobs.h"
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#include <chrono>
+#include <iostream>
+#include <cmath>
+
+#define NEAR_W 0.001f //clip w below this is too close to the camera plane to project
+#define TEST_CHUNK 64 //boxes per job
+
+static float elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+OcclusionCuller::OcclusionCuller()
+{
+	depth = (float*)_mm_malloc(OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float), 16);
+	for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; ++i)
+		depth[i] = 1.0f;
+	num_occluders = num_tested = num_culled = 0;
+	raster_ms = test_ms = 0.0f;
+}
+
+OcclusionCuller::~OcclusionCuller()
+{
+	_mm_free(depth);
+}
+
+void OcclusionCuller::begin(const Matrix44& viewprojection)
+{
+	this->viewprojection = viewprojection;
+	triangles.clear();
+	num_occluders = num_tested = num_culled = 0;
+}
+
+void OcclusionCuller::addOccluder(const Matrix44& model, const Vector3* vertices, int stride, int num_vertices, const unsigned int* indices, int num_triangles)
+{
+	if (num_triangles > MAX_OCCLUDER_TRIANGLES)
+		return;
+	num_occluders++;
+	Matrix44 mvp = model * viewprojection;
+
+	for (int i = 0; i < num_triangles; ++i)
+	{
+		sOccluderTriangle triangle;
+		bool clipped = false;
+		for (int j = 0; j < 3; ++j)
+		{
+			int index = indices ? indices[i * 3 + j] : i * 3 + j;
+			if (index >= num_vertices)
+			{
+				clipped = true;
+				break;
+			}
+			const Vector3& v = *(const Vector3*)((const char*)vertices + index * stride);
+			Vector4 clip = mvp * Vector4(v, 1.0f);
+			if (clip.w < NEAR_W)
+			{
+				clipped = true; //dropping it only makes the occlusion weaker
+				break;
+			}
+			float inv_w = 1.0f / clip.w;
+			triangle.x[j] = (clip.x * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+			triangle.y[j] = (clip.y * inv_w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+			triangle.z[j] = clip.z * inv_w * 0.5f + 0.5f;
+		}
+		if (clipped)
+			continue;
+
+		float min_x = (float)fmin(triangle.x[0], fmin(triangle.x[1], triangle.x[2]));
+		float max_x = (float)fmax(triangle.x[0], fmax(triangle.x[1], triangle.x[2]));
+		float min_y = (float)fmin(triangle.y[0], fmin(triangle.y[1], triangle.y[2]));
+		float max_y = (float)fmax(triangle.y[0], fmax(triangle.y[1], triangle.y[2]));
+		if (max_x < 0.0f || min_x >= OCCLUSION_WIDTH || max_y < 0.0f || min_y >= OCCLUSION_HEIGHT)
+			continue;
+		triangle.min_y = min_y < 0.0f ? 0 : (int)min_y;
+		triangle.max_y = max_y >= OCCLUSION_HEIGHT ? OCCLUSION_HEIGHT - 1 : (int)max_y;
+		triangles.push_back(triangle);
+	}
+}
+
+void OcclusionCuller::rasterize()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	JobPool::get()->run(OCCLUSION_BANDS, rasterizeJob, this);
+	raster_ms = elapsedMs(start);
+}
+
+void OcclusionCuller::rasterizeJob(int job, void* data)
+{
+	((OcclusionCuller*)data)->rasterizeBand(job);
+}
+
+//edge functions and depth plane evaluated for 4 pixels of a row at once, the depth keeps the minimum
+void OcclusionCuller::rasterizeBand(int band)
+{
+	int band_start = band * OCCLUSION_HEIGHT / OCCLUSION_BANDS;
+	int band_end = (band + 1) * OCCLUSION_HEIGHT / OCCLUSION_BANDS;
+
+	const __m128 far_depth = _mm_set1_ps(1.0f);
+	for (int y = band_start; y < band_end; ++y)
+		for (int x = 0; x < OCCLUSION_WIDTH; x += 4)
+			_mm_store_ps(depth + y * OCCLUSION_WIDTH + x, far_depth);
+
+	const __m128 lane_offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (size_t t = 0; t < triangles.size(); ++t)
+	{
+		const sOccluderTriangle& triangle = triangles[t];
+		if (triangle.max_y < band_start || triangle.min_y >= band_end)
+			continue;
+
+		float x0 = triangle.x[0], y0 = triangle.y[0], z0 = triangle.z[0];
+		float x1 = triangle.x[1], y1 = triangle.y[1], z1 = triangle.z[1];
+		float x2 = triangle.x[2], y2 = triangle.y[2], z2 = triangle.z[2];
+		float area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+		if (fabs(area) < 1e-6f)
+			continue;
+		if (area < 0.0f) //both windings occlude, make it counter clockwise
+		{
+			float tx = x1, ty = y1, tz = z1;
+			x1 = x2; y1 = y2; z1 = z2;
+			x2 = tx; y2 = ty; z2 = tz;
+			area = -area;
+		}
+
+		//E(p) = a * p.x + b * p.y + c, positive inside
+		float a0 = -(y1 - y0), b0 = x1 - x0, c0 = (y1 - y0) * x0 - (x1 - x0) * y0;
+		float a1 = -(y2 - y1), b1 = x2 - x1, c1 = (y2 - y1) * x1 - (x2 - x1) * y1;
+		float a2 = -(y0 - y2), b2 = x0 - x2, c2 = (y0 - y2) * x2 - (x0 - x2) * y2;
+
+		float dzdx = ((z1 - z0) * (y2 - y0) - (z2 - z0) * (y1 - y0)) / area;
+		float dzdy = ((z2 - z0) * (x1 - x0) - (z1 - z0) * (x2 - x0)) / area;
+		float zc = z0 - dzdx * x0 - dzdy * y0;
+
+		float min_x = (float)fmin(x0, fmin(x1, x2));
+		float max_x = (float)fmax(x0, fmax(x1, x2));
+		int start_x = min_x < 0.0f ? 0 : ((int)min_x & ~3);
+		int end_x = max_x >= OCCLUSION_WIDTH ? OCCLUSION_WIDTH - 1 : (int)max_x;
+		int start_y = triangle.min_y > band_start ? triangle.min_y : band_start;
+		int end_y = triangle.max_y < band_end - 1 ? triangle.max_y : band_end - 1;
+
+		for (int y = start_y; y <= end_y; ++y)
+		{
+			float py = y + 0.5f;
+			__m128 row0 = _mm_set1_ps(b0 * py + c0);
+			__m128 row1 = _mm_set1_ps(b1 * py + c1);
+			__m128 row2 = _mm_set1_ps(b2 * py + c2);
+			__m128 rowz = _mm_set1_ps(dzdy * py + zc);
+			float* row = depth + y * OCCLUSION_WIDTH;
+			for (int x = start_x; x <= end_x; x += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets);
+				__m128 e0 = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(a0)), row0);
+				__m128 e1 = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(a1)), row1);
+				__m128 e2 = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(a2)), row2);
+				__m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+				if (!_mm_movemask_ps(inside))
+					continue;
+				__m128 z = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(dzdx)), rowz);
+				__m128 old = _mm_load_ps(row + x);
+				__m128 nearest = _mm_min_ps(old, z);
+				_mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+			}
+		}
+	}
+}
+
+bool OcclusionCuller::testBox(const BoundingBox& box) const
+{
+	float min_x = 1e10f, min_y = 1e10f, max_x = -1e10f, max_y = -1e10f, min_z = 1e10f;
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 corner = box.center + Vector3(i & 1 ? box.halfsize.x : -box.halfsize.x, i & 2 ? box.halfsize.y : -box.halfsize.y, i & 4 ? box.halfsize.z : -box.halfsize.z);
+		Vector4 clip = viewprojection * Vector4(corner, 1.0f);
+		if (clip.w < NEAR_W)
+			return true; //crosses the camera plane
+		float inv_w = 1.0f / clip.w;
+		float x = (clip.x * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+		float y = (clip.y * inv_w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+		float z = clip.z * inv_w * 0.5f + 0.5f;
+		min_x = (float)fmin(min_x, x); max_x = (float)fmax(max_x, x);
+		min_y = (float)fmin(min_y, y); max_y = (float)fmax(max_y, y);
+		min_z = (float)fmin(min_z, z);
+	}
+	//out of the screen is a matter of the frustum culling
+	if (max_x < 0.0f || min_x >= OCCLUSION_WIDTH || max_y < 0.0f || min_y >= OCCLUSION_HEIGHT)
+		return true;
+
+	int x0 = min_x < 0.0f ? 0 : (int)min_x;
+	int x1 = max_x >= OCCLUSION_WIDTH ? OCCLUSION_WIDTH - 1 : (int)max_x;
+	int y0 = min_y < 0.0f ? 0 : (int)min_y;
+	int y1 = max_y >= OCCLUSION_HEIGHT ? OCCLUSION_HEIGHT - 1 : (int)max_y;
+
+	//visible as soon as one pixel of the rect is further than the nearest point of the box
+	const __m128 box_z = _mm_set1_ps(min_z);
+	const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	const __m128 first = _mm_set1_ps((float)x0);
+	const __m128 last = _mm_set1_ps((float)x1);
+	for (int y = y0; y <= y1; ++y)
+	{
+		const float* row = depth + y * OCCLUSION_WIDTH;
+		for (int x = x0 & ~3; x <= x1; x += 4)
+		{
+			__m128 px = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+			__m128 in_rect = _mm_and_ps(_mm_cmpge_ps(px, first), _mm_cmple_ps(px, last));
+			__m128 further = _mm_cmpge_ps(_mm_load_ps(row + x), box_z);
+			if (_mm_movemask_ps(_mm_and_ps(in_rect, further)))
+				return true;
+		}
+	}
+	return false;
+}
+
+void OcclusionCuller::testJob(int job, void* data)
+{
+	sTestJob* test = (sTestJob*)data;
+	int end = (job + 1) * TEST_CHUNK < test->num ? (job + 1) * TEST_CHUNK : test->num;
+	for (int i = job * TEST_CHUNK; i < end; ++i)
+		test->visible[i] = test->culler->testBox(*test->boxes[i]);
+}
+
+void OcclusionCuller::testBoxes(const BoundingBox* const* boxes, int num, bool* visible)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	sTestJob test = { this, boxes, num, visible };
+	JobPool::get()->run((num + TEST_CHUNK - 1) / TEST_CHUNK, testJob, &test);
+	num_tested += num;
+	for (int i = 0; i < num; ++i)
+		if (!visible[i])
+			num_culled++;
+	test_ms = elapsedMs(start);
+}
+
+static Matrix44 testViewProjection()
+{
+	Matrix44 view, projection;
+	Vector3 eye(0, 0, 0), center(0, 0, -1), up(0, 1, 0);
+	view.lookAt(eye, center, up);
+	projection.perspective(70.0f, 16.0f / 9.0f, 1.0f, 1000.0f);
+	return view * projection;
+}
+
+//a 10x10 wall at 10 units from the camera, facing it
+static void addTestWall(OcclusionCuller& culler, bool clockwise)
+{
+	Vector3 quad[4] = { Vector3(-5, -5, -10), Vector3(5, -5, -10), Vector3(5, 5, -10), Vector3(-5, 5, -10) };
+	unsigned int ccw[6] = { 0, 1, 2, 0, 2, 3 };
+	unsigned int cw[6] = { 0, 2, 1, 0, 3, 2 };
+	culler.addOccluder(Matrix44::IDENTITY, quad, sizeof(Vector3), 4, clockwise ? cw : ccw, 2);
+}
+
+bool OcclusionCuller::test()
+{
+	int errors[6] = { 0, 0, 0, 0, 0, 0 };
+	Matrix44 vp = testViewProjection();
+
+	for (int winding = 0; winding < 2; ++winding)
+	{
+		OcclusionCuller culler;
+		culler.begin(vp);
+		addTestWall(culler, winding == 1);
+		culler.rasterize();
+
+		//the center of the buffer gets the depth of the wall, the corners stay far
+		Vector4 clip = vp * Vector4(0, 0, -10, 1);
+		float wall_z = clip.z / clip.w * 0.5f + 0.5f;
+		float center_z = culler.depth[(OCCLUSION_HEIGHT / 2) * OCCLUSION_WIDTH + OCCLUSION_WIDTH / 2];
+		errors[0] += fabs(center_z - wall_z) > 1e-4f || culler.depth[0] != 1.0f || culler.depth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT - 1] != 1.0f;
+
+		//behind the wall
+		errors[1] += culler.testBox(BoundingBox(Vector3(0, 0, -30), Vector3(1, 1, 1)));
+		errors[1] += culler.testBox(BoundingBox(Vector3(3, -3, -100), Vector3(5, 5, 5)));
+
+		//in front of it, crossing it, and partly out of its side
+		errors[2] += !culler.testBox(BoundingBox(Vector3(0, 0, -5), Vector3(1, 1, 1)));
+		errors[2] += !culler.testBox(BoundingBox(Vector3(0, 0, -10), Vector3(1, 1, 1)));
+		errors[2] += !culler.testBox(BoundingBox(Vector3(15, 0, -30), Vector3(2, 2, 2)));
+
+		//crossing the near plane, even if the rest is behind the wall
+		errors[3] += !culler.testBox(BoundingBox(Vector3(0, 0, -20), Vector3(1, 1, 20)));
+		errors[3] += !culler.testBox(BoundingBox(Vector3(0, 0, 0), Vector3(2, 2, 2)));
+
+		//both windings give the same buffer
+		if (winding == 0)
+			continue;
+		OcclusionCuller other;
+		other.begin(vp);
+		addTestWall(other, false);
+		other.rasterize();
+		for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; ++i)
+			errors[4] += culler.depth[i] != other.depth[i];
+
+		//the parallel tests give the same results as one at a time
+		const int num_boxes = 1000;
+		std::vector<BoundingBox> boxes(num_boxes);
+		std::vector<const BoundingBox*> pointers(num_boxes);
+		bool visible[num_boxes];
+		for (int i = 0; i < num_boxes; ++i)
+		{
+			boxes[i] = BoundingBox(Vector3(random(40.0f, -20), random(40.0f, -20), -random(60.0f, -2)), Vector3(random(3.0f) + 0.1f, random(3.0f) + 0.1f, random(3.0f) + 0.1f));
+			pointers[i] = &boxes[i];
+		}
+		culler.testBoxes(&pointers[0], num_boxes, visible);
+		for (int i = 0; i < num_boxes; ++i)
+			errors[5] += visible[i] != culler.testBox(boxes[i]);
+	}
+
+	bool passed = !errors[0] && !errors[1] && !errors[2] && !errors[3] && !errors[4] && !errors[5];
+	if (passed)
+		std::cout << " + Occlusion test: OK" << std::endl;
+	else
+		std::cout << "[ERROR]: Occlusion test failed. Depth: " << errors[0] << ", hidden: " << errors[1] << ", visible: " << errors[2]
+			<< ", near plane: " << errors[3] << ", winding: " << errors[4] << ", batch: " << errors[5] << std::endl;
+	return passed;
+}
+
+//a corridor of walls facing the camera with boxes scattered behind and between them
+void OcclusionCuller::benchmark(int num_occluders, int num_boxes)
+{
+	Matrix44 view, projection;
+	Vector3 eye(0, 0, 0), center(0, 0, -1), up(0, 1, 0);
+	view.lookAt(eye, center, up);
+	projection.perspective(70.0f, 16.0f / 9.0f, 1.0f, 1000.0f);
+
+	OcclusionCuller culler;
+	culler.begin(view * projection);
+
+	Vector3 quad[4] = { Vector3(-1, -1, 0), Vector3(1, -1, 0), Vector3(1, 1, 0), Vector3(-1, 1, 0) };
+	unsigned int quad_indices[6] = { 0, 1, 2, 0, 2, 3 };
+	for (int i = 0; i < num_occluders; ++i)
+	{
+		Matrix44 model;
+		model.setScale(random(40.0f, 10), random(20.0f, 5), 1.0f);
+		model.translateGlobal(random(400.0f, -200), random(200.0f, -100), -random(400.0f, 20));
+		culler.addOccluder(model, quad, sizeof(Vector3), 4, quad_indices, 2);
+	}
+	culler.rasterize();
+
+	std::vector<BoundingBox> boxes(num_boxes);
+	std::vector<const BoundingBox*> pointers(num_boxes);
+	bool* visible = new bool[num_boxes];
+	for (int i = 0; i < num_boxes; ++i)
+	{
+		boxes[i] = BoundingBox(Vector3(random(600.0f, -300), random(300.0f, -150), -random(800.0f, 30)), Vector3(random(5.0f, 1), random(5.0f, 1), random(5.0f, 1)));
+		pointers[i] = &boxes[i];
+	}
+	culler.testBoxes(&pointers[0], num_boxes, visible);
+	delete[] visible;
+
+	std::cout << "Occlusion benchmark: " << culler.num_occluders << " occluders (" << culler.triangles.size() << " triangles) rasterized in " << culler.raster_ms << " ms, "
+		<< num_boxes << " boxes tested in " << culler.test_ms << " ms, " << culler.num_culled << " culled (" << (100.0f * culler.num_culled / (num_boxes ? num_boxes : 1)) << "%), "
+		<< (JobPool::get()->num_threads + 1) << " threads" << std::endl;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+#define OCCLUSION_WIDTH 320		//multiple of 4, the rasterizer works on 4 pixels at once
+#define OCCLUSION_HEIGHT 180
+#define OCCLUSION_BANDS 12		//rows of the buffer split in bands rasterized in parallel
+#define MAX_OCCLUDER_TRIANGLES 4096	//bigger meshes are too slow to be occluders
+
+//occluder triangle already projected, x and y in pixels of the buffer, z in [0,1]
+struct sOccluderTriangle {
+	float x[3];
+	float y[3];
+	float z[3];
+	int min_y, max_y; //rows it touches
+};
+
+// Software occlusion culling, all in the CPU.
+// The big occluders are rasterized with SSE into a small depth buffer that keeps the nearest depth
+// and then the screen rect of every candidate box is compared with it: if all the pixels
+// under the rect are nearer than the nearest point of the box, the box is hidden.
+// Triangles that cross the near plane are dropped and boxes that cross it are always visible,
+// so nothing visible is culled because of the projection. The coverage is sampled at the pixel centers,
+// a hole thinner than a pixel of the buffer can be closed.
+// Both the rasterization (in bands of rows) and the tests run in the JobPool.
+class OcclusionCuller
+{
+public:
+	float* depth; //OCCLUSION_WIDTH x OCCLUSION_HEIGHT, 1 is far
+	Matrix44 viewprojection;
+	std::vector<sOccluderTriangle> triangles;
+
+	//stats of the last frame
+	int num_occluders;
+	int num_tested;
+	int num_culled;
+	float raster_ms;
+	float test_ms;
+
+	OcclusionCuller();
+	~OcclusionCuller();
+
+	void begin(const Matrix44& viewprojection);
+	//vertices with any stride in bytes, indices NULL for non indexed meshes
+	void addOccluder(const Matrix44& model, const Vector3* vertices, int stride, int num_vertices, const unsigned int* indices, int num_triangles);
+	void rasterize();
+
+	bool testBox(const BoundingBox& box) const;
+	//tests many boxes in parallel, visible[i] gets the result of boxes[i]
+	void testBoxes(const BoundingBox* const* boxes, int num, bool* visible);
+
+	//random walls and boxes, prints the cost and the cull rate. Needs no GL
+	static void benchmark(int num_occluders, int num_boxes);
+	//a wall in front of the camera and boxes around it with known results, prints OK or the failed checks. Needs no GL
+	static bool test();
+
+private:
+	void rasterizeBand(int band);
+	static void rasterizeJob(int job, void* data);
+	static void testJob(int job, void* data);
+
+	struct sTestJob {
+		OcclusionCuller* culler;
+		const BoundingBox* const* boxes;
+		int num;
+		bool* visible;
+	};
+};
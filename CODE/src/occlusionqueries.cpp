@@ -0,0 +1,196 @@
+#include "occlusionqueries.h"
+
+#include "camera.h"
+#include "PrefabEntity.h"
+
+#include <cassert>
+
+OcclusionQueries::OcclusionQueries()
+{
+	frame = 0;
+	target = 0;
+	num_results = 0;
+	num_hidden_entities = 0;
+}
+
+OcclusionQueries::~OcclusionQueries()
+{
+	for (auto it = states.begin(); it != states.end(); ++it)
+		glDeleteQueries(1, &it->second.query);
+}
+
+void OcclusionQueries::beginFrame()
+{
+	if (!target)
+	{
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		target = (major > 3 || (major == 3 && minor >= 3)) ? GL_ANY_SAMPLES_PASSED : GL_SAMPLES_PASSED;
+	}
+
+	frame++;
+	num_results = 0;
+	for (auto it = states.begin(); it != states.end(); )
+	{
+		sQueryState& state = it->second;
+		if (state.issued_frame != -1)
+		{
+			GLint available = 0;
+			glGetQueryObjectiv(state.query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint samples = 0;
+				glGetQueryObjectuiv(state.query, GL_QUERY_RESULT, &samples);
+				state.visible = samples > 0;
+				state.result_frame = frame;
+				state.issued_frame = -1;
+				num_results++;
+			}
+		}
+		else if (frame - state.used_frame > QUERY_FORGET_FRAMES)
+		{
+			glDeleteQueries(1, &state.query);
+			it = states.erase(it);
+			continue;
+		}
+		++it;
+	}
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+sQueryState& OcclusionQueries::getState(const void* key)
+{
+	auto it = states.find(key);
+	if (it != states.end())
+	{
+		it->second.used_frame = frame;
+		return it->second;
+	}
+	sQueryState& state = states[key];
+	glGenQueries(1, &state.query);
+	state.issued_frame = -1;
+	state.result_frame = -QUERY_CHECK_INTERVAL; //checked as soon as possible
+	state.used_frame = frame;
+	state.visible = true;
+	return state;
+}
+
+//while waiting for a result the last one is kept, an old result means the object was not around
+bool OcclusionQueries::isVisible(const sQueryState& state) const
+{
+	if (state.issued_frame != -1)
+		return state.visible;
+	return state.visible || frame - state.result_frame > QUERY_STALE_FRAMES;
+}
+
+//the checks are spread over the frames with the address of the object
+bool OcclusionQueries::isDue(const sQueryState& state, const void* key) const
+{
+	if (state.issued_frame != -1)
+		return false;
+	int jitter = (int)(((size_t)key >> 4) % QUERY_CHECK_INTERVAL);
+	return frame - state.result_frame >= QUERY_CHECK_INTERVAL + jitter;
+}
+
+//a box around the camera cannot be tested, its faces are behind the near plane
+static bool containsEye(const BoundingBox& box, Camera* camera)
+{
+	Vector3 d = camera->eye - box.center;
+	float margin = camera->near_plane * 2.0f;
+	return fabs(d.x) <= box.halfsize.x + margin && fabs(d.y) <= box.halfsize.y + margin && fabs(d.z) <= box.halfsize.z + margin;
+}
+
+//the calls are still in collection order, the ones of an entity are together
+void OcclusionQueries::extract(GTR::RenderQueue& queue, Camera* camera)
+{
+	box_queries.clear();
+	hidden_calls.clear();
+	checked_calls.clear();
+	num_hidden_entities = 0;
+
+	PrefabEntity* entity = NULL;
+	sQueryState* entity_state = NULL;
+	bool entity_hidden = false;
+	bool any_visible = false;
+	int num = 0;
+	for (int i = 0; i <= queue.num_calls; ++i)
+	{
+		GTR::sRenderCall* call = i < queue.num_calls ? &queue.calls[i] : NULL;
+		PrefabEntity* call_entity = call ? call->entity : NULL;
+		if (call_entity != entity)
+		{
+			//an entity where nothing passed is hidden as a whole from now on
+			if (entity && !entity_hidden && !any_visible)
+			{
+				entity_state->visible = false;
+				entity_state->result_frame = frame;
+			}
+			entity = call_entity;
+			if (entity)
+			{
+				entity_state = &getState(entity);
+				entity_hidden = !isVisible(*entity_state) && !containsEye(entity->world_bounding, camera);
+				if (entity_hidden)
+				{
+					num_hidden_entities++;
+					if (entity_state->issued_frame == -1)
+						box_queries.push_back({ entity_state, &entity->world_bounding });
+				}
+				any_visible = false;
+			}
+		}
+		if (!call)
+			break;
+
+		if (!call->box || !entity)
+		{
+			queue.calls[num] = *call;
+			queue.keys[num++] = queue.keys[i];
+			continue;
+		}
+
+		if (entity_hidden)
+		{
+			hidden_calls.push_back({ *call, entity_state });
+			continue;
+		}
+
+		bool contains_eye = containsEye(*call->box, camera);
+		sQueryState& state = getState(call->box);
+		if (contains_eye)
+		{
+			state.visible = true;
+			state.result_frame = frame;
+		}
+		else if (!isVisible(state))
+		{
+			if (state.issued_frame == -1)
+				box_queries.push_back({ &state, call->box });
+			hidden_calls.push_back({ *call, &state });
+			continue;
+		}
+
+		any_visible = true;
+		if (!contains_eye && isDue(state, call->box))
+		{
+			checked_calls.push_back({ *call, &state });
+			continue;
+		}
+		queue.calls[num] = *call;
+		queue.keys[num++] = queue.keys[i];
+	}
+	queue.num_calls = num;
+}
+
+void OcclusionQueries::beginQuery(sQueryState* state)
+{
+	assert(state->issued_frame == -1 && "the query is still in flight");
+	glBeginQuery(target, state->query);
+}
+
+void OcclusionQueries::endQuery(sQueryState* state)
+{
+	glEndQuery(target);
+	state->issued_frame = frame;
+}
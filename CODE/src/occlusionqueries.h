@@ -0,0 +1,73 @@
+#pragma once
+
+#include "includes.h"
+#include "renderqueue.h"
+
+#include <unordered_map>
+#include <vector>
+
+#define QUERY_CHECK_INTERVAL 8	//frames between the queries of a visible object
+#define QUERY_STALE_FRAMES 4	//a result older than this is not trusted, the object is drawn again
+#define QUERY_FORGET_FRAMES 120	//states of objects not seen for this long are released
+
+class Camera;
+
+struct sQueryState {
+	GLuint query;
+	int issued_frame;	//-1 when there is no query in flight
+	int result_frame;	//frame when the last result was read
+	int used_frame;		//last frame the object was in the frustum
+	bool visible;
+};
+
+//a call taken out of the queue, drawn inside its query or under the condition of one
+struct sQueriedCall {
+	GTR::sRenderCall call;
+	sQueryState* state;
+};
+
+struct sBoxQuery {
+	sQueryState* state;
+	const BoundingBox* box;
+};
+
+// GPU occlusion queries with temporal coherence, in the style of CHC++.
+// Every entity and every node instance has a query state keyed by its address. The visibility of the
+// last frame decides what to do, so the CPU never waits for a result:
+// - visible objects are drawn with the queue, and every few frames one is drawn alone inside a query
+//   to find out if it got hidden.
+// - hidden objects only get their box queried after the visible ones fill the depth, and they are drawn
+//   with conditional rendering on it, so if they appear they are never missing for a frame.
+// - an entity with all its nodes hidden becomes hidden itself, then only its whole box is queried.
+// The results are read at the start of the next frames when they are available.
+class OcclusionQueries
+{
+public:
+	std::unordered_map<const void*, sQueryState> states;
+	int frame;
+	GLenum target; //GL_ANY_SAMPLES_PASSED when the driver has it
+
+	//filled by extract, drawn by the renderer after the queue
+	std::vector<sBoxQuery> box_queries;
+	std::vector<sQueriedCall> hidden_calls;
+	std::vector<sQueriedCall> checked_calls;
+
+	//stats of the last frame
+	int num_results;
+	int num_hidden_entities;
+
+	OcclusionQueries();
+	~OcclusionQueries();
+
+	void beginFrame(); //reads the results that are ready, never waits
+	//takes out of the queue the calls of hidden objects and the visible ones due for a check
+	void extract(GTR::RenderQueue& queue, Camera* camera);
+
+	void beginQuery(sQueryState* state);
+	void endQuery(sQueryState* state);
+
+private:
+	sQueryState& getState(const void* key);
+	bool isVisible(const sQueryState& state) const;
+	bool isDue(const sQueryState& state, const void* key) const;
+};
@@ -15,7 +15,7 @@
 
 using namespace GTR;
 
-Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF)
+Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF), occluder(false), prefab(NULL), flat_index(-1)
 {
 
 }
@@ -43,6 +43,21 @@ BoundingBox Node::getBoundingBox()
 	return transformBoundingBox(model, aabb);
 }
 
+void Node::setModel(const Matrix44& m)
+{
+	model = m;
+	markDirty();
+}
+
+void Node::markDirty()
+{
+	if (!prefab || flat_index == -1)
+		return;
+	prefab->flat_local[flat_index] = model;
+	prefab->flat_dirty[flat_index] = 1;
+	prefab->has_dirty = true;
+}
+
 void Node::renderInMenu()
 {
 	#ifndef SKIP_IMGUI
@@ -51,7 +66,9 @@ void Node::renderInMenu()
 	ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.75f, 0.75f, 0.75f, 1.0f));
 
 	//Model edit
-	ImGuiMatrix44(model, "Model");
+	if (ImGuiMatrix44(model, "Model"))
+		markDirty();
+	ImGui::Checkbox("Occluder", &occluder);
 
 	//Material
 	if (material && ImGui::TreeNode(material, "Material"))
@@ -76,6 +93,12 @@ void Node::renderInMenu()
 #endif
 }
 
+Prefab::Prefab()
+{
+	has_dirty = false;
+	version = 0;
+}
+
 Prefab::~Prefab()
 {
 	if (name.size())
@@ -91,6 +114,62 @@ void Prefab::updateBounding()
 	bounding = root.getBoundingBox();
 }
 
+void flattenInDepth(Prefab* prefab, Node* node, int parent)
+{
+	int index = (int)prefab->flat_nodes.size();
+	node->prefab = prefab;
+	node->flat_index = index;
+	prefab->flat_nodes.push_back(node);
+	prefab->flat_parents.push_back(parent);
+	prefab->flat_subtree_end.push_back(index + 1);
+	for (int i = 0; i < node->children.size(); ++i)
+		flattenInDepth(prefab, node->children[i], index);
+	prefab->flat_subtree_end[index] = (int)prefab->flat_nodes.size();
+}
+
+void Prefab::flatten()
+{
+	flat_nodes.clear();
+	flat_parents.clear();
+	flat_subtree_end.clear();
+	flattenInDepth(this, &root, -1);
+
+	int num = (int)flat_nodes.size();
+	flat_local.resize(num);
+	flat_global.resize(num);
+	flat_dirty.assign(num, 1);
+	for (int i = 0; i < num; ++i)
+		flat_local[i] = flat_nodes[i]->model;
+	has_dirty = true;
+	updateGlobalMatrices();
+}
+
+void Prefab::updateGlobalMatrices()
+{
+	if (!has_dirty)
+		return;
+
+	//parents are always processed before their children so the dirty flag propagates down
+	for (int i = 0; i < flat_nodes.size(); ++i)
+	{
+		int parent = flat_parents[i];
+		if (parent != -1 && flat_dirty[parent])
+			flat_dirty[i] = 1;
+		if (!flat_dirty[i])
+			continue;
+		if (parent == -1)
+			flat_global[i] = flat_local[i];
+		else
+			flat_global[i] = flat_local[i] * flat_global[parent];
+		flat_nodes[i]->global_model = flat_global[i];
+	}
+
+	for (int i = 0; i < flat_dirty.size(); ++i)
+		flat_dirty[i] = 0;
+	has_dirty = false;
+	version++;
+}
+
 std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
 
 Prefab* Prefab::Get(const char* filename)
@@ -110,6 +189,7 @@ Prefab* Prefab::Get(const char* filename)
 	std::string name = filename;
 	prefab->registerPrefab(name);
 	prefab->updateBounding();
+	prefab->flatten();
 	return prefab;
 }
 
@@ -14,6 +14,8 @@ class Camera;
 
 namespace GTR {
 
+	class Prefab;
+
 	//A node represents a part of a prefab, that has a mesh, a material, and a transform matrix
 	class Node
 	{
@@ -21,6 +23,7 @@ namespace GTR {
 		std::string name;
 		bool visible;
 		int layers;
+		bool occluder; //used by the occlusion culling even if it is not big enough
 
 		Mesh* mesh;
 		Material* material;
@@ -33,6 +36,10 @@ namespace GTR {
 		Node* parent;
 		std::vector<Node*> children;
 
+		//position inside the flattened arrays of its prefab (-1 if not flattened)
+		Prefab* prefab;
+		int flat_index;
+
 		//ctor
 		Node();
 
@@ -47,6 +54,10 @@ namespace GTR {
 		//add node to children list
 		void addChild(Node* child) { assert(child->parent == NULL);  children.push_back(child); child->parent = this; }
 
+		//change the local matrix, flags the node so its global matrix gets recomputed
+		void setModel(const Matrix44& m);
+		void markDirty();
+
 		//compute the global matrix taking into account its parent
 		Matrix44 getGlobalMatrix(bool fast = false) { 
 			if (parent)
@@ -69,10 +80,27 @@ namespace GTR {
 		Node root;
 		BoundingBox bounding;
 
+		//the tree flattened in depth first order (a parent is always before its children)
+		std::vector<Node*> flat_nodes;
+		std::vector<int> flat_parents;		//index of the parent, -1 for the root
+		std::vector<int> flat_subtree_end;	//index after the last descendant, to skip whole subtrees
+		std::vector<Matrix44> flat_local;	//local matrix of every node
+		std::vector<Matrix44> flat_global;	//matrix of every node in prefab space
+		std::vector<char> flat_dirty;		//local matrix changed since last update
+		bool has_dirty;
+		unsigned int version;				//increased every time any global matrix changes
+
+		Prefab();
+
 		//dtor
 		virtual ~Prefab();
 
 		void updateBounding();
+
+		//must be called if the tree structure changes (nodes added or removed)
+		void flatten();
+		//recomputes only the global matrices of the dirty nodes and their descendants
+		void updateGlobalMatrices();
 		void updateNodesByName();
 		Node* getNodeByName(const char* name);
 
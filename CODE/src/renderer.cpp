@@ -8,6 +8,9 @@
 #include "material.h"
 #include "utils.h"
 #include "extra/hdre.h"
+#include "arena.h"
+#include "glstate.h"
+#include "geometrypool.h"
 
 
 bool show_probes = false;
@@ -25,6 +28,14 @@ Renderer::Renderer() {
 	volumetric_fbo = new FBO();
 	volumetric_fbo->create(Application::instance->window_width / 4, Application::instance->window_height / 4, 1, GL_RGBA);
 	probes_texture = NULL;
+	lights_ubo = NULL;
+	frame_ubo = NULL;
+	materials_ubo = NULL;
+	material_stride = 0;
+	num_material_blocks = 0;
+	cascaded_light = NULL;
+	num_forward_lights = 0;
+	num_directional_lights = 0;
 	show_properties = false;
 	degamma = true;
 	pbr = true;
@@ -39,6 +50,22 @@ Renderer::Renderer() {
 	apply_glow = false;
 	SHinterpolation = false;
 	show_irradiance = false;
+	cache_shadows = true;
+	shadow_receiver_culling = false;
+	shadow_static_split = true;
+	use_clustered = true;
+	use_instancing = true;
+	use_multidraw = true;
+	use_occlusion_culling = false;
+	use_occlusion_queries = false;
+	use_scene_tree = true;
+	use_batch_culling = true;
+	entity_boxes_frame = 0;
+	occluder_min_size = 200.0f;
+	num_draw_calls = num_instanced_draws = 0;
+	cascade_distance = 3000.0f;
+	cascade_lambda = 0.75f;
+	shadowmaps_rendered = 0;
 	noise = Texture::Get("data/textures/noise.png");
 
 	points = GTR::generateSpherePoints(64, 1.0, true);
@@ -48,6 +75,13 @@ Renderer::Renderer() {
 	decal = Texture::Get("data/textures/crack.png");
 	cube = new Mesh();
 	cube->createCube();
+	cone = new Mesh();
+	cone->createCone(CONE_SEGMENTS);
+
+	//the atlas is already loaded, resolve the shaders used per draw only once
+	forward_shader = Shader::GetHandle("forward");
+	gbuffer_shader = Shader::GetHandle("multi");
+	shadow_shader = Shader::GetHandle("shadow");
 
 	generateReflectionProbes();
 
@@ -65,6 +99,97 @@ void Renderer::renderInMenu() {
 	ImGui::Checkbox("PBR", &pbr);
 	ImGui::Checkbox("Add decal", &add_decal);
 	ImGui::Checkbox("Apply Volumetric in Directional", &apply_volumetric);
+	ImGui::Text("Forward lights: %d", num_forward_lights);
+	ImGui::Text("GL calls: %d issued, %d skipped", GLState::issued_last_frame, GLState::skipped_last_frame);
+	ImGui::Checkbox("Instancing", &use_instancing);
+	ImGui::Text("Draw calls: %d, instanced: %d", num_draw_calls, num_instanced_draws);
+	if (MultiDraw::isSupported()) {
+		ImGui::Checkbox("Multi-draw indirect", &use_multidraw);
+		ImGui::Text("Indirect draws: %d, commands: %d", multi_draw.num_multidraws, multi_draw.num_commands_drawn);
+	}
+
+	if (ImGui::TreeNode("Shadows")) {
+		ImGui::Checkbox("Cache shadowmaps", &cache_shadows);
+		if (ImGui::Checkbox("Static/dynamic split", &shadow_static_split))
+			for (int i = 0; i < Scene::getInstance()->lights.size(); i++)
+				Scene::getInstance()->lights[i]->shadow_dirty = true;
+		ImGui::Checkbox("Cull casters outside the view", &shadow_receiver_culling);
+		ImGui::Text("Shadowmaps rendered: %d", shadowmaps_rendered);
+		int atlas_size = shadow_atlas.size == 2048 ? 0 : (shadow_atlas.size == 4096 ? 1 : 2);
+		if (ImGui::Combo("Atlas size", &atlas_size, "2048\04096\08192\0"))
+			shadow_atlas.init(2048 << atlas_size);
+		ImGui::Text("Atlas repacks: %d", shadow_atlas.repacks);
+		ImGui::DragFloat("Cascades distance", &cascade_distance, 10.0f, 100.0f, 100000.0f);
+		ImGui::SliderFloat("Cascades log split", &cascade_lambda, 0.0f, 1.0f);
+		for (int i = 0; i < Scene::getInstance()->lights.size(); i++) {
+			Light* l = Scene::getInstance()->lights[i];
+			if (l->getType() == OMNI)
+				continue;
+			ImGui::Text("Light %d: %d casters, %d culled", l->id, l->shadow_casters, l->shadow_culled);
+			ImGui::Text("  tile %d at (%d, %d), importance %.2f", l->shadow_tile_size, l->shadow_tile_x, l->shadow_tile_y, l->shadow_importance);
+		}
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Occlusion culling")) {
+		ImGui::Checkbox("Enabled", &use_occlusion_culling);
+		ImGui::SliderFloat("Occluder min size", &occluder_min_size, 10.0f, 2000.0f);
+		ImGui::Text("Occluders: %d, %d triangles", occlusion_culler.num_occluders, (int)occlusion_culler.triangles.size());
+		ImGui::Text("Culled: %d of %d", occlusion_culler.num_culled, occlusion_culler.num_tested);
+		ImGui::Text("Raster: %.3f ms, test: %.3f ms", occlusion_culler.raster_ms, occlusion_culler.test_ms);
+		if (ImGui::Button("Benchmark"))
+		{
+			OcclusionCuller::test();
+			OcclusionCuller::benchmark(500, 50000);
+		}
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Occlusion queries")) {
+		ImGui::Checkbox("Enabled", &use_occlusion_queries);
+		ImGui::Text("Objects: %d, results read: %d", (int)occlusion_queries.states.size(), occlusion_queries.num_results);
+		ImGui::Text("Hidden: %d calls, %d entities", (int)occlusion_queries.hidden_calls.size(), occlusion_queries.num_hidden_entities);
+		ImGui::Text("Box queries: %d, checks: %d", (int)occlusion_queries.box_queries.size(), (int)occlusion_queries.checked_calls.size());
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Scene tree")) {
+		Scene* scene = Scene::getInstance();
+		ImGui::Checkbox("Cull with the tree", &use_scene_tree);
+		if (!use_scene_tree)
+			ImGui::Checkbox("Batch SIMD culling", &use_batch_culling);
+		if (ImGui::Button("Culling benchmark"))
+			CullingBoxes::benchmark(100000);
+		ImGui::Text("Entities: %d, height %d", scene->entity_tree.num_leaves, scene->entity_tree.getHeight());
+		ImGui::Text("Lights: %d, height %d", scene->light_tree.num_leaves, scene->light_tree.getHeight());
+		ImGui::Text("In view: %d, moved: %d", (int)visible_entities.size(), (int)scene->moved_entities.size());
+		ImGui::Text("Tree frustum tests: %d", scene->entity_tree.num_frustum_tests);
+		ImGui::Text("Node frustum tests: %d", render_queue.num_box_tests);
+		ImGui::TreePop();
+	}
+
+	if (GeometryPool::pool && ImGui::TreeNode("Geometry pool")) {
+		GeometryPool::pool->renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Clustered lights")) {
+		ImGui::Checkbox("Use clustered deferred", &use_clustered);
+		ImGui::Text("Lights: %d, references: %d", light_clusters.num_lights, light_clusters.num_indices);
+		ImGui::Text("Max lights in a cluster: %d", light_clusters.max_per_cluster);
+		if (light_clusters.overflows)
+			ImGui::Text("Lost references: %d", light_clusters.overflows);
+		ImGui::DragFloat("Max distance", &light_clusters.max_distance, 10.0f, 100.0f, 100000.0f);
+		//same lights as the ones commented in the application, to test many lights
+		if (ImGui::Button("Add 100 omni lights")) {
+			for (int i = 0; i < 100; i++) {
+				Light* l = new Light(Vector3(0, 0, 1), Vector3(rand() % 2000 - 1000, 100, rand() % 2000 - 1000), Vector2(0, 0), OMNI, 10, Application::instance->window_width, Application::instance->window_height);
+				l->setMaxDist(200);
+				Scene::getInstance()->addLight(l);
+			}
+		}
+		ImGui::TreePop();
+	}
 
 	if (ImGui::TreeNode("SSAO+")) {
 		ImGui::Checkbox("Show SSAO", &show_ssao);
@@ -113,217 +238,338 @@ void Renderer::renderInMenu() {
 #endif
 }
 
-//renders all the prefab
-void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
+//submits the sorted render queue, used by the forward pipeline
+//fills the uniform buffer with all the visible lights, once per scene render
+void Renderer::uploadLights(Scene* scene)
 {
-	//assign the model to the root node
-	renderNode(model, &prefab->root, camera);
+	if (!lights_ubo) {
+		lights_ubo = new UBO();
+		lights_ubo->create(sizeof(sLightsBlock), LIGHTS_UBO_BINDING);
+	}
+
+	int num = 0;
+	cascaded_light = NULL;
+	num_directional_lights = 0;
+	for (int i = 0; i < scene->lights.size(); i++)
+		scene->lights[i]->buffer_index = -1;
+	for (int i = 0; i < scene->lights.size() && num < MAX_FORWARD_LIGHTS; i++) {
+		Light* l = scene->lights[i];
+		if (!l->visible)
+			continue;
+
+		//the cascades are plain uniforms, only one directional light can use them
+		bool cascades = l->getType() == DIRECTIONAL && l->shadow_tile_size && !cascaded_light;
+		if (cascades)
+			cascaded_light = l;
+		l->fillShaderData(lights_block.lights[num], cascades);
+
+		if (l->getType() == DIRECTIONAL)
+			directional_lights[num_directional_lights++] = num;
+		l->buffer_index = num;
+		forward_lights[num++] = l;
+	}
+	num_forward_lights = num;
+	lights_block.info = Vector4((float)num, 0, 0, 0);
+
+	//only the used part of the array
+	lights_ubo->upload(&lights_block, sizeof(Vector4) + num * sizeof(sLightData));
 }
 
-//renders a node of the prefab and its children
-void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+//distance from the light to the closest point of the box
+static bool lightReachesBox(Light* l, const BoundingBox& box)
 {
-	if (!node->visible)
-		return;
-
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	Vector3 pos = l->model.getTranslation();
+	float dx = (float)fmax(fabs(pos.x - box.center.x) - box.halfsize.x, 0.0);
+	float dy = (float)fmax(fabs(pos.y - box.center.y) - box.halfsize.y, 0.0);
+	float dz = (float)fmax(fabs(pos.z - box.center.z) - box.halfsize.z, 0.0);
+	float max_dist = l->getMaxDist();
+	return dx * dx + dy * dy + dz * dz <= max_dist * max_dist;
+}
 
-	//does this node have a mesh? then we must render it
-	if (node->mesh && node->material)
-	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(node_model,node->mesh->box);
-		
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) )
-		{
-			//render node mesh
-			renderMeshWithMaterial( node_model, node->mesh, node->material, camera );
-			//node->mesh->renderBounding(node_model, true);
+//indices of the lights whose range touches the box, the directional ones always do
+int Renderer::computeObjectLights(const BoundingBox& box, int* indices)
+{
+	int num = 0;
+	if (use_scene_tree) {
+		//only the lights whose range box touches the mesh come from the tree
+		for (int i = 0; i < num_directional_lights && num < MAX_OBJECT_LIGHTS; i++)
+			indices[num++] = directional_lights[i];
+		near_lights.clear();
+		Scene::getInstance()->light_tree.queryBox(box, near_lights);
+		for (int i = 0; i < near_lights.size() && num < MAX_OBJECT_LIGHTS; i++) {
+			Light* l = (Light*)near_lights[i];
+			if (l->buffer_index != -1 && lightReachesBox(l, box))
+				indices[num++] = l->buffer_index;
 		}
+		return num;
 	}
 
-	//iterate recursively with children
-	for (int i = 0; i < node->children.size(); ++i)
-		renderNode(prefab_model, node->children[i], camera);
+	for (int i = 0; i < num_forward_lights && num < MAX_OBJECT_LIGHTS; i++) {
+		Light* l = forward_lights[i];
+		if (l->getType() != DIRECTIONAL && !lightReachesBox(l, box))
+			continue;
+		indices[num++] = i;
+	}
+	return num;
 }
 
-//renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+//uniforms shared by all the meshes of the forward pass
+void Renderer::setForwardFrameUniforms(Shader* shader, Camera* camera)
 {
-	//in case there is nothing to do
-	if (!mesh || !mesh->getNumVertices() || !material)
-		return;
-	assert(glGetError() == GL_NO_ERROR);
-
-	//define locals to simplify coding
-	Shader* shader = NULL;
-	Texture* texture = NULL;
-
-	texture = material->color_texture;
-	//texture = material->emissive_texture;
-	//texture = material->metallic_roughness_texture;
-	//texture = material->normal_texture;
-	//texture = material->occlusion_texture;
-	if (texture == NULL)
-		texture = Texture::getWhiteTexture(); //a 1x1 white texture
+	shader->setUniform(UNIFORM_u_viewprojection, camera->viewprojection_matrix);
+	shader->setUniform(UNIFORM_u_camera_pos, camera->eye);
+	shader->setUniform("degamma", degamma);
+	shader->setUniform("u_ambient_light", Scene::getInstance()->ambient_light);
 
+	if (shadow_atlas.fbo)
+		shader->setUniform("shadowmap", shadow_atlas.fbo->depth_texture, 8);
+	if (cascaded_light)
+		setShadowUniforms(shader, cascaded_light);
+	else
+		shader->setUniform("u_num_cascades", 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
 
+void Renderer::setForwardMaterialUniforms(Shader* shader, GTR::Material* material)
+{
 	//select if render both sides of the triangles
 	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
-	assert(glGetError() == GL_NO_ERROR);
+		GLState::enable(GL_CULL_FACE);
 
-	//chose a shader
-	shader = Shader::Get("forward");
-
-	assert(glGetError() == GL_NO_ERROR);
+	//all the lights are in the same pass, blending is only for transparency
+	if (material->alpha_mode == GTR::AlphaMode::BLEND) {
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	else
+		GLState::disable(GL_BLEND);
 
-	//no shader? then nothing to render
-	if (!shader)
-		return;
-	shader->enable();
+	Texture* texture = material->color_texture;
+	if (texture == NULL)
+		texture = Texture::getWhiteTexture(); //a 1x1 white texture
+	shader->setUniform(UNIFORM_u_texture, texture, 0);
 
-	glDepthFunc(GL_LEQUAL);
-	//glBlendFunc(GL_SRC_ALPHA, GL_ONE); //set blending mode to additive
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-
-	float ambient = Scene::getInstance()->ambient_light;
-	int it = 0;
-	for (int i = 0; i < Scene::getInstance()->lights.size(); i++) {
-		Light* light = Scene::getInstance()->lights[i];
-		if (light->visible) {
-			//first one do not use blending
-			if (it == 0) {
-				glDisable(GL_BLEND);
-				shader->setUniform("u_ambient_light", ambient);			//aquest es canvia si volem afegir ambient
-				if (material->emissive_texture) {
-					shader->setUniform("u_emissive_factor", (float)material->emissive_factor.length());
-					shader->setUniform("u_emissive_texture", material->emissive_texture, 3);
-				}
-				else if (material->emissive_factor.length() > 0) {
-					shader->setUniform("u_emissive_factor", (float)material->emissive_factor.length());
-					shader->setUniform("u_emissive_texture", Texture::getWhiteTexture(), 3);
-				}else{
-					shader->setUniform("u_emissive_factor", 0.0f);
-					shader->setUniform("u_emissive_texture", Texture::getBlackTexture(), 3);
-				}
-			}
-			else {
-				glEnable(GL_BLEND);
-				shader->setUniform("u_ambient_light", 0.0f);
-				shader->setUniform("u_emissive_texture", Texture::getBlackTexture(), 3);
-				shader->setUniform("u_emissive_factor", 0.0f);
-			}
-			/*
-			if (i == 0 && material->alpha_mode != GTR::AlphaMode::BLEND) {
-				glDisable(GL_BLEND);
-				shader->setUniform("u_ambient_light", ambient);			//aquest es canvia si volem afegir ambient
-				if (material->emissive_texture)
-					shader->setUniform("u_emissive_texture", material->emissive_texture, 3);
-				else
-					shader->setUniform("u_emissive_texture", Texture::getBlackTexture(), 3);
-			}
-			else if (i == 0 && material->alpha_mode == GTR::AlphaMode::BLEND) {
-				glEnable(GL_BLEND);
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-				shader->setUniform("u_ambient_light", ambient);			//aquest es canvia si volem afegir ambient
-				if (material->emissive_texture)
-					shader->setUniform("u_emissive_texture", material->emissive_texture, 3);
-				else
-					shader->setUniform("u_emissive_texture", Texture::getBlackTexture(), 3);
-			}
-			else {
-				glEnable(GL_BLEND);
-				shader->setUniform("u_ambient_light", 0.0f);
-				shader->setUniform("u_emissive_texture", Texture::getBlackTexture(), 3);
-			}*/
+	if (material->metallic_roughness_texture)
+		shader->setUniform(UNIFORM_u_rough_metal_texture, material->metallic_roughness_texture, 1);
+	else
+		shader->setUniform(UNIFORM_u_rough_metal_texture, Texture::getBlackTexture(), 1);
 
+	if (material->emissive_texture) {
+		shader->setUniform(UNIFORM_u_emissive_factor, (float)material->emissive_factor.length());
+		shader->setUniform(UNIFORM_u_emissive_texture, material->emissive_texture, 3);
+	}
+	else if (material->emissive_factor.length() > 0) {
+		shader->setUniform(UNIFORM_u_emissive_factor, (float)material->emissive_factor.length());
+		shader->setUniform(UNIFORM_u_emissive_texture, Texture::getWhiteTexture(), 3);
+	}
+	else {
+		shader->setUniform(UNIFORM_u_emissive_factor, 0.0f);
+		shader->setUniform(UNIFORM_u_emissive_texture, Texture::getBlackTexture(), 3);
+	}
 
+	shader->setUniform(UNIFORM_u_texture_rep, (float)material->texture_rep);
+	shader->setUniform(UNIFORM_u_color, material->color);
+	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	shader->setUniform(UNIFORM_u_alpha_cutoff, material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0.0f);
+	assert(glGetError() == GL_NO_ERROR);
+}
 
+//one draw with all the lights that reach the mesh
+void Renderer::drawForward(Shader* shader, const Matrix44& model, Mesh* mesh)
+{
+	int indices[MAX_OBJECT_LIGHTS];
+	BoundingBox box = transformBoundingBox(model, mesh->box);
+	int num = computeObjectLights(box, indices);
+
+	shader->setUniform(UNIFORM_u_model, model);
+	shader->setUniform(UNIFORM_u_num_lights, num);
+	if (num)
+		shader->setUniform1Array(UNIFORM_u_light_indices, indices, num);
+	mesh->render(GL_TRIANGLES);
+	num_draw_calls++;
+}
 
-			//codigo relacionado con shadowmap
-			if (light->shadow_fbo) {
-				Texture* shadowmap = Scene::getInstance()->lights[i]->shadow_fbo->depth_texture;
+//the instances share the light list, made from the box that contains all of them
+void Renderer::drawForwardBatch(Shader* shader, const Matrix44* models, int count, Mesh* mesh)
+{
+	if (!(shader->features & FEATURE(INSTANCING))) {
+		for (int i = 0; i < count; ++i)
+			drawForward(shader, models[i], mesh);
+		return;
+	}
 
-				shader->setUniform("shadowmap", shadowmap, 8);
-				shader->setUniform("gShadowMap", shadowmap, 9);
-				shader->setUniform("gMapSize", Vector2(shadowmap->width, shadowmap->height));
-				Matrix44 shadow_proj = light->getCamera()->viewprojection_matrix;
+	int indices[MAX_OBJECT_LIGHTS];
+	BoundingBox box = transformBoundingBox(models[0], mesh->box);
+	for (int i = 1; i < count; ++i)
+		box = mergeBoundingBoxes(box, transformBoundingBox(models[i], mesh->box));
+	int num = computeObjectLights(box, indices);
+
+	shader->setUniform(UNIFORM_u_num_lights, num);
+	if (num)
+		shader->setUniform1Array(UNIFORM_u_light_indices, indices, num);
+	mesh->renderInstanced(GL_TRIANGLES, models, count);
+	num_draw_calls++;
+	num_instanced_draws++;
+}
 
-				shader->setUniform("u_shadow_viewproj", shadow_proj);
-				shader->setUniform("u_shadow_bias", light->shadow_bias*0.1f);
-			}
-			assert(glGetError() == GL_NO_ERROR);
-			//upload uniforms
-			shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-			shader->setUniform("u_camera_position", camera->eye);
-			shader->setUniform("u_model", model);
+//batches with enough instances use the instancing variant of their shader, the indirect ones always
+Shader* Renderer::getBatchShader(Shader* shader, int count, Mesh* mesh)
+{
+	if ((use_instancing && count >= MIN_INSTANCES) || (mesh && isMultiDrawn(mesh)))
+		return shader->getVariant(FEATURE(INSTANCING));
+	return shader;
+}
 
-			shader->setUniform("pbr", pbr);
-			shader->setUniform("degamma", degamma);			
-			shader->setUniform("u_texture_rep", (float)material->texture_rep);
+//one instanced draw if the shader takes the model per instance, one draw per model if not
+void Renderer::drawBatch(Shader* shader, const Matrix44* models, int count, Mesh* mesh)
+{
+	if (shader->features & FEATURE(INSTANCING)) {
+		mesh->renderInstanced(GL_TRIANGLES, models, count);
+		num_draw_calls++;
+		num_instanced_draws++;
+		return;
+	}
+	for (int i = 0; i < count; ++i) {
+		shader->setUniform(UNIFORM_u_model, models[i]);
+		mesh->render(GL_TRIANGLES);
+		num_draw_calls++;
+	}
+}
 
-			shader->setUniform("u_color", material->color);
-			if (texture)
-				shader->setUniform("u_texture", texture, 0);
+bool Renderer::isMultiDrawn(Mesh* mesh)
+{
+	return use_multidraw && mesh->pool_allocation != -1 && MultiDraw::isSupported();
+}
 
-			if (material->metallic_roughness_texture)
-				shader->setUniform("u_rough_metal_texture", material->metallic_roughness_texture, 1);
-			else
-				shader->setUniform("u_rough_metal_texture", Texture::getBlackTexture(), 1);
+//the models of the queue are already in batch order, the commands point inside them
+void Renderer::beginMultiDraw(RenderQueue& queue)
+{
+	if (use_multidraw && MultiDraw::isSupported())
+		multi_draw.begin(queue.instance_models, queue.num_calls, queue.num_batches);
+}
 
-			
+//pooled meshes wait in the indirect commands, the rest are drawn now
+void Renderer::submitBatch(RenderQueue& queue, const sRenderBatch& batch, Shader* shader)
+{
+	sRenderCall& call = queue.getBatchCall(batch);
+	if ((shader->features & FEATURE(INSTANCING)) && isMultiDrawn(call.mesh))
+		multi_draw.add(call.mesh, batch.first, batch.count);
+	else
+		drawBatch(shader, queue.getBatchModels(batch), batch.count, call.mesh);
+}
 
+//must be called before changing the shader or the material uniforms
+void Renderer::flushMultiDraw()
+{
+	if (multi_draw.flush())
+		num_draw_calls++;
+}
 
+void Renderer::renderQueueForward(Camera* camera)
+{
+	Shader* shader = NULL;
+	GLState::depthFunc(GL_LEQUAL);
 
-			assert(glGetError() == GL_NO_ERROR);
-			//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-			shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0);
+	//the queue is sorted by shader variant and material, only upload them when they change
+	GTR::Material* current_material = NULL;
+	for (int i = 0; i < render_queue.num_batches; ++i)
+	{
+		sRenderBatch& batch = render_queue.batches[i];
+		sRenderCall& call = render_queue.getBatchCall(batch);
+		if (!call.shader)
+			continue;
+		Shader* batch_shader = getBatchShader(call.shader, batch.count, NULL); //no indirect draws here
+		if (batch_shader != shader) {
+			shader = batch_shader;
+			shader->enable();
+			setForwardFrameUniforms(shader, camera);
+			current_material = NULL;
+		}
+		if (call.material != current_material) {
+			setForwardMaterialUniforms(shader, call.material);
+			current_material = call.material;
+		}
+		drawForwardBatch(shader, render_queue.getBatchModels(batch), batch.count, call.mesh);
+	}
 
-			//pass all uniforms corresponding to each light
-			shader->setUniform("u_light_color", light->getColor());
+	if (shader)
+		shader->disable();
+	GLState::disable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
+}
 
-			shader->setUniform("u_light_intensity", light->getIntensity());
+const std::vector<BaseEntity*>& Renderer::getEntitiesInFrustum(Scene* scene, Camera* camera, std::vector<BaseEntity*>& results)
+{
+	if (use_scene_tree) {
+		results.clear();
+		scene->entity_tree.queryFrustum(camera, results);
+		return results;
+	}
+	if (!use_batch_culling)
+		return scene->entities;
+
+	//the entities do not move during the frame, the same boxes serve the main view, the lights and the probes
+	int num = (int)scene->entities.size();
+	if (entity_boxes_frame != FrameArena::frame->frame_id || entity_boxes.num != num) {
+		entity_boxes.clear();
+		entity_boxes.reserve(num);
+		for (int i = 0; i < num; i++) {
+			BaseEntity* ent = scene->entities[i];
+			if (ent->type == PREFAB)
+				entity_boxes.add(((PrefabEntity*)ent)->world_bounding);
+			else
+				entity_boxes.add(BoundingBox(ent->model.getTranslation(), Vector3(0, 0, 0)));
+		}
+		entity_boxes_frame = FrameArena::frame->frame_id;
+	}
 
-			if (light->getType() == DIRECTIONAL) {
-				Vector3 light_direction = light->model.frontVector();
-				shader->setUniform("u_light_vector", light_direction);
-				shader->setUniform("u_light_type", 0.0f);
-				assert(glGetError() == GL_NO_ERROR);
-			}
-			else {
-				Vector3 light_pos = light->model.getTranslation();
-				shader->setUniform("u_light_position", light_pos);
-				shader->setUniform("u_light_maxdist", (float)light->getMaxDist());
-				if (light->getType() == OMNI) {
-					shader->setUniform("u_light_type", 1.0f);
-				}
-				else { //SPOT LIGHT
-					shader->setUniform("u_light_type", 2.0f);
-					Vector3 light_direction = light->model.frontVector();
-					shader->setUniform("spotDirection", light_direction);
-					shader->setUniform("spotCosineCutoff", Scene::getInstance()->lights[i]->getSpotAngle());
-					shader->setUniform("spotExponent", light->getSpotExponent());
-				}
+	culling_mask.resize(CullingBoxes::getMaskWords(num) + 1);
+	entity_boxes.cull(camera, &culling_mask[0]);
+	results.clear();
+	for (int i = 0; i < num; i++)
+		if (CullingBoxes::isVisible(&culling_mask[0], i))
+			results.push_back(scene->entities[i]);
+	return results;
+}
 
-			}
+//the occluders are the opaque nodes in the frustum that are big or flagged, and not too detailed
+OcclusionCuller* Renderer::renderOccluders(const std::vector<BaseEntity*>& entities, Camera* camera)
+{
+	if (!use_occlusion_culling)
+		return NULL;
 
-			mesh->render(GL_TRIANGLES);
-			it++;
+	occlusion_culler.begin(camera->viewprojection_matrix);
+	for (int i = 0; i < entities.size(); i++) {
+		BaseEntity* ent = entities[i];
+		if (ent->type != PREFAB || !ent->visible)
+			continue;
+		PrefabEntity* p = (PrefabEntity*)ent;
+		GTR::Prefab* prefab = p->getPrefab();
+		if (!prefab)
+			continue;
+		p->updateWorldCache();
+		for (int j = 0; j < prefab->flat_nodes.size(); ++j) {
+			Node* node = prefab->flat_nodes[j];
+			if (!node->visible || !node->mesh || !node->material || node->material->alpha_mode != NO_ALPHA)
+				continue;
+			Mesh* mesh = node->mesh;
+			BoundingBox& box = p->world_boxes[j];
+			if (!node->occluder && box.halfsize.length() < occluder_min_size)
+				continue;
+			if (!camera->testBoxInFrustum(box.center, box.halfsize))
+				continue;
+			if (mesh->interleaved.size())
+				occlusion_culler.addOccluder(p->world_models[j], &mesh->interleaved[0].vertex, sizeof(Mesh::tInterleaved), (int)mesh->interleaved.size(),
+					mesh->indices.size() ? (const unsigned int*)&mesh->indices[0] : NULL, mesh->indices.size() ? (int)mesh->indices.size() : (int)mesh->interleaved.size() / 3);
+			else if (mesh->vertices.size())
+				occlusion_culler.addOccluder(p->world_models[j], &mesh->vertices[0], sizeof(Vector3), (int)mesh->vertices.size(),
+					mesh->indices.size() ? (const unsigned int*)&mesh->indices[0] : NULL, mesh->indices.size() ? (int)mesh->indices.size() : (int)mesh->vertices.size() / 3);
 		}
-
 	}
-
-	//disable shader
-	shader->disable();
-
-	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS);
+	occlusion_culler.rasterize();
+	return &occlusion_culler;
 }
 
 void Renderer::renderForward(Scene* scene, Camera* camera) {
@@ -333,10 +579,8 @@ void Renderer::renderForward(Scene* scene, Camera* camera) {
 	
 
 	//glFrontFace(GL_CW);
-	glEnable(GL_DEPTH_TEST);
-	for (int i = 0; i < scene->lights.size(); i++) {
-		createShadowmap(scene->entities, scene->lights[i]);
-	}
+	GLState::enable(GL_DEPTH_TEST);
+	updateShadowmaps(scene, camera);
 	glFrontFace(GL_CCW);
 	//glDisable(GL_DEPTH_TEST);
 	
@@ -357,112 +601,371 @@ void Renderer::renderSceneForward(Scene* scene, Camera* camera) {
 	
 	renderSkybox(camera);
 
-	glEnable(GL_DEPTH_TEST);
-	for (int i = 0; i < scene->entities.size(); i++) {
+	GLState::enable(GL_DEPTH_TEST);
+	uploadLights(scene);
+	const std::vector<BaseEntity*>& entities = getEntitiesInFrustum(scene, camera, visible_entities);
+	render_queue.occlusion = renderOccluders(entities, camera);
+	render_queue.queries = NULL;
+	render_queue.collect(entities, camera, Shader::Get(forward_shader), pbr ? FEATURE(PBR) : 0);
+	renderQueueForward(camera);
+}
+
+//places the light cameras according to the light type and parameters
+void Renderer::setupShadowCamera(Light* l, Camera* camera) {
+	Camera* cameraL = l->camera; //reuse the light camera, no allocations per frame
+	Vector3 at = l->model.frontVector();
+	Vector3 up = l->model.rotateVector(Vector3(0, 1, 0));
+	if (l->getType() == SPOT) {
+		cameraL->setPerspective(acos(l->getSpotAngle()) * RAD2DEG + 40, 1, l->cnear, l->getMaxDist());
+		Vector3 pos = l->model.getTranslation();
+		cameraL->lookAt(pos, pos + at, up);
+	}
+	else
+		setupCascades(l, camera);
+}
+
+//permutation of the light shaders for the shadow the light has
+unsigned int Renderer::getLightFeatures(Light* l) {
+	unsigned int features = pbr ? FEATURE(PBR) : 0;
+	if (!l->shadow_tile_size)
+		return features;
+	if (l->getType() == DIRECTIONAL && l->num_cascades > 0)
+		return features | FEATURE(CASCADES);
+	if (l->getType() != OMNI)
+		features |= FEATURE(SHADOWMAP);
+	return features;
+}
+
+//splits the view in slices and fits an orthographic camera around every one
+void Renderer::setupCascades(Light* l, Camera* camera) {
+	Vector3 at = l->model.frontVector();
+	at.normalize();
+	Vector3 right = at.cross(l->model.rotateVector(Vector3(0, 1, 0)));
+	right.normalize();
+	Vector3 up = right.cross(at);
+
+	Vector3 front = camera->center - camera->eye;
+	front.normalize();
+	float n = camera->near_plane;
+	float f = (float)fmin(camera->far_plane, cascade_distance);
+
+	//half size of the view at distance 1
+	float tan_y = 0, tan_x = 0;
+	if (camera->type == Camera::PERSPECTIVE) {
+		tan_y = tan(camera->fov * 0.5f * DEG2RAD);
+		tan_x = tan_y * camera->aspect;
+	}
 
-		if (scene->entities.at(i)->type == PREFAB) {
-			PrefabEntity* p = new PrefabEntity();
-			p = (PrefabEntity*)scene->entities[i];
-			renderPrefab(scene->entities.at(i)->model, p->getPrefab(), camera);
+	float prev = n;
+	for (int i = 0; i < l->num_cascades; i++) {
+		//mix of logarithmic and uniform splits
+		float t = (i + 1) / (float)l->num_cascades;
+		float split = cascade_lambda * n * pow(f / n, t) + (1.0f - cascade_lambda) * (n + (f - n) * t);
+		l->cascade_splits[i] = split;
+
+		//bounding sphere of the slice, its size does not change when the camera rotates
+		float mid = (prev + split) * 0.5f;
+		Vector3 center = camera->eye + front * mid;
+		float radius = 0;
+		float depths[2] = { prev, split };
+		for (int j = 0; j < 2; j++) {
+			float w, h;
+			if (camera->type == Camera::PERSPECTIVE) {
+				w = depths[j] * tan_x;
+				h = depths[j] * tan_y;
+			}
+			else {
+				w = (camera->right - camera->left) * 0.5f;
+				h = (camera->top - camera->bottom) * 0.5f;
+			}
+			float d = depths[j] - mid;
+			radius = (float)fmax(radius, sqrt(d * d + w * w + h * h));
 		}
+
+		//move the center in whole texels so the shadow edges do not shimmer
+		int x, y, size;
+		shadow_atlas.getViewRect(l, i, x, y, size);
+		float texel = 2.0f * radius / size;
+		float cx = center.dot(right);
+		float cy = center.dot(up);
+		center = center + right * (floor(cx / texel) * texel - cx) + up * (floor(cy / texel) * texel - cy);
+
+		//room behind the slice for the casters
+		float depth = (float)fmax(radius, l->cfar * 0.5f);
+		Camera* cascade = l->cascade_cameras[i];
+		cascade->setOrthographic(-radius, radius, -radius, radius, 0.0f, depth + radius);
+		Vector3 pos = center - at * depth;
+		cascade->lookAt(pos, center, up);
+		prev = split;
 	}
 }
 
-void Renderer::createShadowmap(std::vector<BaseEntity*> ent, Light* l) {
-	if (l->getType() == DIRECTIONAL || l->getType() == SPOT) {
-		Shader* shader = NULL;
-		shader = Shader::Get("shadow");
-		shader->enable();
+//renders the shadowmaps only when something that affects them changed
+void Renderer::updateShadowmaps(Scene* scene, Camera* camera) {
+	shadowmaps_rendered = 0;
+	//first pass of the frame in both pipelines
+	num_draw_calls = num_instanced_draws = 0;
+	multi_draw.resetStats();
+
+	//with receiver culling the casters depend on the main camera
+	bool camera_moved = memcmp(shadow_camera_viewproj.m, camera->viewprojection_matrix.m, sizeof(Matrix44)) != 0;
+	shadow_camera_viewproj = camera->viewprojection_matrix;
+
+	//tiles that moved in the atlas are marked dirty
+	shadow_atlas.update(scene->lights, camera);
+
+	for (int i = 0; i < scene->lights.size(); i++) {
+		Light* l = scene->lights[i];
+		if (!l->shadow_tile_size)
+			continue;
+
+		setupShadowCamera(l, camera);
+		int num_views = l->getNumShadowViews();
+
+		//light moved or its projection changed
+		bool light_changed = !cache_shadows || l->shadow_dirty || (shadow_receiver_culling && camera_moved);
+		for (int v = 0; v < num_views && !light_changed; v++)
+			light_changed = memcmp(l->shadow_cached_viewproj[v].m, l->getShadowCamera(v)->viewprojection_matrix.m, sizeof(Matrix44)) != 0;
+
+		//casters that moved inside the light volume (before or after moving)
+		bool static_moved = false, dynamic_moved = false;
+		for (int j = 0; j < scene->moved_entities.size() && !light_changed; j++) {
+			PrefabEntity* p = (PrefabEntity*)scene->moved_entities[j];
+			bool inside = false;
+			for (int v = 0; v < num_views && !inside; v++) {
+				Camera* light_camera = l->getShadowCamera(v);
+				inside = light_camera->testBoxInFrustum(p->world_bounding.center, p->world_bounding.halfsize) ||
+					light_camera->testBoxInFrustum(p->prev_world_bounding.center, p->prev_world_bounding.halfsize);
+			}
+			if (!inside)
+				continue;
+			if (p->is_static && shadow_static_split)
+				static_moved = true;
+			else
+				dynamic_moved = true;
+		}
 
-		if (!l->shadow_fbo) {
-			l->shadow_fbo = new FBO();
-			//l->shadow_fbo->setDepthOnly(1024, 1024);
-			l->shadow_fbo->create(1024, 1024, 1);
+		if (!shadow_static_split) {
+			if (light_changed || dynamic_moved)
+				createShadowmap(scene, l, ALL_CASTERS);
 		}
+		else if (light_changed || static_moved || dynamic_moved) {
+			//static casters are cached in their own map and composited before drawing the dynamic ones
+			if (light_changed || static_moved)
+				createShadowmap(scene, l, STATIC_CASTERS);
+			createShadowmap(scene, l, DYNAMIC_CASTERS);
+		}
+
+		for (int v = 0; v < num_views; v++)
+			l->shadow_cached_viewproj[v] = l->getShadowCamera(v)->viewprojection_matrix;
+		l->shadow_dirty = false;
+	}
+}
 
-		l->shadow_fbo->bind();
-		//glColorMask(false, false, false, false);
-		glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+void Renderer::createShadowmap(Scene* scene, Light* l, eShadowCasters casters) {
+	if (l->shadow_tile_size) {
+		Shader* shader = NULL;
+		shader = Shader::Get(shadow_shader);
+		shader->enable();
 
-		Camera* main_camera = Camera::current;
-		Camera* cameraL = new Camera();
-		Vector3 at = l->model.frontVector();
-		Vector3 up = l->model.rotateVector(Vector3(0, 1, 0));
-		if (l->getType() == SPOT) {
-			cameraL->setPerspective(acos(l->getSpotAngle()) * RAD2DEG + 40, 1, l->cnear, l->getMaxDist());
-			Vector3 pos = l->model.getTranslation();
-			cameraL->lookAt(pos, pos + at, up);
+		//every light draws only inside its tile of the atlas
+		FBO* target = casters == STATIC_CASTERS ? shadow_atlas.getStaticFBO() : shadow_atlas.fbo;
+		int x = l->shadow_tile_x, y = l->shadow_tile_y, size = l->shadow_tile_size;
+
+		if (casters == DYNAMIC_CASTERS && shadow_atlas.static_fbo) {
+			//start from the cached static depth
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, shadow_atlas.static_fbo->fbo_id);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target->fbo_id);
+			glBlitFramebuffer(x, y, x + size, y + size, x, y, x + size, y + size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			target->bind();
+			shadow_atlas.setViewport(l);
+			GLState::enable(GL_SCISSOR_TEST);
 		}
 		else {
-			cameraL->setOrthographic(-l->frustrum, l->frustrum, -l->frustrum, l->frustrum, l->cnear, l->cfar); //to change
-			//Vector3 pos = Vector3(-500, 600, 500);
-			//Vector3 pos = Vector3(Camera::current->eye.x, 0, Camera::current->eye.z) - (at * 100);
-			Vector3 pos = Vector3(0, 0, 0) - (at * 500.0);
-			//float step = l->shadow_fbo->depth_texture->height / (2 * l->frustrum);
-			/*pos.x = floor(pos.x / step) * step;
-			pos.y = floor(pos.y / step) * step;
-			pos.z = floor(pos.z / step) * step;*/
-
-			cameraL->lookAt(pos, pos + at, up);
+			target->bind();
+			shadow_atlas.setViewport(l);
+			GLState::enable(GL_SCISSOR_TEST);
+			glClear(GL_DEPTH_BUFFER_BIT);
 		}
 
-		l->camera = cameraL;
-		l->camera->enable();
-		
-		for (int i = 0; i < ent.size(); i++) {
-			if (ent[i]->type == PREFAB) {
-				PrefabEntity* p = new PrefabEntity();
-				p = (PrefabEntity*)ent[i];
-				checkRendering(p, shader, l, &p->getPrefab()->root);
+		Camera* main_camera = Camera::current;
+
+		//the dynamic pass adds to the counters of the static one
+		if (casters != DYNAMIC_CASTERS || !shadow_atlas.static_fbo)
+			l->shadow_casters = l->shadow_culled = 0;
+
+		//every cascade only draws the casters inside its own box
+		for (int v = 0; v < l->getNumShadowViews(); v++) {
+			Camera* light_camera = l->getShadowCamera(v);
+			light_camera->enable();
+			shadow_atlas.setViewport(l, v);
+
+			const std::vector<BaseEntity*>& ent = getEntitiesInFrustum(scene, light_camera, caster_entities);
+
+			//upper bound of casters for the queue
+			int max_casters = 0;
+			for (int i = 0; i < ent.size(); i++)
+				if (ent[i]->type == PREFAB && ((PrefabEntity*)ent[i])->getPrefab())
+					max_casters += (int)((PrefabEntity*)ent[i])->getPrefab()->flat_nodes.size();
+
+			//the casters of all the entities go to one queue, so the repeated ones are drawn instanced
+			shadow_queue.begin(light_camera, max_casters);
+			for (int i = 0; i < ent.size(); i++) {
+				if (ent[i]->type == PREFAB) {
+					if (casters == STATIC_CASTERS && !ent[i]->is_static)
+						continue;
+					if (casters == DYNAMIC_CASTERS && ent[i]->is_static)
+						continue;
+					PrefabEntity* p = (PrefabEntity*)ent[i];
+					checkRendering(p, shader, l, light_camera, main_camera);
+				}
 			}
+			shadow_queue.sort();
+			renderShadowQueue(light_camera);
 		}
 
-		l->shadow_fbo->unbind();
-		glColorMask(true, true, true, true);
+		GLState::disable(GL_SCISSOR_TEST);
+		target->unbind();
 		shader->disable();
 		main_camera->enable();
+		shadowmaps_rendered++;
 	}
 
 }
 
-void Renderer::checkRendering(PrefabEntity* p, Shader* s, Light* l, GTR::Node* n) {
-	if (n->children.size() != 0) {
-		for (int i = 0; i < n->children.size(); i++) {
-			checkRendering(p, s, l, n->children[i]);
-		}
+//where to read the shadow of the light in the atlas, directional lights use the cascades
+void Renderer::setShadowUniforms(Shader* shader, Light* l) {
+	shader->setUniform("u_shadow_tile", l->shadow_tile);
+	shader->setUniform("u_shadow_viewproj", l->getCamera()->viewprojection_matrix);
+
+	int num_cascades = l->getType() == DIRECTIONAL && l->shadow_tile_size ? l->num_cascades : 0;
+	shader->setUniform("u_num_cascades", num_cascades);
+	if (!num_cascades)
+		return;
+
+	Matrix44 viewprojs[MAX_CASCADES];
+	Vector4 tiles[MAX_CASCADES];
+	for (int i = 0; i < num_cascades; i++) {
+		viewprojs[i] = l->cascade_cameras[i]->viewprojection_matrix;
+		tiles[i] = shadow_atlas.getViewTile(l, i);
+	}
+	shader->setMatrix44Array("u_cascade_viewproj", viewprojs, num_cascades);
+	shader->setUniform4Array("u_cascade_tiles", (float*)tiles, num_cascades);
+}
+
+//true if the shadow of the box could fall inside the camera frustum,
+//the box is extruded away from the light as far as the light reaches
+static bool shadowReachesCamera(const BoundingBox& box, Light* l, Camera* camera) {
+	BoundingBox end = box;
+	if (l->getType() == DIRECTIONAL) {
+		end.center = box.center + l->model.frontVector() * l->cfar;
 	}
 	else {
-		if (n->material->alpha_mode == GTR::AlphaMode::NO_ALPHA) {
-			assert(glGetError() == GL_NO_ERROR);
-			s->setUniform("u_viewprojection", l->getCamera()->viewprojection_matrix);
-			s->setUniform("u_model", n->getGlobalMatrix(true) * p->model);
-			if(n->material->color_texture)
-				s->setUniform("u_texture", n->material->color_texture, 1);
-			else
-				s->setUniform("u_texture", Texture::getWhiteTexture(), 1);
+		Vector3 light_pos = l->model.getTranslation();
+		Vector3 dir = box.center - light_pos;
+		float dist = dir.length();
+		float len = l->getMaxDist() - dist;
+		if (len <= 0.0f || dist < 0.0001f)
+			return camera->testBoxInFrustum(box.center, box.halfsize) != CLIP_OUTSIDE;
+		end.center = box.center + dir * (len / dist);
+		//the shadow grows with the distance to a point light
+		end.halfsize = box.halfsize * (l->getMaxDist() / dist);
+	}
+	BoundingBox swept = mergeBoundingBoxes(box, end);
+	return camera->testBoxInFrustum(swept.center, swept.halfsize) != CLIP_OUTSIDE;
+}
 
-			assert(glGetError() == GL_NO_ERROR);
-			n->mesh->render(GL_TRIANGLES);
+void Renderer::checkRendering(PrefabEntity* p, Shader* s, Light* l, Camera* light_camera, Camera* camera) {
+	p->updateWorldCache();
 
+	GTR::Prefab* prefab = p->getPrefab();
+
+	//whole entity outside the light
+	if (!light_camera->testBoxInFrustum(p->world_bounding.center, p->world_bounding.halfsize)) {
+		l->shadow_culled++;
+		return;
+	}
+
+	//same subtree culling as the main view
+	int inside_end = 0;
+	for (int i = 0; i < prefab->flat_nodes.size(); ) {
+		GTR::Node* n = prefab->flat_nodes[i];
+		if (!n->visible || !p->subtree_has_mesh[i]) {
+			i = prefab->flat_subtree_end[i];
+			continue;
 		}
+		char clip = CLIP_INSIDE;
+		if (i >= inside_end) {
+			BoundingBox& subtree = p->world_subtree_boxes[i];
+			clip = light_camera->testBoxInFrustum(subtree.center, subtree.halfsize);
+			if (clip == CLIP_OUTSIDE) {
+				l->shadow_culled++;
+				i = prefab->flat_subtree_end[i];
+				continue;
+			}
+			if (clip == CLIP_INSIDE)
+				inside_end = prefab->flat_subtree_end[i];
+		}
+		if (n->mesh && n->material && n->material->alpha_mode == GTR::AlphaMode::NO_ALPHA) {
+			BoundingBox& box = p->world_boxes[i];
+			bool cast = clip == CLIP_INSIDE || prefab->flat_subtree_end[i] == i + 1 || light_camera->testBoxInFrustum(box.center, box.halfsize) != CLIP_OUTSIDE;
+			if (cast && camera && shadow_receiver_culling)
+				cast = shadowReachesCamera(box, l, camera);
+			if (!cast) {
+				l->shadow_culled++;
+				++i;
+				continue;
+			}
+
+			shadow_queue.add(n->mesh, n->material, s, p->world_models[i], light_camera);
+			l->shadow_casters++;
+		}
+		++i;
+	}
+}
+
+//draws the casters collected for one view of the light, the atlas viewport must be set
+void Renderer::renderShadowQueue(Camera* light_camera) {
+	Shader* shader = NULL;
+	Texture* texture = NULL; //the only material state of the shadow shader
+	beginMultiDraw(shadow_queue);
+	for (int i = 0; i < shadow_queue.num_batches; ++i) {
+		sRenderBatch& batch = shadow_queue.batches[i];
+		sRenderCall& call = shadow_queue.getBatchCall(batch);
+
+		Shader* batch_shader = getBatchShader(call.shader, batch.count, call.mesh);
+		Texture* batch_texture = call.material->color_texture ? call.material->color_texture : Texture::getWhiteTexture();
+		if (batch_shader != shader || batch_texture != texture)
+			flushMultiDraw();
+		if (batch_shader != shader) {
+			shader = batch_shader;
+			shader->enable();
+			shader->setUniform(UNIFORM_u_viewprojection, light_camera->viewprojection_matrix);
+			texture = NULL;
+		}
+		if (batch_texture != texture) {
+			texture = batch_texture;
+			shader->setUniform(UNIFORM_u_texture, texture, 1);
+		}
+		submitBatch(shadow_queue, batch, shader);
 	}
+	flushMultiDraw();
+	assert(glGetError() == GL_NO_ERROR);
 }
 
 void Renderer::renderSceneInDeferred(Scene* scene, Camera* camera) {
 
 	//glFrontFace(GL_CW);
-	for (int i = 0; i < scene->lights.size(); i++) {
-		createShadowmap(scene->entities, scene->lights[i]);
-		//scene->lights[i]->renderSphere(camera);
-	}
+	updateShadowmaps(scene, camera);
 	glFrontFace(GL_CCW);
 
 
-	renderMeshinDeferred(scene->entities, camera);
+	renderMeshinDeferred(getEntitiesInFrustum(scene, camera, visible_entities), camera);
 	
 }
 
-void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* camera) {
+void Renderer::renderMeshinDeferred(const std::vector<BaseEntity*>& entities, Camera* camera) {
 	int height = Application::instance->window_height;
 	int width = Application::instance->window_width;
 
@@ -470,7 +973,7 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		deferred_fbo = new FBO();
 		deferred_fbo->create(width, height, 4, GL_RGBA, GL_HALF_FLOAT, true);
 		complete_fbo = new FBO();
-		complete_fbo->create(width, height, 2, GL_RGB, GL_FLOAT);
+		complete_fbo->create(width, height, 2, GL_RGB, GL_FLOAT, true, true);
 		ssao_fbo = new FBO();
 		ssao_fbo->create(width, height, 1, GL_RGBA);
 		aux = new FBO(); 
@@ -507,13 +1010,16 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 	
 	
 	//Render entities
-	for (int i = 0; i < entities.size(); i++) {
-		if (entities.at(i)->type == PREFAB) {
-			PrefabEntity* p = new PrefabEntity();
-			p = (PrefabEntity*)entities[i];
-			renderPrefabDeferred(entities[i]->model, p->getPrefab(), camera);
-		}
+	render_queue.occlusion = renderOccluders(entities, camera);
+	render_queue.queries = NULL;
+	if (use_occlusion_queries) {
+		occlusion_queries.beginFrame();
+		render_queue.queries = &occlusion_queries;
 	}
+	render_queue.collect(entities, camera, Shader::Get(gbuffer_shader), SHinterpolation ? FEATURE(SH_INTERPOLATION) : 0);
+	renderQueueDeferred(camera);
+	if (use_occlusion_queries)
+		renderQueriedCalls(camera);
 	
 
 	
@@ -534,10 +1040,10 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		deferred_fbo->depth_texture->copyTo(decal_depth_texture);
 
 		deferred_fbo->bind();
-		glEnable(GL_DEPTH_TEST);
-		glEnable(GL_CULL_FACE);
-		glEnable(GL_BLEND);
-		glDepthMask(false);
+		GLState::enable(GL_DEPTH_TEST);
+		GLState::enable(GL_CULL_FACE);
+		GLState::enable(GL_BLEND);
+		GLState::depthMask(false);
 
 		Matrix44 m, invm;
 		m.setTranslation(260, 130, -200);
@@ -559,12 +1065,12 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		
 		cube->render(GL_TRIANGLES);
 		shader->disable();
-		glDepthMask(true);
+		GLState::depthMask(true);
 		deferred_fbo->unbind();
 		
 	}
 
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_DEPTH_TEST);
 
 	Mesh* quad = Mesh::getQuad();
 
@@ -586,9 +1092,9 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		ssao_fbo->unbind();
 	}
 	
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ONE);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_BLEND);
+	GLState::blendFunc(GL_ONE, GL_ONE);
 
 	if (show_properties) { //Pintar Frame Buffers
 		glViewport(0, height * 0.5, width * 0.5, height * 0.5);
@@ -621,15 +1127,14 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		renderSkybox(camera);
 
 		glClearColor(0.0f, 0.0f, 0.0f, 1.0);
-		glDisable(GL_DEPTH_TEST);
+		GLState::disable(GL_DEPTH_TEST);
 
 		//Apliquem deferred
-		Shader* shader1 = Shader::Get("deferred");
-		shader1->enable();
+		Shader* deferred_shader = Shader::Get("deferred");
 
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 
-		//===================== SCENE ILUMINATION FOR SPOT AND POINT LIGHTS =========================//
+		//===================== SCENE ILUMINATION FOR DIRECTIONAL LIGHTS =========================//
 		float amb = Scene::getInstance()->ambient_light;
 		Texture* irr = deferred_fbo->color_textures[3];
 		Scene* scene = Scene::getInstance();
@@ -637,9 +1142,11 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 			Light* light = (*it);
 
 			if (light->visible) {
-				if (light->getType() == SPOT || light->getType() == DIRECTIONAL) {
+				//spots and omnis are shaded by the clusters or by their light volumes
+				if (light->getType() == DIRECTIONAL) {
+					Shader* shader1 = deferred_shader->getVariant(getLightFeatures(light));
+					shader1->enable();
 					shader1->setUniform("degamma", degamma);
-					shader1->setUniform("pbr", pbr);
 					shader1->setUniform("ssao", apply_ssao);
 					shader1->setUniform("u_light_maxdist", light->getMaxDist());
 					shader1->setUniform("u_color_texture", deferred_fbo->color_textures[0], 0);
@@ -665,86 +1172,46 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 					shader1->setUniform("u_shadow_viewproj", light->getCamera()->viewprojection_matrix);
 					shader1->setUniform("u_shadow_bias", light->shadow_bias * 0.1f);
 					shader1->setUniform("u_camera_pos", camera->eye);
-					if (light->shadow_fbo) {
-						shader1->setUniform("shadow_map", light->shadow_fbo->depth_texture, 8);
+					setShadowUniforms(shader1, light);
+					if (light->shadow_tile_size) {
+						Texture* shadowmap = shadow_atlas.fbo->depth_texture;
+						shader1->setUniform("shadow_map", shadowmap, 8);
 
-						shader1->setUniform("gShadowMap", light->shadow_fbo->depth_texture, 8);
-						shader1->setUniform("gMapSize", Vector2(light->shadow_fbo->depth_texture->width, light->shadow_fbo->depth_texture->height));
+						shader1->setUniform("gShadowMap", shadowmap, 8);
+						shader1->setUniform("gMapSize", Vector2(shadowmap->width, shadowmap->height));
 					}
 
-					if (light->getType() == SPOT) {
-						shader1->setUniform("u_light_type", (float)2.0);
-						Vector3 light_direction = light->model.frontVector();
-						shader1->setUniform("spotDirection", light_direction);
-						shader1->setUniform("spotCosineCutoff", light->getSpotAngle());
-						shader1->setUniform("spotExponent", (float)3.0);
-					}
-					else if (light->getType() == DIRECTIONAL) {
-						shader1->setUniform("u_light_type", (float)0.0);
-						Vector3 at = light->model.frontVector();
-						shader1->setUniform("u_light_vector", at);
-
-					}
+					shader1->setUniform("u_light_type", (float)0.0);
+					shader1->setUniform("u_light_vector", light->model.frontVector());
 					quad->render(GL_TRIANGLES);
-					glEnable(GL_BLEND);
+					shader1->disable();
+					GLState::enable(GL_BLEND);
 				}
 			}
 		}
-		shader1->disable();
 
-		//===================== SCENE ILUMINATION FOR DIRECTIONAL LIGHTS =========================//
-		glEnable(GL_CULL_FACE);
-		Shader* shader2 = Shader::Get("deferred_ws");
-		Mesh* sphere = Mesh::Get("data/meshes/sphere.obj");
-		shader2->enable();
-
-		for (std::vector<Light*>::iterator it = scene->lights.begin(); it < scene->lights.end(); it++) {
-			Light* light = (*it);
-
-			if (light->visible) {
-				if (light->getType() == OMNI) {
-
-					shader2->setUniform("u_viewprojection", camera->viewprojection_matrix);
-					Matrix44 ma;
-					Vector3 pos = light->model.getTranslation();
-					ma.setTranslation(pos.x, pos.y, pos.z);
-					ma.scale(light->getMaxDist(), light->getMaxDist(), light->getMaxDist());
-
-					shader2->setUniform("u_model", ma);
-
-					shader2->setUniform("degamma", degamma);
-					shader2->setUniform("pbr", pbr);
-
-					shader2->setUniform("u_light_maxdist", light->getMaxDist());
-					shader2->setUniform("u_color_texture", deferred_fbo->color_textures[0], 0);
-					shader2->setUniform("u_normal_texture", deferred_fbo->color_textures[1], 1);
-					shader2->setUniform("u_extra_texture", deferred_fbo->color_textures[2], 2);
-					shader2->setUniform("u_depth_texture", deferred_fbo->depth_texture, 3);
-					shader2->setUniform("u_ambient_texture", ssao_fbo->color_textures[0], 4);
-
-					shader2->setUniform("u_inverse_viewprojection", inv_viewprojection);
-					Vector3 light_pos = light->model.getTranslation();
-					shader2->setUniform("u_light_position", light_pos);
-					shader2->setUniform("u_light_color", light->getColor());
-					shader2->setUniform("u_light_intensity", light->getIntensity());
-					shader2->setUniform("u_ambient_light", 0.0f);
-
-					shader2->setUniform("u_iRes", Vector2(1.0 / deferred_fbo->width, 1.0 / deferred_fbo->height));
-					shader2->setUniform("u_shadow_viewproj", light->getCamera()->viewprojection_matrix);
-					shader2->setUniform("u_shadow_bias", light->shadow_bias);
-					shader2->setUniform("u_camera_pos", camera->eye);
-					shader2->setUniform("u_light_type", (float)1.0);
-
-					glDisable(GL_DEPTH_TEST);
-					glEnable(GL_CULL_FACE);
-					glFrontFace(GL_CW);
-					sphere->render(GL_TRIANGLES);
-					glFrontFace(GL_CCW);
-					glDisable(GL_CULL_FACE);
-				}
+		//===================== SCENE ILUMINATION FOR OMNI AND SPOT LIGHTS =========================//
+		if (use_clustered) {
+			buildLightClusters(scene, camera);
+			renderClusteredLights(camera, inv_viewprojection, amb, irr);
+		}
+		else {
+			//the ambient was added by the first directional light, if there was none it needs its own pass
+			if (amb != 0.0f) {
+				Shader* shader1 = deferred_shader->getVariant(pbr ? FEATURE(PBR) : 0);
+				shader1->enable();
+				setLightPassUniforms(shader1, camera, inv_viewprojection);
+				shader1->setUniform("u_light_type", -1.0f);
+				shader1->setUniform("u_irradiance_texture", irr, 3);
+				shader1->setUniform1("u_ambient_light", amb);
+				shader1->setUniform("u_shadow_tile", Vector4(0, 0, 0, 0));
+				shader1->setUniform("u_num_cascades", 0);
+				quad->render(GL_TRIANGLES);
+				shader1->disable();
+				GLState::enable(GL_BLEND);
 			}
+			renderLightVolumes(scene, camera, inv_viewprojection);
 		}
-		shader2->disable();
 
 		//complete_fbo->unbind();
 
@@ -757,8 +1224,8 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		//======================== POST ============================//
 
 		//=============== REFLECTIONS ==============//
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		if (apply_environmentReflections && skybox) { 
 
 			Mesh* quadr = Mesh::getQuad();
@@ -802,8 +1269,8 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		
 
 		//la light[0] es la directional (llum del sol)
-		if (scene->lights[0] && scene->lights[0]->shadow_fbo && apply_volumetric) {
-			glDisable(GL_BLEND);
+		if (scene->lights[0] && scene->lights[0]->shadow_tile_size && apply_volumetric) {
+			GLState::disable(GL_BLEND);
 
 			noise->bind();
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -824,7 +1291,8 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 
 			shader->setUniform("u_shadow_viewproj", scene->lights[0]->getCamera()->viewprojection_matrix);
 			shader->setUniform("u_shadow_bias", scene->lights[0]->shadow_bias);
-			shader->setUniform("shadow_map", scene->lights[0]->shadow_fbo->depth_texture, 8);
+			shader->setUniform("shadow_map", shadow_atlas.fbo->depth_texture, 8);
+			setShadowUniforms(shader, scene->lights[0]);
 
 			shader->setUniform("u_random_vector", Vector3(random(), random(), random()));
 			shader->setUniform("u_noise_texture", noise, 5);
@@ -833,18 +1301,18 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 			shader->disable();
 			volumetric_fbo->unbind();
 
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 			complete_fbo->bind();
 			volumetric_fbo->color_textures[0]->toViewport();
-			glDisable(GL_BLEND);
+			GLState::disable(GL_BLEND);
 
 		}
 
 
 		if (apply_glow) {
 			complete_fbo->color_textures[1]->copyTo(aux->color_textures[0]);
-			glBlendFunc(GL_ONE, GL_ONE);
+			GLState::blendFunc(GL_ONE, GL_ONE);
 			for (int i = 0; i < 10; i++) {
 
 				aux2->bind();
@@ -858,13 +1326,13 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 				aux->unbind();
 			}
 			complete_fbo->bind();
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_COLOR, GL_ONE);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_COLOR, GL_ONE);
 			//glBlendFunc(GL_ONE, GL_ONE);
 
 			aux->color_textures[0]->toViewport();
 			complete_fbo->unbind();
-			glDisable(GL_BLEND);
+			GLState::disable(GL_BLEND);
 		}
 
 
@@ -872,11 +1340,7 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 		complete_fbo->unbind();
 		if (apply_tonemapper) {
 			Shader* tonemapper = Shader::Get("tonemapper");
-			tonemapper->enable();
-			tonemapper->setUniform("u_scale", u_scale);
-			tonemapper->setUniform("u_average_lum", u_average_lum);
-			tonemapper->setUniform("u_lumwhite2", u_lumwhite2 * u_lumwhite2);
-			tonemapper->setUniform("u_igamma", 1.0f / u_igamma);
+			tonemapper->enable(); //scale, lum and gamma come from the FrameBlock
 			complete_fbo->color_textures[0]->toViewport(tonemapper);
 		}
 		else {
@@ -887,14 +1351,14 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 
 		if (show_reflectionProbes) {
 			glClear(GL_DEPTH_BUFFER_BIT);
-			glEnable(GL_DEPTH_TEST);
+			GLState::enable(GL_DEPTH_TEST);
 			for (int i = 0; i < reflection_probes.size(); i++)
 				renderReflectionProbe(reflection_probes[i]->pos, 4, reflection_probes[i]->cubemap, camera);
 		}
 
 		if (show_probes) {
 			glClear(GL_DEPTH_BUFFER_BIT);
-			glEnable(GL_DEPTH_TEST);
+			GLState::enable(GL_DEPTH_TEST);
 			for (int i = 0; i < probes.size(); i++)
 				renderProbe(probes[i].pos, 4, (float*)&probes[i].sh, camera, deferred_fbo->depth_texture);
 		}
@@ -904,125 +1368,388 @@ void Renderer::renderMeshinDeferred(std::vector<BaseEntity*> entities, Camera* c
 	}
 }
 
-void Renderer::renderPrefabDeferred(const Matrix44& model, GTR::Prefab* prefab, Camera* camera){
-	renderNodeDeferred(model, &prefab->root, camera);
-}
+//submits the sorted render queue to the gbuffers, only changing shader and material state when the key changes
+void Renderer::renderQueueDeferred(Camera* camera) {
+	Shader* shader = NULL;
+	GTR::Material* material = NULL;
+
+	GLState::disable(GL_BLEND);
+	uploadFrameBlock(camera);
+	beginMultiDraw(render_queue);
+
+	for (int i = 0; i < render_queue.num_batches; ++i) {
+		sRenderBatch& batch = render_queue.batches[i];
+		sRenderCall& call = render_queue.getBatchCall(batch);
+		if (!call.shader)
+			continue;
+
+		Shader* batch_shader = getBatchShader(call.shader, batch.count, call.mesh);
+		if (batch_shader != shader || call.material != material)
+			flushMultiDraw();
+		if (batch_shader != shader) {
+			shader = batch_shader;
+			shader->enable();
+			setDeferredFrameUniforms(shader, camera);
+			material = NULL;
+		}
 
-void Renderer::renderNodeDeferred(const Matrix44& prefab_model, GTR::Node* node, Camera* camera) {
-	if (!node->visible)
-		return;
+		if (call.material != material) {
+			material = call.material;
+			setDeferredMaterialUniforms(shader, material);
+		}
 
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+		submitBatch(render_queue, batch, shader);
+	}
+	flushMultiDraw();
 
-	if (node->mesh && node->material){
-		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
+	if (shader)
+		shader->disable();
+	GLState::disable(GL_BLEND);
+	assert(glGetError() == GL_NO_ERROR);
+}
 
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize)){
-			renderMeshWithMaterialDeferred(node_model, node->mesh, node->material, camera);
-		}
+//one gbuffer draw of a call taken out of the queue, changing shader and material only if needed
+void Renderer::drawQueriedCall(sRenderCall& call, Shader*& shader, GTR::Material*& material, Camera* camera) {
+	if (call.shader != shader) {
+		shader = call.shader;
+		shader->enable();
+		setDeferredFrameUniforms(shader, camera);
+		material = NULL;
+	}
+	if (call.material != material) {
+		material = call.material;
+		setDeferredMaterialUniforms(shader, material);
 	}
-	for (int i = 0; i < node->children.size(); ++i)
-		renderNodeDeferred(prefab_model, node->children[i], camera);
+	shader->setUniform(UNIFORM_u_model, call.model);
+	call.mesh->render(GL_TRIANGLES);
+	num_draw_calls++;
 }
 
-void Renderer::renderMeshWithMaterialDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera) {
-	if (!mesh || !mesh->getNumVertices() || !material)
-		return;
-	assert(glGetError() == GL_NO_ERROR);
-	Shader* shader = NULL;
-	Texture* texture = NULL;
+void Renderer::renderQueriedCalls(Camera* camera) {
+	OcclusionQueries& queries = occlusion_queries;
+
+	//boxes against the depth of the visible objects, writing nothing
+	if (queries.box_queries.size()) {
+		Shader* flat = Shader::Get("flat");
+		flat->enable();
+		flat->setUniform(UNIFORM_u_viewprojection, camera->viewprojection_matrix);
+		glColorMask(false, false, false, false);
+		GLState::depthMask(false);
+		GLState::disable(GL_CULL_FACE);
+		Mesh* cube = Mesh::getCube();
+		for (int i = 0; i < queries.box_queries.size(); ++i) {
+			sBoxQuery& box_query = queries.box_queries[i];
+			Matrix44 model;
+			model.setScale(box_query.box->halfsize.x, box_query.box->halfsize.y, box_query.box->halfsize.z);
+			model.translateGlobal(box_query.box->center.x, box_query.box->center.y, box_query.box->center.z);
+			flat->setUniform(UNIFORM_u_model, model);
+			queries.beginQuery(box_query.state);
+			cube->render(GL_TRIANGLES);
+			queries.endQuery(box_query.state);
+		}
+		glColorMask(true, true, true, true);
+		GLState::depthMask(true);
+		flat->disable();
+	}
 
-	texture = material->color_texture;
-	//texture = material->emissive_texture;
-	//texture = material->metallic_roughness_texture;
-	//texture = material->normal_texture;
-	//texture = material->occlusion_texture;
-	if (texture == NULL)
-		texture = Texture::getWhiteTexture();
+	//hidden objects are drawn only if their box passed, decided in the GPU without waiting in the CPU
+	Shader* shader = NULL;
+	GTR::Material* material = NULL;
+	for (int i = 0; i < queries.hidden_calls.size(); ++i) {
+		sQueriedCall& hidden = queries.hidden_calls[i];
+		glBeginConditionalRender(hidden.state->query, GL_QUERY_WAIT);
+		drawQueriedCall(hidden.call, shader, material, camera);
+		glEndConditionalRender();
+	}
 
-	//select the blending
-	glDisable(GL_BLEND);
+	//visible objects due for a check, their own geometry inside the query
+	for (int i = 0; i < queries.checked_calls.size(); ++i) {
+		sQueriedCall& checked = queries.checked_calls[i];
+		queries.beginQuery(checked.state);
+		drawQueriedCall(checked.call, shader, material, camera);
+		queries.endQuery(checked.state);
+	}
 
-	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
-	else
-		glEnable(GL_CULL_FACE);
+	if (shader)
+		shader->disable();
 	assert(glGetError() == GL_NO_ERROR);
+}
 
-	shader = Shader::Get("multi");
+//camera, irradiance grid and global parameters, shared by every shader that declares the FrameBlock
+void Renderer::uploadFrameBlock(Camera* camera) {
+	if (!frame_ubo) {
+		frame_ubo = new UBO();
+		frame_ubo->create(sizeof(sFrameBlock), FRAME_UBO_BINDING);
+	}
 
-	assert(glGetError() == GL_NO_ERROR);
+	sFrameBlock& b = frame_block;
+	b.viewprojection = camera->viewprojection_matrix;
+	b.camera_position = Vector4(camera->eye, getTime() * 0.001f);
+	b.irr_start = Vector4(start_pos, dim.x * dim.y * dim.z);
+	b.irr_end = Vector4(end_pos, 0.0f);
+	b.irr_delta = Vector4(delta, 0.0f);
+	b.irr_dims = Vector4(dim, 0.0f);
+	b.tonemapper = Vector4(u_scale, u_average_lum, u_lumwhite2 * u_lumwhite2, 1.0f / u_igamma);
+	b.flags = Vector4(degamma ? 1.0f : 0.0f, SHinterpolation ? 1.0f : 0.0f, pbr ? 1.0f : 0.0f, Scene::getInstance()->ambient_light);
+	frame_ubo->upload(&frame_block, sizeof(sFrameBlock));
+}
 
-	if (!shader)
-		return;
-	shader->enable();
+//every material gets an aligned range of the buffer the first time it is used,
+//after that it is only uploaded again if it was edited
+void Renderer::bindMaterialBlock(GTR::Material* material) {
+	if (!materials_ubo) {
+		int alignment = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		material_stride = ((sizeof(sMaterialBlock) + alignment - 1) / alignment) * alignment;
+		materials_ubo = new UBO();
+		materials_ubo->create(material_stride * 64, MATERIAL_UBO_BINDING);
+	}
 
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	assert(glGetError() == GL_NO_ERROR);
-	shader->setUniform("u_model", model);
+	if (material->block_index == -1) {
+		if ((num_material_blocks + 1) * material_stride > materials_ubo->size)
+			materials_ubo->resize(materials_ubo->size * 2);
+		material->block_index = num_material_blocks++;
+		material->block_dirty = true;
+	}
+
+	int offset = material->block_index * material_stride;
+	if (material->block_dirty) {
+		sMaterialBlock b;
+		b.color = material->color;
+		Vector3 emissive = material->emissive_texture ? Vector3(0, 0, 0) : material->emissive_factor;
+		b.emissive_factor = Vector4(emissive, (float)material->texture_rep);
+		b.params = Vector4(material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0.0f,
+			material->normal_texture ? 1.0f : 0.0f, material->roughness_factor, material->metallic_factor);
+		materials_ubo->upload(&b, sizeof(sMaterialBlock), offset);
+		material->block_dirty = false;
+	}
+	materials_ubo->bindRange(offset, sizeof(sMaterialBlock));
+}
+
+//uniforms that are the same for every mesh rendered with this shader, the rest is in the FrameBlock
+void Renderer::setDeferredFrameUniforms(Shader* shader, Camera* camera) {
+	///////////////////IRADIANCE
+	if (probes_texture)
+		shader->setUniform(UNIFORM_u_probes_texture, probes_texture, 4);
+	else
+		shader->setUniform(UNIFORM_u_probes_texture, Texture::getBlackTexture(), 4);
 	assert(glGetError() == GL_NO_ERROR);
+}
+
+//uniforms and state that only change when the material changes
+void Renderer::setDeferredMaterialUniforms(Shader* shader, GTR::Material* material) {
+	Texture* texture = material->color_texture;
+	if (texture == NULL)
+		texture = Texture::getWhiteTexture();
+
+	if (material->two_sided)
+		GLState::disable(GL_CULL_FACE);
+	else
+		GLState::enable(GL_CULL_FACE);
 
 	//ROUGHNESS-METALLIC
 	if (material->metallic_roughness_texture)
-		shader->setUniform("u_material_map", material->metallic_roughness_texture, 1);
+		shader->setUniform(UNIFORM_u_material_map, material->metallic_roughness_texture, 1);
 	else
-		shader->setUniform("u_material_map", Texture::getBlackTexture(), 1);
+		shader->setUniform(UNIFORM_u_material_map, Texture::getBlackTexture(), 1);
 
 	//NORMAL MAP
-	if (material->normal_texture) {
-		shader->setUniform("u_normal_map", material->normal_texture, 2);
-		float normal = 1.0;
-		shader->setUniform("hasNormalmap", normal);
-	}
-	else {
-		float normal = 0.0;
-		shader->setUniform("hasNormalmap", normal);
-	}
+	if (material->normal_texture)
+		shader->setUniform(UNIFORM_u_normal_map, material->normal_texture, 2);
 
+	//EMISSIVE
+	if (material->emissive_texture)
+		shader->setUniform(UNIFORM_u_emissive_texture, material->emissive_texture, 3);
+	else
+		shader->setUniform(UNIFORM_u_emissive_texture, Texture::getBlackTexture(), 3);
 
-	shader->setUniform("SHinterp", SHinterpolation);
+	shader->setUniform(UNIFORM_u_texture, texture, 0);
 
-	//EMISSIVE
-	if (material->emissive_texture) {
-		shader->setUniform("u_emissive_texture", material->emissive_texture, 3);
-		shader->setUniform("u_emissive_factor", Vector3(0,0,0) );
-	}
-	else{
-		shader->setUniform("u_emissive_texture", Texture::getBlackTexture(), 3);
-	shader->setUniform("u_emissive_factor", material->emissive_factor);
+	//color, factors and flags
+	bindMaterialBlock(material);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+//packs the visible omni and spot lights and bins them in the clusters of the camera
+void Renderer::buildLightClusters(Scene* scene, Camera* camera) {
+	sLightData* data = FrameArena::frame->allocArray<sLightData>(scene->lights.size() + 1);
+	int num = 0;
+	for (int i = 0; i < scene->lights.size(); i++) {
+		Light* l = scene->lights[i];
+		if (!l->visible || l->getType() == DIRECTIONAL)
+			continue;
+		if (camera->testSphereInFrustum(l->model.getTranslation(), l->getMaxDist()) == CLIP_OUTSIDE)
+			continue;
+		l->fillShaderData(data[num++], false);
 	}
+	light_clusters.build(data, num, camera);
+}
+
+//one fullscreen quad for all the local lights, blended over the directional passes if there were any
+void Renderer::renderClusteredLights(Camera* camera, const Matrix44& inv_viewprojection, float ambient, Texture* irradiance) {
+	Mesh* quad = Mesh::getQuad();
+	Shader* shader = Shader::Get("deferred_clustered");
+	if (!shader)
+		return;
+	shader = shader->getVariant(pbr ? FEATURE(PBR) : 0);
+	shader->enable();
 
+	setLightPassUniforms(shader, camera, inv_viewprojection);
+	shader->setUniform("u_irradiance_texture", irradiance, 3);
+	shader->setUniform("shadow_map", shadow_atlas.fbo ? shadow_atlas.fbo->depth_texture : Texture::getWhiteTexture(), 6);
+	light_clusters.setUniforms(shader, 7);
+	shader->setUniform1("u_ambient_light", ambient);
 
-	///////////////////IRADIANCE
-	
-	if (probes_texture)
-		shader->setUniform("u_probes_texture", probes_texture, 4);
-	else
-		shader->setUniform("u_probes_texture", Texture::getBlackTexture(), 4);
-	shader->setUniform("u_irr_start", start_pos);
-	shader->setUniform("u_irr_end", end_pos);
-	shader->setUniform("u_irr_delta", delta);
-	shader->setUniform("u_irr_dims", dim);
-	shader->setUniform("u_num_probes", dim.x*dim.y*dim.z);
-	shader->setUniform("u_irr_normal_distance", 0.0f);
+	quad->render(GL_TRIANGLES);
+	GLState::enable(GL_BLEND);
+	shader->disable();
+}
+
+//gbuffer and camera, shared by all the fullscreen and volume light passes
+void Renderer::setLightPassUniforms(Shader* shader, Camera* camera, const Matrix44& inv_viewprojection) {
+	shader->setUniform("degamma", degamma);
+	shader->setUniform("ssao", apply_ssao);
+	shader->setUniform("u_color_texture", deferred_fbo->color_textures[0], 0);
+	shader->setUniform("u_normal_texture", deferred_fbo->color_textures[1], 1);
+	shader->setUniform("u_extra_texture", deferred_fbo->color_textures[2], 2);
+	shader->setUniform("u_depth_texture", deferred_fbo->depth_texture, 4);
+	shader->setUniform("u_ambient_texture", ssao_fbo->color_textures[0], 5);
+	shader->setUniform("u_inverse_viewprojection", inv_viewprojection);
+	shader->setUniform("u_camera_pos", camera->eye);
+	shader->setUniform("u_iRes", Vector2(1.0 / deferred_fbo->width, 1.0 / deferred_fbo->height));
+}
+
+//screen rect covered by the sphere, false if it is outside the screen
+static bool computeLightScissor(Camera* camera, const Vector3& center, float radius, int width, int height, int& x, int& y, int& w, int& h) {
+	float min_x = 1.0f, min_y = 1.0f, max_x = -1.0f, max_y = -1.0f;
+	for (int i = 0; i < 8; ++i) {
+		Vector3 corner = center + Vector3(i & 1 ? radius : -radius, i & 2 ? radius : -radius, i & 4 ? radius : -radius);
+		Vector4 clip = camera->viewprojection_matrix * Vector4(corner, 1.0f);
+		//crosses the camera plane, the projection is not valid
+		if (clip.w <= 0.0f) {
+			min_x = min_y = -1.0f;
+			max_x = max_y = 1.0f;
+			break;
+		}
+		min_x = (float)fmin(min_x, clip.x / clip.w); max_x = (float)fmax(max_x, clip.x / clip.w);
+		min_y = (float)fmin(min_y, clip.y / clip.w); max_y = (float)fmax(max_y, clip.y / clip.w);
+	}
+	if (max_x < -1.0f || min_x > 1.0f || max_y < -1.0f || min_y > 1.0f)
+		return false;
 
+	x = (int)floor(clamp(min_x * 0.5f + 0.5f, 0.0f, 1.0f) * width);
+	y = (int)floor(clamp(min_y * 0.5f + 0.5f, 0.0f, 1.0f) * height);
+	w = (int)ceil(clamp(max_x * 0.5f + 0.5f, 0.0f, 1.0f) * width) - x;
+	h = (int)ceil(clamp(max_y * 0.5f + 0.5f, 0.0f, 1.0f) * height) - y;
+	return w > 0 && h > 0;
+}
 
+//spots as cones and omnis as spheres. The scissor skips everything outside the projected bounds of the light
+//and a stencil pass marks the pixels whose surface is inside the volume, so only those run the light shader
+void Renderer::renderLightVolumes(Scene* scene, Camera* camera, const Matrix44& inv_viewprojection) {
+	Shader* volume_shader = Shader::Get("deferred_ws");
+	Shader* stencil_shader = Shader::Get("flat");
+	Mesh* sphere = Mesh::Get("data/meshes/sphere.obj");
+
+	//the volumes are tested against the scene depth, copy it to the target
+	glColorMask(false, false, false, false);
+	GLState::depthMask(true);
+	deferred_fbo->depth_texture->copyTo(NULL);
+	glColorMask(true, true, true, true);
+
+	GLState::enable(GL_BLEND);
+	GLState::blendFunc(GL_ONE, GL_ONE);
+	GLState::enable(GL_SCISSOR_TEST);
+	GLState::enable(GL_STENCIL_TEST);
+	glStencilMask(0xFF);
+	GLState::depthMask(false);
+	GLState::depthFunc(GL_LESS);
 
-	shader->setUniform1("u_texture_rep", (float)material->texture_rep);
+	for (int i = 0; i < scene->lights.size(); i++) {
+		Light* light = scene->lights[i];
+		if (!light->visible || light->getType() == DIRECTIONAL)
+			continue;
+
+		Vector3 pos = light->model.getTranslation();
+		float radius = light->getMaxDist();
+		int x, y, w, h;
+		if (!computeLightScissor(camera, pos, radius, complete_fbo->width, complete_fbo->height, x, y, w, h))
+			continue;
+		glScissor(x, y, w, h);
+
+		//wide spots are closer to a sphere than to a cone
+		Mesh* volume = sphere;
+		Matrix44 model;
+		float cutoff = light->getSpotAngle();
+		if (light->getType() == SPOT && cutoff > 0.3f) {
+			//the base is a bit bigger so the polygon contains the circle of the spot
+			float base = radius * tan(acos(cutoff)) / cos(PI / CONE_SEGMENTS);
+			model = light->model;
+			model.scale(base, base, radius);
+			volume = cone;
+		}
+		else {
+			model.setTranslation(pos.x, pos.y, pos.z);
+			model.scale(radius, radius, radius);
+		}
 
+		//stencil pass, only the back faces behind the surface and the front faces in front of it change the count
+		glClear(GL_STENCIL_BUFFER_BIT);
+		glColorMask(false, false, false, false);
+		GLState::enable(GL_DEPTH_TEST);
+		GLState::disable(GL_CULL_FACE);
+		glStencilFunc(GL_ALWAYS, 0, 0xFF);
+		glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+		glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+		stencil_shader->enable();
+		stencil_shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+		stencil_shader->setUniform("u_model", model);
+		stencil_shader->setUniform("u_color", Vector4(1, 1, 1, 1));
+		volume->render(GL_TRIANGLES);
+		stencil_shader->disable();
+		glColorMask(true, true, true, true);
 
-	shader->setUniform("u_color", material->color);
-	if (texture)
-		shader->setUniform("u_texture", texture, 0);
+		//light pass, the back faces are drawn so it also works with the camera inside the volume
+		glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+		glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+		GLState::disable(GL_DEPTH_TEST);
+		GLState::enable(GL_CULL_FACE);
+		GLState::cullFace(GL_FRONT);
 
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0);
-	shader->setUniform("degamma", degamma);
+		Shader* shader = volume_shader->getVariant(getLightFeatures(light));
+		shader->enable();
+		setLightPassUniforms(shader, camera, inv_viewprojection);
+		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+		shader->setUniform("u_model", model);
+		shader->setUniform("u_irradiance_texture", Texture::getBlackTexture(), 3);
+		shader->setUniform("u_ambient_light", 0.0f);
+		shader->setUniform("u_light_maxdist", radius);
+		shader->setUniform("u_light_position", pos);
+		shader->setUniform("u_light_color", light->getColor());
+		shader->setUniform("u_light_intensity", light->getIntensity());
+		shader->setUniform("u_shadow_bias", light->shadow_bias * 0.1f);
+		setShadowUniforms(shader, light);
+		if (light->getType() == SPOT) {
+			shader->setUniform("u_light_type", 2.0f);
+			shader->setUniform("spotDirection", light->model.frontVector());
+			shader->setUniform("spotCosineCutoff", cutoff);
+			shader->setUniform("spotExponent", light->getSpotExponent());
+			if (light->shadow_tile_size)
+				shader->setUniform("shadow_map", shadow_atlas.fbo->depth_texture, 8);
+		}
+		else
+			shader->setUniform("u_light_type", 1.0f);
+		volume->render(GL_TRIANGLES);
+		shader->disable();
 
-	mesh->render(GL_TRIANGLES);
+		GLState::cullFace(GL_BACK);
+		GLState::disable(GL_CULL_FACE);
+	}
 
-	shader->disable();
-	glDisable(GL_BLEND);
+	GLState::disable(GL_STENCIL_TEST);
+	GLState::disable(GL_SCISSOR_TEST);
+	GLState::depthMask(true);
+	assert(glGetError() == GL_NO_ERROR);
 }
 
 
@@ -1123,7 +1850,7 @@ void Renderer::renderProbe(Vector3 pos, float size, float* coeffs, Camera* camer
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj");
 
 	//glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
 	//glEnable(GL_DEPTH_TEST);
 	
 	Matrix44 model;
@@ -1208,7 +1935,7 @@ void Renderer::computeReflections(Scene* scene) {
 
 	Camera c;
 	c.setPerspective(90, 1, 0.1, 1000);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_DEPTH_TEST);
 	for (int j = 0; j < reflection_probes.size(); j++) {
 
 		sReflectionProbe *probe = reflection_probes.at(j);
@@ -1235,8 +1962,8 @@ void Renderer::computeReflections(Scene* scene) {
 }
 
 void Renderer::renderReflectionProbe(Vector3 pos, float size, Texture* cubemap, Camera* camera) {
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
+	GLState::enable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
 	
 	
 	Shader* shader = Shader::Get("reflectionprobe");
@@ -1272,9 +1999,9 @@ void Renderer::renderSkybox(Camera *camera) {
 	if (skybox) {
 		Shader* shader = Shader::Get("skybox");
 		Mesh* mesh = Mesh::Get("data/meshes/sphere.obj");
-		glDisable(GL_CULL_FACE);
-		glDisable(GL_BLEND);
-		glDisable(GL_DEPTH_TEST);
+		GLState::disable(GL_CULL_FACE);
+		GLState::disable(GL_BLEND);
+		GLState::disable(GL_DEPTH_TEST);
 		Matrix44 model;
 		model.setTranslation(camera->eye.x, camera->eye.y, camera->eye.z);
 		model.scale(10, 10, 10);
@@ -1284,8 +2011,8 @@ void Renderer::renderSkybox(Camera *camera) {
 		shader->setUniform("u_model", model);
 		shader->setUniform("u_texture", skybox, 0);
 		mesh->render(GL_TRIANGLES);
-		glEnable(GL_DEPTH_TEST);
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_DEPTH_TEST);
+		GLState::enable(GL_CULL_FACE);
 		shader->disable();
 	}
 }
@@ -5,6 +5,14 @@
 #include "fbo.h"
 #include "application.h"
 #include "sphericalharmonics.h"
+#include "renderqueue.h"
+#include "shadowatlas.h"
+#include "ubo.h"
+#include "clusters.h"
+#include "multidraw.h"
+#include "occlusion.h"
+#include "culling.h"
+#include "occlusionqueries.h"
 
 //forward declarations
 class Camera;
@@ -32,6 +40,42 @@ namespace GTR {
 		int num_probes;
 	};
 
+	#define MAX_FORWARD_LIGHTS 64	//lights in the uniform buffer
+	#define MAX_OBJECT_LIGHTS 16	//lights that can reach one mesh in the forward pass
+	#define CONE_SEGMENTS 24	//sides of the spot light volumes
+	#define MIN_INSTANCES 2	//batches with fewer calls are drawn one by one
+
+	struct sLightsBlock {
+		Vector4 info; //x number of lights
+		sLightData lights[MAX_FORWARD_LIGHTS];
+	};
+
+	//camera and global parameters, uploaded once per pass (FrameBlock in the shaders)
+	struct sFrameBlock {
+		Matrix44 viewprojection;
+		Vector4 camera_position;	//w time in seconds
+		Vector4 irr_start;			//w number of probes
+		Vector4 irr_end;			//w normal distance
+		Vector4 irr_delta;
+		Vector4 irr_dims;
+		Vector4 tonemapper;			//scale, average lum, lumwhite squared, inverse gamma
+		Vector4 flags;				//x degamma, y SH interpolation, z pbr, w ambient light
+	};
+
+	//factors of one material, every material has its own range in the materials buffer (MaterialBlock in the shaders)
+	struct sMaterialBlock {
+		Vector4 color;
+		Vector4 emissive_factor;	//w texture repetition
+		Vector4 params;				//x alpha cutoff, y has normalmap, z roughness, w metalness
+	};
+
+	//which entities are drawn into a shadowmap
+	enum eShadowCasters {
+		ALL_CASTERS,
+		STATIC_CASTERS,
+		DYNAMIC_CASTERS
+	};
+
 	std::vector<Vector3> generateSpherePoints(int num, float radius, bool hemi);
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
@@ -42,7 +86,14 @@ namespace GTR {
 		bool show_properties, degamma, pbr, show_ssao, computeAmbientOcclusion, 
 			apply_ssao, apply_volumetric, apply_environmentReflections, 
 			show_reflectionProbes, add_decal, apply_tonemapper, apply_glow, SHinterpolation,
-			show_irradiance;
+			show_irradiance, cache_shadows, shadow_static_split, shadow_receiver_culling,
+			use_clustered, use_instancing, use_multidraw, use_occlusion_culling, use_occlusion_queries, use_scene_tree, use_batch_culling;
+		Matrix44 shadow_camera_viewproj; //main camera when the shadows were updated
+		float cascade_distance; //how far from the camera the directional shadows reach
+		float cascade_lambda; //0 splits the cascades uniformly, 1 logarithmically
+		int shadowmaps_rendered; //last frame
+		int num_draw_calls;			//of the queues this frame, an instanced draw counts as one
+		int num_instanced_draws;
 		Texture* skybox, *decal_depth_texture, *decal, *noise;
 		std::vector<Vector3> points;
 		std::vector<sProbe> probes;
@@ -52,20 +103,69 @@ namespace GTR {
 		Vector3 dim;
 		Vector3 delta;
 		Mesh* cube;
+		Mesh* cone; //volume of the spot lights
 
 		float u_scale, u_average_lum, u_lumwhite2, u_igamma;
+
+		RenderQueue render_queue;
+		RenderQueue shadow_queue; //casters of one view of a light
+		MultiDraw multi_draw; //pooled meshes of the gbuffer and shadow passes
+		OcclusionCuller occlusion_culler;
+		OcclusionQueries occlusion_queries; //deferred pipeline only
+		float occluder_min_size; //half diagonal of the world box to be an occluder
+
+		//results of the queries to the trees of the scene, kept to reuse the memory
+		std::vector<BaseEntity*> visible_entities;	//in the main view
+		std::vector<BaseEntity*> caster_entities;	//in a view of a light
+		std::vector<BaseEntity*> near_lights;		//lights around a mesh of the forward pass
+
+		//without the tree, the bounds of all the entities in SoA, built once per frame and culled for every view
+		CullingBoxes entity_boxes;
+		std::vector<uint32_t> culling_mask;
+		unsigned int entity_boxes_frame;
+
+		//forward lights
+		UBO* lights_ubo;
+		sLightsBlock lights_block;
+		Light* forward_lights[MAX_FORWARD_LIGHTS]; //same order as in the buffer
+		int num_forward_lights;
+		int directional_lights[MAX_FORWARD_LIGHTS]; //buffer indices of the directional ones, they reach every mesh
+		int num_directional_lights;
+		Light* cascaded_light; //the directional light that uses the cascades uniforms
+
+		//uniform blocks of the gbuffer pass
+		UBO* frame_ubo;
+		sFrameBlock frame_block;
+		UBO* materials_ubo;		//all the materials, one aligned range each
+		int material_stride;	//size of a range, rounded to the offset alignment
+		int num_material_blocks;
+
+		//shaders used per draw, resolved once
+		ShaderHandle forward_shader, gbuffer_shader, shadow_shader;
+
+		//clustered deferred, all the omni and spot lights in one pass
+		LightClusters light_clusters;
 	public:
 		FBO *irr_fbo;
 		Texture* probes_texture;
+		ShadowAtlas shadow_atlas; //shadowmaps of all the lights
 
 		//add here your functions
 		Renderer();
 
 		void renderInMenu();
 
+		//the entities whose bounds touch the view, from the tree of the scene, the batch culling or all of them
+		const std::vector<BaseEntity*>& getEntitiesInFrustum(Scene* scene, Camera* camera, std::vector<BaseEntity*>& results);
+
 		//Shadowmap creation
-		void createShadowmap(std::vector<BaseEntity*> ent, Light* l);
-		void checkRendering(PrefabEntity* p, Shader* s, Light* l, GTR::Node* n);
+		void setupShadowCamera(Light* l, Camera* camera); //the camera is needed to fit the cascades
+		void setupCascades(Light* l, Camera* camera);
+		void setShadowUniforms(Shader* shader, Light* l);
+		unsigned int getLightFeatures(Light* l); //pbr and the kind of shadow, selects the light shader variant
+		void updateShadowmaps(Scene* scene, Camera* camera); //only renders the shadowmaps that changed
+		void createShadowmap(Scene* scene, Light* l, eShadowCasters casters = ALL_CASTERS);
+		void checkRendering(PrefabEntity* p, Shader* s, Light* l, Camera* light_camera, Camera* camera); //camera is used to cull casters whose shadow is not visible
 
 		//Irradiance
 		void computeIrradiance(Scene* scene);
@@ -77,11 +177,17 @@ namespace GTR {
 
 		//Deferred
 		void renderSceneInDeferred(Scene* scene, Camera* camera);
-		void renderMeshinDeferred(std::vector<BaseEntity*> scene, Camera* camera);
-
-		void renderPrefabDeferred(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
-		void renderNodeDeferred(const Matrix44& prefab_model, GTR::Node* node, Camera* camera);
-		void renderMeshWithMaterialDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		void renderMeshinDeferred(const std::vector<BaseEntity*>& entities, Camera* camera);
+
+		void renderQueueDeferred(Camera* camera);
+		void setDeferredFrameUniforms(Shader* shader, Camera* camera);
+		void setDeferredMaterialUniforms(Shader* shader, GTR::Material* material);
+		void uploadFrameBlock(Camera* camera);
+		void bindMaterialBlock(GTR::Material* material); //uploads it the first time and when edited
+		void buildLightClusters(Scene* scene, Camera* camera);
+		void renderClusteredLights(Camera* camera, const Matrix44& inv_viewprojection, float ambient, Texture* irradiance);
+		void renderLightVolumes(Scene* scene, Camera* camera, const Matrix44& inv_viewprojection);
+		void setLightPassUniforms(Shader* shader, Camera* camera, const Matrix44& inv_viewprojection);
 
 		//Reflections
 		void computeReflections(Scene* scene);
@@ -93,14 +199,32 @@ namespace GTR {
 		bool readIrradiance();
 		//--------------------------------------------------------------------
 	
-		//to render a whole prefab (with all its nodes)
-		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
-
-		//to render one node from the prefab and its children
-		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera);
-
-		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		//to render the sorted queue with the forward pipeline, all the lights in one pass
+		void renderQueueForward(Camera* camera);
+		void uploadLights(Scene* scene);
+		int computeObjectLights(const BoundingBox& box, int* indices);
+		void setForwardFrameUniforms(Shader* shader, Camera* camera);
+		void setForwardMaterialUniforms(Shader* shader, GTR::Material* material);
+		void drawForward(Shader* shader, const Matrix44& model, Mesh* mesh);
+		void drawForwardBatch(Shader* shader, const Matrix44* models, int count, Mesh* mesh);
+
+		//instancing of the batches of the queues
+		Shader* getBatchShader(Shader* shader, int count, Mesh* mesh); //mesh NULL in the passes without indirect draws
+		void drawBatch(Shader* shader, const Matrix44* models, int count, Mesh* mesh);
+
+		//indirect draws of the pooled meshes, grouped until the shader or the material changes
+		bool isMultiDrawn(Mesh* mesh);
+		void beginMultiDraw(RenderQueue& queue);
+		void submitBatch(RenderQueue& queue, const sRenderBatch& batch, Shader* shader);
+		void flushMultiDraw();
+		void renderShadowQueue(Camera* light_camera);
+
+		//after the queue: box queries of the hidden objects, their conditional draws and the checks of the visible ones
+		void renderQueriedCalls(Camera* camera);
+		void drawQueriedCall(sRenderCall& call, Shader*& shader, GTR::Material*& material, Camera* camera);
+
+		//rasterizes the big opaque nodes in the occlusion buffer, returns the culler to give to the queue or NULL
+		OcclusionCuller* renderOccluders(const std::vector<BaseEntity*>& entities, Camera* camera);
 	};
 
 	Texture* CubemapFromHDRE(const char* filename);
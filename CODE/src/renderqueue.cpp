@@ -0,0 +1,302 @@
+#include "renderqueue.h"
+
+#include "camera.h"
+#include "mesh.h"
+#include "shader.h"
+#include "prefab.h"
+#include "material.h"
+#include "PrefabEntity.h"
+#include "arena.h"
+#include "occlusion.h"
+#include "occlusionqueries.h"
+
+using namespace GTR;
+
+#define DEPTH_BITS 22
+#define DEPTH_MAX ((1 << DEPTH_BITS) - 1)
+
+RenderQueue::RenderQueue()
+{
+	max_distance = 10000.0f;
+	calls = NULL;
+	keys = tmp_keys = NULL;
+	order = tmp_order = NULL;
+	num_calls = max_calls = 0;
+	batches = NULL;
+	num_batches = 0;
+	instance_models = NULL;
+	occlusion = NULL;
+	queries = NULL;
+	num_box_tests = 0;
+	arena_frame = 0;
+}
+
+void RenderQueue::clear()
+{
+	num_calls = 0;
+	num_batches = 0;
+}
+
+void RenderQueue::begin(Camera* camera, int max)
+{
+	clear();
+	max_distance = camera->far_plane;
+	reserve(max);
+}
+
+void RenderQueue::reserve(int max)
+{
+	FrameArena* arena = FrameArena::frame;
+	//arrays from this frame are still valid, reuse them if big enough
+	if (calls && arena_frame == arena->frame_id && max <= max_calls)
+		return;
+	max_calls = max;
+	arena_frame = arena->frame_id;
+	calls = arena->allocArray<sRenderCall>(max);
+	keys = arena->allocArray<uint64_t>(max);
+	tmp_keys = arena->allocArray<uint64_t>(max);
+	order = arena->allocArray<uint32_t>(max);
+	tmp_order = arena->allocArray<uint32_t>(max);
+	batches = arena->allocArray<sRenderBatch>(max);
+	instance_models = arena->allocArray<Matrix44>(max);
+}
+
+uint64_t RenderQueue::computeKey(eRenderPass pass, unsigned int shader_id, unsigned int material_id, unsigned int mesh_id, float distance, float max_distance)
+{
+	float d = clamp(distance / max_distance, 0.0f, 1.0f);
+	uint64_t depth = (uint64_t)(d * DEPTH_MAX);
+
+	uint64_t key = (uint64_t)pass << 62;
+	if (pass == BLEND_PASS)
+	{
+		//back to front has priority over state changes
+		key |= (uint64_t)(DEPTH_MAX - depth) << 40;
+		key |= (uint64_t)(shader_id & 0xFF) << 32;
+		key |= (uint64_t)(material_id & 0xFFFF) << 16;
+		key |= (uint64_t)(mesh_id & 0xFFFF);
+	}
+	else
+	{
+		//group by state and inside every group front to back for early-z
+		key |= (uint64_t)(shader_id & 0xFF) << 54;
+		key |= (uint64_t)(material_id & 0xFFFF) << 38;
+		key |= (uint64_t)(mesh_id & 0xFFFF) << 22;
+		key |= depth;
+	}
+	return key;
+}
+
+void RenderQueue::add(Mesh* mesh, Material* material, Shader* shader, const Matrix44& model, Camera* camera, const BoundingBox* box, PrefabEntity* entity)
+{
+	assert(num_calls < max_calls && "render queue not reserved");
+	sRenderCall& call = calls[num_calls];
+	call.mesh = mesh;
+	call.material = material;
+	call.shader = shader;
+	call.model = model;
+	call.box = box;
+	call.entity = entity;
+	call.distance = camera->eye.distance(model * mesh->box.center);
+
+	eRenderPass pass = OPAQUE_PASS;
+	if (material->alpha_mode == BLEND)
+		pass = BLEND_PASS;
+	else if (material->alpha_mode == MASK)
+		pass = MASK_PASS;
+
+	keys[num_calls] = computeKey(pass, shader ? shader->sort_id : 0, material->sort_id, mesh->sort_id, call.distance, max_distance);
+	num_calls++;
+}
+
+void RenderQueue::collect(const std::vector<BaseEntity*>& entities, Camera* camera, Shader* shader, unsigned int features)
+{
+	//upper bound of calls is the number of nodes
+	int max = 0;
+	for (int i = 0; i < (int)entities.size(); i++) {
+		if (entities[i]->type != PREFAB)
+			continue;
+		PrefabEntity* p = (PrefabEntity*)entities[i];
+		p->updateWorldCache();
+		if (p->getPrefab())
+			max += (int)p->getPrefab()->flat_nodes.size();
+	}
+	begin(camera, max);
+
+	num_box_tests = 0;
+	for (int i = 0; i < (int)entities.size(); i++) {
+		BaseEntity* ent = entities[i];
+		if (ent->type != PREFAB || !ent->visible)
+			continue;
+		PrefabEntity* p = (PrefabEntity*)ent;
+		if (!p->getPrefab())
+			continue;
+		collectPrefab(p, camera, shader, features);
+	}
+
+	if (occlusion)
+		removeOccluded();
+	if (queries)
+		queries->extract(*this, camera);
+	sort();
+}
+
+//linear walk over the flattened nodes using the cached world matrices.
+//the box of every subtree is tested first: outside skips it, inside draws it without more tests
+void RenderQueue::collectPrefab(PrefabEntity* entity, Camera* camera, Shader* shader, unsigned int features)
+{
+	Prefab* prefab = entity->getPrefab();
+	int num = (int)prefab->flat_nodes.size();
+	int inside_end = 0; //the nodes before this one are in a subtree fully inside the frustum
+	for (int i = 0; i < num; )
+	{
+		Node* node = prefab->flat_nodes[i];
+		if (!node->visible || !entity->subtree_has_mesh[i])
+		{
+			i = prefab->flat_subtree_end[i]; //skip the whole subtree
+			continue;
+		}
+
+		char clip = CLIP_INSIDE;
+		if (i >= inside_end)
+		{
+			BoundingBox& subtree = entity->world_subtree_boxes[i];
+			clip = camera->testBoxInFrustum(subtree.center, subtree.halfsize);
+			num_box_tests++;
+			if (clip == CLIP_OUTSIDE)
+			{
+				i = prefab->flat_subtree_end[i];
+				continue;
+			}
+			if (clip == CLIP_INSIDE)
+				inside_end = prefab->flat_subtree_end[i];
+		}
+
+		if (node->mesh && node->material && node->mesh->getNumVertices())
+		{
+			BoundingBox& world_bounding = entity->world_boxes[i];
+			//in a leaf the box of the subtree is the one of the mesh
+			bool visible = clip == CLIP_INSIDE || prefab->flat_subtree_end[i] == i + 1;
+			if (!visible)
+			{
+				visible = camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) != CLIP_OUTSIDE;
+				num_box_tests++;
+			}
+			if (visible)
+				add(node->mesh, node->material, shader ? shader->getVariant(features | node->material->getShaderFeatures()) : NULL, entity->world_models[i], camera, &world_bounding, entity);
+		}
+		++i;
+	}
+}
+
+//keeps the order of the remaining calls, the ones without box are never culled
+void RenderQueue::removeOccluded()
+{
+	if (!num_calls)
+		return;
+	const BoundingBox** boxes = FrameArena::frame->allocArray<const BoundingBox*>(num_calls);
+	int* tested = FrameArena::frame->allocArray<int>(num_calls);
+	bool* visible = FrameArena::frame->allocArray<bool>(num_calls);
+	int num_tested = 0;
+	for (int i = 0; i < num_calls; ++i)
+		if (calls[i].box)
+		{
+			tested[num_tested] = i;
+			boxes[num_tested++] = calls[i].box;
+		}
+	occlusion->testBoxes(boxes, num_tested, visible);
+
+	int num = 0;
+	for (int i = 0, j = 0; i < num_calls; ++i)
+	{
+		bool hidden = false;
+		if (j < num_tested && tested[j] == i)
+			hidden = !visible[j++];
+		if (hidden)
+			continue;
+		calls[num] = calls[i];
+		keys[num] = keys[i];
+		num++;
+	}
+	num_calls = num;
+}
+
+//LSD radix sort of the keys, 8 bits per pass, moving the indices along
+void RenderQueue::sort()
+{
+	int num = num_calls;
+	for (int i = 0; i < num; ++i)
+		order[i] = i;
+	if (num < 2)
+	{
+		buildBatches();
+		return;
+	}
+
+	uint64_t* src_keys = keys;
+	uint32_t* src_order = order;
+	uint64_t* dst_keys = tmp_keys;
+	uint32_t* dst_order = tmp_order;
+
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		unsigned int count[256] = { 0 };
+		for (int i = 0; i < num; ++i)
+			count[(src_keys[i] >> shift) & 0xFF]++;
+
+		//all keys share this byte, nothing to do
+		if (count[(src_keys[0] >> shift) & 0xFF] == (unsigned int)num)
+			continue;
+
+		unsigned int offset = 0;
+		for (int i = 0; i < 256; ++i)
+		{
+			unsigned int c = count[i];
+			count[i] = offset;
+			offset += c;
+		}
+
+		for (int i = 0; i < num; ++i)
+		{
+			unsigned int pos = count[(src_keys[i] >> shift) & 0xFF]++;
+			dst_keys[pos] = src_keys[i];
+			dst_order[pos] = src_order[i];
+		}
+
+		std::swap(src_keys, dst_keys);
+		std::swap(src_order, dst_order);
+	}
+
+	//result ended in the temporal buffers
+	if (src_keys != keys)
+	{
+		std::swap(keys, tmp_keys);
+		std::swap(order, tmp_order);
+	}
+
+	buildBatches();
+}
+
+void RenderQueue::buildBatches()
+{
+	num_batches = 0;
+	for (int i = 0; i < num_calls; ++i)
+	{
+		sRenderCall& call = calls[order[i]];
+		instance_models[i] = call.model;
+
+		if (num_batches && call.material->alpha_mode != BLEND)
+		{
+			sRenderBatch& last = batches[num_batches - 1];
+			sRenderCall& prev = calls[order[last.first]];
+			if (prev.mesh == call.mesh && prev.material == call.material && prev.shader == call.shader)
+			{
+				last.count++;
+				continue;
+			}
+		}
+
+		sRenderBatch& batch = batches[num_batches++];
+		batch.first = i;
+		batch.count = 1;
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "framework.h"
+#include "BaseEntity.h"
+#include "PrefabEntity.h"
+#include <vector>
+#include <cstdint>
+
+//forward declarations
+class Camera;
+class Mesh;
+class Shader;
+class OcclusionCuller;
+class OcclusionQueries;
+
+namespace GTR {
+
+	class Material;
+	class Node;
+
+	//passes are the most significant bits of the key, so opaque is drawn first and blend last
+	enum eRenderPass {
+		OPAQUE_PASS = 0,
+		MASK_PASS = 1,
+		BLEND_PASS = 2
+	};
+
+	//everything needed to issue one draw call
+	struct sRenderCall {
+		Mesh* mesh;
+		Material* material;
+		Shader* shader;
+		Matrix44 model;
+		const BoundingBox* box; //world box, NULL if it was added without one
+		PrefabEntity* entity; //owner of the node, NULL if it was added by hand
+		float distance;
+	};
+
+	//consecutive sorted calls with the same mesh, material and shader, drawn with one instanced call
+	struct sRenderBatch {
+		int first; //in sorted order
+		int count;
+	};
+
+	// Collects the visible meshes of the scene into a flat array, sorts them by a 64 bit key
+	// and lets the renderer submit them in one pass minimizing state changes.
+	// The arrays are carved from the frame arena, so they are only valid until the end of the frame.
+	// key layout (from msb): pass(2) | shader(8) | material(16) | mesh(16) | depth(22)
+	// for the blend pass the depth goes right after the pass, inverted, so it is drawn back to front
+	// after sorting, the calls that only differ in the model are next to each other and are grouped in batches
+	class RenderQueue
+	{
+	public:
+		sRenderCall* calls;
+		uint64_t* keys;
+		uint32_t* order; //indices to calls sorted by key
+		int num_calls;
+		int max_calls;
+
+		sRenderBatch* batches;
+		int num_batches;
+		Matrix44* instance_models; //models in sorted order, the ones of a batch are contiguous
+
+		float max_distance; //used to quantize the depth
+		OcclusionCuller* occlusion; //if set, collect drops the calls hidden by its occluders
+		OcclusionQueries* queries; //if set, collect gives it the calls of hidden objects and the ones to check
+		int num_box_tests; //frustum tests done by the last collect
+
+		RenderQueue();
+
+		void clear();
+		void reserve(int max); //must be called before adding calls
+		void begin(Camera* camera, int max); //clear and reserve, when the calls are added by hand
+		void add(Mesh* mesh, Material* material, Shader* shader, const Matrix44& model, Camera* camera, const BoundingBox* box = NULL, PrefabEntity* entity = NULL);
+		//every call uses the variant of the shader for its material features plus the global ones
+		void collect(const std::vector<BaseEntity*>& entities, Camera* camera, Shader* shader, unsigned int features = 0);
+		void removeOccluded(); //tests the boxes of the calls in parallel, before sorting
+		void sort(); //also groups the calls in batches
+		void buildBatches(); //blended calls are never grouped, they must keep their order
+
+		int size() const { return num_calls; }
+		sRenderCall& operator[](int i) { return calls[order[i]]; }
+		sRenderCall& getBatchCall(const sRenderBatch& batch) { return calls[order[batch.first]]; }
+		const Matrix44* getBatchModels(const sRenderBatch& batch) const { return instance_models + batch.first; }
+
+		static uint64_t computeKey(eRenderPass pass, unsigned int shader_id, unsigned int material_id, unsigned int mesh_id, float distance, float max_distance);
+
+	private:
+		uint64_t* tmp_keys;
+		uint32_t* tmp_order;
+		unsigned int arena_frame; //frame of the arena where the arrays were allocated
+
+		void collectPrefab(PrefabEntity* entity, Camera* camera, Shader* shader, unsigned int features);
+	};
+
+};
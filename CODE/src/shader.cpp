@@ -6,10 +6,12 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <cstdint>
 
 #include "texture.h"
 
 std::string Shader::s_shader_atlas_filename;
+std::string Shader::s_binary_cache_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
 
 
@@ -54,7 +56,82 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 #endif
 
 std::map<std::string,Shader*> Shader::s_Shaders;
+std::vector<Shader*> Shader::s_handles;
+
+//macros of the SHADER_FEATURES, in bit order
+static const char* s_feature_macros[] = {
+#define F(name) "#define USE_" #name "\n",
+	SHADER_FEATURES
+#undef F
+};
+
+//program binaries loaded from the cache or retrieved after linking
+struct sProgramBinary {
+	GLenum format;
+	std::string data;
+	bool used; //only the ones used this run are saved, so old code does not pile up
+};
+static std::map<uint64_t, sProgramBinary> s_binaries;
+static bool s_binaries_dirty = false;
+
+#define SHADER_BIN_VERSION 2
+
+typedef struct
+{
+	int version;
+	int header_bytes;
+	int num_programs;
+	char extra[20]; //unused
+} sShaderBinInfo;
+
+//fnv-1a, good enough to tell apart sources
+static uint64_t hashString(const std::string& str, uint64_t hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//a binary is only valid for the same driver that created it
+static uint64_t computeProgramKey(const std::string& vs, const std::string& fs)
+{
+	static std::string driver;
+	if (driver.empty())
+	{
+		driver = (const char*)glGetString(GL_VENDOR);
+		driver += (const char*)glGetString(GL_RENDERER);
+		driver += (const char*)glGetString(GL_VERSION);
+	}
+	uint64_t hash = hashString(driver);
+	hash = hashString(vs, hash);
+	hash = hashString("\n//fs\n", hash);
+	return hashString(fs, hash);
+}
+
+//drivers without ARB_get_program_binary, or that do not want to cache anything, report no formats
+static bool supportsProgramBinary()
+{
+	static GLint num_formats = -1;
+	if (num_formats == -1)
+	{
+		num_formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		glGetError();
+	}
+	return num_formats > 0;
+}
+
+//names of the SHADER_UNIFORMS, in the same order as the ids
+static const char* s_uniform_names[] = {
+#define U(name) #name,
+	SHADER_UNIFORMS
+#undef U
+};
 bool Shader::s_ready = false;
+unsigned int Shader::s_last_sort_id = 0;
 Shader* Shader::current = NULL;
 
 Shader::Shader()
@@ -63,11 +140,24 @@ Shader::Shader()
 		Shader::init();
 	compiled = false;
 	from_atlas = false;
+	sort_id = ++s_last_sort_id;
+	handle = -1;
+	features = 0;
+	base = NULL;
+	supported_features = ~0u;
+	for (int i = 0; i < NUM_UNIFORMS; ++i)
+	{
+		uniform_locations[i] = -1;
+		uniform_known[i] = false;
+	}
 }
 
 Shader::~Shader()
 {
+	releaseVariants();
 	release();
+	if (handle != -1)
+		s_handles[handle] = NULL;
 }
 
 void Shader::setFilenames(const std::string& vsf, const std::string& psf)
@@ -131,12 +221,102 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 	return sh;
 }
 
+ShaderHandle Shader::GetHandle(const char* name)
+{
+	std::map<std::string, Shader*>::iterator it = s_Shaders.find(name);
+	if (it == s_Shaders.end())
+		return -1;
+
+	Shader* sh = it->second;
+	if (sh->handle == -1)
+	{
+		sh->handle = (int)s_handles.size();
+		s_handles.push_back(sh);
+	}
+	return sh->handle;
+}
+
+Shader* Shader::getVariant(unsigned int features)
+{
+	//all the variants are cached in the base shader
+	if (base)
+		return base->getVariant(this->features | features);
+	features &= supported_features;
+	if (!features)
+		return this;
+	std::map<unsigned int, Shader*>::iterator it = variants.find(features);
+	if (it != variants.end())
+		return it->second;
+
+	std::string defines = macros;
+	if (!defines.empty() && defines[defines.size() - 1] != '\n')
+		defines += "\n";
+	for (int i = 0; i < NUM_SHADER_FEATURES; ++i)
+		if (features & (1u << i))
+			defines += s_feature_macros[i];
+
+	Shader* sh = new Shader();
+	bool ok = false;
+	if (from_atlas)
+	{
+		ok = sh->compileFromMemory(insertMacros(s_shaders_atlas[vs_filename], defines), insertMacros(s_shaders_atlas[ps_filename], defines));
+		sh->vs_filename = vs_filename;
+		sh->ps_filename = ps_filename;
+		sh->from_atlas = true;
+		sh->supported_features = supported_features;
+	}
+	else
+		ok = sh->load(vs_filename, ps_filename, defines.c_str());
+
+	//keep rendering with the generic one rather than not rendering at all
+	if (!ok)
+	{
+		std::cout << " * Error compiling variant " << features << " of " << vs_filename << "," << ps_filename << std::endl;
+		delete sh;
+		sh = this;
+	}
+	else
+	{
+		sh->macros = defines;
+		sh->features = features;
+		sh->base = this;
+	}
+	variants[features] = sh;
+	return sh;
+}
+
+void Shader::releaseVariants()
+{
+	for (std::map<unsigned int, Shader*>::iterator it = variants.begin(); it != variants.end(); ++it)
+		if (it->second != this)
+			delete it->second;
+	variants.clear();
+}
+
+std::string Shader::insertMacros(const std::string& code, const std::string& macros)
+{
+	if (macros.empty())
+		return code;
+	size_t pos = code.find("#version");
+	if (pos == std::string::npos)
+		return macros + "\n" + code;
+	pos = code.find('\n', pos);
+	if (pos == std::string::npos)
+		return code + "\n" + macros;
+	return code.substr(0, pos + 1) + macros + "\n" + code.substr(pos + 1);
+}
+
 void Shader::ReloadAll()
 {
+	//the variants are compiled again the next time they are requested
 	for( std::map<std::string,Shader*>::iterator it = s_Shaders.begin(); it!=s_Shaders.end();it++)
+	{
+		it->second->releaseVariants();
 		it->second->recompile();
+	}
 	if(!s_shader_atlas_filename.empty())
 		LoadAtlas(s_shader_atlas_filename.c_str());
+	SaveBinaryCache(); //the atlas entries that changed
 	std::cout << "Shaders recompiled" << std::endl;
 }
 
@@ -168,8 +348,16 @@ bool Shader::LoadAtlas(const char* filename)
 		return false;
 	}
 
-	//separate subfiles
+	//the binaries go next to the atlas, with the same name
 	s_shader_atlas_filename = filename;
+	std::string cache_filename = filename;
+	size_t ext = cache_filename.find_last_of('.');
+	if (ext != std::string::npos)
+		cache_filename = cache_filename.substr(0, ext);
+	if (s_binary_cache_filename != cache_filename + ".sbin")
+		LoadBinaryCache((cache_filename + ".sbin").c_str());
+
+	//separate subfiles
 	std::vector<std::string> lines = tokenize(content, "\n");
 	std::string subfile_name = "";
 	std::string subfile_content = "";
@@ -238,8 +426,9 @@ bool Shader::LoadAtlas(const char* filename)
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
+		//the macros must go after the #version
+		vs_code = insertMacros(vs_code, macros);
+		fs_code = insertMacros(fs_code, macros);
 
 		Shader* shader = NULL;
 		auto it = s_Shaders.find( name );
@@ -261,13 +450,136 @@ bool Shader::LoadAtlas(const char* filename)
 
 		shader->vs_filename = vs_filename;
 		shader->ps_filename = fs_filename;
+		shader->macros = macros;
 		shader->from_atlas = true;
+
+		//the features that appear in the code, any other bit would compile the same program again
+		shader->supported_features = 0;
+		for (int j = 0; j < NUM_SHADER_FEATURES; ++j)
+		{
+			std::string name = s_feature_macros[j] + 8; //skip the #define
+			name = trim(name);
+			if (vs_code.find(name) != std::string::npos || fs_code.find(name) != std::string::npos)
+				shader->supported_features |= 1u << j;
+		}
 		std::cout << " + Shader from atlas: " << name << std::endl;
 	}
 
 	return true;
 }
 
+void Shader::WarmUp()
+{
+	long start = getTime();
+	int num = 0;
+	for (std::map<std::string, Shader*>::iterator it = s_Shaders.begin(); it != s_Shaders.end(); ++it)
+	{
+		Shader* shader = it->second;
+		if (!shader->from_atlas || !shader->supported_features)
+			continue;
+		//every subset of the features the code uses
+		unsigned int all = shader->supported_features;
+		for (unsigned int sub = all; sub; sub = (sub - 1) & all)
+		{
+			shader->getVariant(sub);
+			num++;
+		}
+	}
+	std::cout << " + Shader variants warmed up: " << num << " in " << (getTime() - start) << "ms" << std::endl;
+	SaveBinaryCache();
+}
+
+bool Shader::LoadBinaryCache(const char* filename)
+{
+	s_binary_cache_filename = filename;
+	if (!supportsProgramBinary())
+		return false;
+
+	std::string content;
+	if (!readFile(filename, content) || content.size() < 4 + sizeof(sShaderBinInfo))
+		return false;
+
+	//watermark
+	const char* pos = content.data();
+	const char* end = pos + content.size();
+	if (memcmp(pos, "SBIN", 4) != 0)
+	{
+		std::cout << "[ERROR] loading shader binaries: invalid content: " << filename << std::endl;
+		return false;
+	}
+	pos += 4;
+
+	sShaderBinInfo info;
+	memcpy(&info, pos, sizeof(sShaderBinInfo));
+	pos += sizeof(sShaderBinInfo);
+	if (info.version != SHADER_BIN_VERSION || info.header_bytes != sizeof(sShaderBinInfo))
+	{
+		std::cout << "[WARN] loading shader binaries: old version: " << filename << std::endl;
+		return false;
+	}
+
+	//key, format, size and data of every program
+	for (int i = 0; i < info.num_programs; ++i)
+	{
+		uint64_t key;
+		unsigned int format, size;
+		if (pos + sizeof(key) + sizeof(format) + sizeof(size) > end)
+			break;
+		memcpy(&key, pos, sizeof(key)); pos += sizeof(key);
+		memcpy(&format, pos, sizeof(format)); pos += sizeof(format);
+		memcpy(&size, pos, sizeof(size)); pos += sizeof(size);
+		if (pos + size > end)
+			break;
+		sProgramBinary& binary = s_binaries[key];
+		binary.format = format;
+		binary.data.assign(pos, size);
+		binary.used = false;
+		pos += size;
+	}
+	std::cout << " + Shader binaries: " << s_binaries.size() << " programs in cache" << std::endl;
+	return true;
+}
+
+bool Shader::SaveBinaryCache()
+{
+	if (!s_binaries_dirty || s_binary_cache_filename.empty())
+		return false;
+
+	FILE* f = fopen(s_binary_cache_filename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write shader binaries: " << s_binary_cache_filename << std::endl;
+		return false;
+	}
+
+	sShaderBinInfo info;
+	memset(&info, 0, sizeof(info));
+	info.version = SHADER_BIN_VERSION;
+	info.header_bytes = sizeof(sShaderBinInfo);
+	for (std::map<uint64_t, sProgramBinary>::iterator it = s_binaries.begin(); it != s_binaries.end(); ++it)
+		if (it->second.used)
+			info.num_programs++;
+
+	//watermark
+	fwrite("SBIN", sizeof(char), 4, f);
+	fwrite((void*)&info, sizeof(sShaderBinInfo), 1, f);
+	for (std::map<uint64_t, sProgramBinary>::iterator it = s_binaries.begin(); it != s_binaries.end(); ++it)
+	{
+		if (!it->second.used)
+			continue;
+		uint64_t key = it->first;
+		unsigned int format = it->second.format;
+		unsigned int size = (unsigned int)it->second.data.size();
+		fwrite(&key, sizeof(key), 1, f);
+		fwrite(&format, sizeof(format), 1, f);
+		fwrite(&size, sizeof(size), 1, f);
+		fwrite(it->second.data.data(), size, 1, f);
+	}
+	fclose(f);
+	s_binaries_dirty = false;
+	return true;
+}
+
 bool Shader::compile()
 {
 	assert(!compiled && "Shader already compiled" );
@@ -305,6 +617,31 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
 
+	//linked before with the same code and driver, skip the compilation
+	uint64_t key = 0;
+	bool use_binaries = supportsProgramBinary();
+	if (use_binaries)
+	{
+		key = computeProgramKey(vsm, psm);
+		std::map<uint64_t, sProgramBinary>::iterator it = s_binaries.find(key);
+		if (it != s_binaries.end())
+		{
+			GLint linked = 0;
+			glProgramBinary(program, it->second.format, it->second.data.data(), (GLsizei)it->second.data.size());
+			glGetProgramiv(program, GL_LINK_STATUS, &linked);
+			glGetError(); //an invalid format is not fatal, it is compiled again
+			if (linked)
+			{
+				it->second.used = true;
+				resolveUniforms();
+				compiled = true;
+				return true;
+			}
+			s_binaries.erase(it);
+		}
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
 	if (!createVertexShaderObject(vsm))
 	{
 		printf("Vertex shader compilation failed\n");
@@ -317,6 +654,11 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	//fixed locations, the vertex arrays of the meshes are built for them
+#define A(name, location) glBindAttribLocation(program, location, #name);
+	SHADER_ATTRIBUTES
+#undef A
+
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
@@ -336,6 +678,22 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	validate();
 #endif
 
+	if (use_binaries)
+	{
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length > 0)
+		{
+			sProgramBinary& binary = s_binaries[key];
+			binary.data.resize(length);
+			glGetProgramBinary(program, length, NULL, &binary.format, &binary.data[0]);
+			binary.used = true;
+			s_binaries_dirty = true;
+		}
+		assert(glGetError() == GL_NO_ERROR);
+	}
+
+	resolveUniforms();
 	compiled = true;
 
 	return true;
@@ -426,16 +784,38 @@ void Shader::release()
 
 	if (program)
 	{
+		GLState::forgetProgram(program);
 		glDeleteProgram(program);
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
 	}
 
 	locations.clear();
+	for (int i = 0; i < NUM_UNIFORMS; ++i)
+	{
+		uniform_locations[i] = -1;
+		uniform_known[i] = false;
+	}
 
 	compiled = false;
 }
 
+void Shader::resolveUniforms()
+{
+	static_assert(sizeof(s_uniform_names) / sizeof(s_uniform_names[0]) == NUM_UNIFORMS, "one name per uniform id");
+	for (int i = 0; i < NUM_UNIFORMS; ++i)
+	{
+		uniform_locations[i] = glGetUniformLocation(program, s_uniform_names[i]);
+		uniform_known[i] = false;
+	}
+
+	//blocks the program does not use are skipped
+#define B(name, binding) setUniformBlock(#name, binding);
+	SHADER_UNIFORM_BLOCKS
+#undef B
+	assert(glGetError() == GL_NO_ERROR);
+}
+
 
 void Shader::enable()
 {
@@ -444,7 +824,7 @@ void Shader::enable()
 
 	current = this;
 
-	glUseProgram(program);
+	GLState::useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -456,14 +836,15 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	GLState::useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	current = NULL;
+	GLState::useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -563,10 +944,28 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
+	GLState::activeTexture(slot);
+}
+
+void Shader::setUniform(eUniform id, Texture* tex, int slot)
+{
+	assert(current == this);
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
+	GLint loc = uniform_locations[id];
+	if (loc != -1 && uniformChanged(id, (float)slot))
+		glUniform1i(loc, slot);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniformBlock(const char* block_name, int binding)
+{
+	GLuint index = glGetUniformBlockIndex(program, block_name);
+	if (index == GL_INVALID_INDEX)
+		return;
+	glUniformBlockBinding(program, index, binding);
+	assert(glGetError() == GL_NO_ERROR);
 }
 
 /*
@@ -9,6 +9,7 @@
 #include <string>
 #include <map>
 #include "framework.h"
+#include "glstate.h"
 #include <cassert>
 
 #ifdef _DEBUG
@@ -20,11 +21,88 @@
 
 class Texture;
 
+//uniforms set in the hot paths (per draw or per material). Every one gets an id at compile time
+//and its location is resolved once after linking, so setting it is an array index instead of a map search
+#define SHADER_UNIFORMS \
+	U(u_model) \
+	U(u_viewprojection) \
+	U(u_camera_pos) \
+	U(u_color) \
+	U(u_texture) \
+	U(u_texture_rep) \
+	U(u_alpha_cutoff) \
+	U(u_emissive_factor) \
+	U(u_emissive_texture) \
+	U(u_rough_metal_texture) \
+	U(u_material_map) \
+	U(u_normal_map) \
+	U(u_probes_texture) \
+	U(u_num_lights) \
+	U(u_light_indices)
+
+enum eUniform {
+#define U(name) UNIFORM_##name,
+	SHADER_UNIFORMS
+#undef U
+	NUM_UNIFORMS
+};
+
+//vertex attributes bound to fixed locations before linking, every program reads the streams
+//of a mesh from the same slots so one vertex array object per mesh works with all of them
+#define SHADER_ATTRIBUTES \
+	A(a_vertex, 0) \
+	A(a_normal, 1) \
+	A(a_uv, 2) \
+	A(a_color, 3) \
+	A(a_uv1, 4) \
+	A(a_bones, 5) \
+	A(a_weights, 6) \
+	A(u_model, 8) //instanced mat4, it takes four slots
+
+enum eAttribute {
+#define A(name, location) ATTRIB_##name = location,
+	SHADER_ATTRIBUTES
+#undef A
+};
+
+//uniform blocks bound to fixed binding points once after linking, the renderer binds the buffers
+//to the same points so switching shaders needs no block lookups
+#define LIGHTS_UBO_BINDING 0
+#define FRAME_UBO_BINDING 1
+#define MATERIAL_UBO_BINDING 2
+#define SHADER_UNIFORM_BLOCKS \
+	B(LightsBlock, LIGHTS_UBO_BINDING) \
+	B(FrameBlock, FRAME_UBO_BINDING) \
+	B(MaterialBlock, MATERIAL_UBO_BINDING)
+
+typedef int ShaderHandle; //index of a shader, stays valid when the shaders are reloaded
+
+//features that select a permutation of a shader, each one adds a #define after the #version line
+//so the shaders can remove the code and the texture fetches they do not need
+#define SHADER_FEATURES \
+	F(NORMALMAP) \
+	F(EMISSIVE) \
+	F(ALPHA_MASK) \
+	F(PBR) \
+	F(SH_INTERPOLATION) \
+	F(SHADOWMAP) \
+	F(CASCADES) \
+	F(INSTANCING)
+
+enum eShaderFeature {
+#define F(name) FEATURE_BIT_##name,
+	SHADER_FEATURES
+#undef F
+	NUM_SHADER_FEATURES
+};
+#define FEATURE(name) (1u << FEATURE_BIT_##name)
+
 class Shader
 {
 	int last_slot;
 
 	static bool s_ready; //used to initialize shader vars
+	static unsigned int s_last_sort_id;
 
 public:
 	static Shader* current;
@@ -64,6 +142,19 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//same with a pre-resolved uniform id
+	//the values are cached per program, setting the same one again does not reach GL
+	void setUniform(eUniform id, bool input) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); if (uniformChanged(id, input)) glUniform1i(loc, input); }
+	void setUniform(eUniform id, int input) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); if (uniformChanged(id, (float)input)) glUniform1i(loc, input); }
+	void setUniform(eUniform id, float input) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); if (uniformChanged(id, input)) glUniform1f(loc, input); }
+	void setUniform(eUniform id, const Vector2& input) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); if (uniformChanged(id, input.x, input.y)) glUniform2f(loc, input.x, input.y); }
+	void setUniform(eUniform id, const Vector3& input) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); if (uniformChanged(id, input.x, input.y, input.z)) glUniform3f(loc, input.x, input.y, input.z); }
+	void setUniform(eUniform id, const Vector4& input) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); if (uniformChanged(id, input.x, input.y, input.z, input.w)) glUniform4f(loc, input.x, input.y, input.z, input.w); }
+	void setUniform(eUniform id, const Matrix44& input) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); glUniformMatrix4fv(loc, 1, GL_FALSE, input.m); }
+	void setUniform(eUniform id, Texture* texture, int slot);
+	void setUniform1Array(eUniform id, const int* input, const int count) { assert(current == this); GLint loc = uniform_locations[id]; CHECK_SHADER_VAR(loc, id); glUniform1iv(loc, count, input); }
+	GLint getLocation(eUniform id) const { return uniform_locations[id]; }
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -98,6 +189,7 @@ public:
 
 	//virtual void setTexture(const char* varname, const unsigned int tex) ;
 	virtual void setTexture(const char* varname, Texture* texture, int slot);
+	virtual void setUniformBlock(const char* block_name, int binding); //reads the block from the buffer bound to that point
 
 	virtual int getAttribLocation(const char* varname);
 	virtual int getUniformLocation(const char* varname);
@@ -105,17 +197,35 @@ public:
 	std::string getInfoLog() const;
 	bool hasInfoLog() const;
 	bool compiled;
+	unsigned int sort_id; //small id used to sort draw calls by shader
+	ShaderHandle handle; //-1 until someone asks for it
+	std::map<unsigned int, Shader*> variants; //permutations of this shader by feature mask
+	unsigned int features; //of this permutation
+	Shader* base; //shader this permutation comes from, NULL if it is not a permutation
+	unsigned int supported_features; //the ones its code checks, getVariant ignores the rest
 
 	void setMacros(const char * macros);
 
 	static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
+	static ShaderHandle GetHandle(const char* name); //resolve once, -1 if there is no shader with that name
+	Shader* getVariant(unsigned int features); //compiled the first time it is requested, itself if features is 0. From a variant its features are added
+	void releaseVariants();
+	static std::string insertMacros(const std::string& code, const std::string& macros); //after the #version
+	static Shader* Get(ShaderHandle handle) { return handle >= 0 && handle < (int)s_handles.size() ? s_handles[handle] : NULL; }
+	static std::vector<Shader*> s_handles;
 	static void ReloadAll();
 	static std::map<std::string,Shader*> s_Shaders;
 
 	//this is a way to load a single file that contains all the shaders 
 	//to know more about the file format, it is based in this https://github.com/jagenjo/rendeer.js/tree/master/guides#the-shaders but with tiny differences
 	static bool LoadAtlas(const char* filename);
+	static void WarmUp(); //compiles every variant of the atlas shaders, so none is compiled in the middle of a frame
 	static std::string s_shader_atlas_filename;
+
+	//linked programs of previous runs stored next to the atlas, keyed by the hash of the code and the driver
+	static bool LoadBinaryCache(const char* filename);
+	static bool SaveBinaryCache();
+	static std::string s_binary_cache_filename;
 	static std::map<std::string, std::string> s_shaders_atlas; //stores strings, no shaders
 
 	static Shader* getDefaultShader(std::string name);
@@ -156,6 +266,26 @@ private:
 public:
 	GLint getLocation( const char* varname, loctable* table );
 	loctable locations;	
+
+	GLint uniform_locations[NUM_UNIFORMS]; //of the SHADER_UNIFORMS, -1 if the program does not use it
+	void resolveUniforms(); //after linking
+
+	//last value set with every id, matrices and arrays are not cached
+	float uniform_values[NUM_UNIFORMS][4];
+	bool uniform_known[NUM_UNIFORMS];
+	bool uniformChanged(eUniform id, float x, float y = 0.0f, float z = 0.0f, float w = 0.0f)
+	{
+		float* v = uniform_values[id];
+		if (uniform_known[id] && v[0] == x && v[1] == y && v[2] == z && v[3] == w)
+		{
+			GLState::countSkipped();
+			return false;
+		}
+		v[0] = x; v[1] = y; v[2] = z; v[3] = w;
+		uniform_known[id] = true;
+		GLState::countIssued();
+		return true;
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,222 @@
+#include "shadowatlas.h"
+
+#include "fbo.h"
+#include "camera.h"
+#include "Light.h"
+#include <algorithm>
+
+using namespace GTR;
+
+ShadowAtlas::ShadowAtlas()
+{
+	fbo = NULL;
+	static_fbo = NULL;
+	size = 4096;
+	min_tile = 128;
+	max_tile = 2048;
+	repacks = 0;
+}
+
+ShadowAtlas::~ShadowAtlas()
+{
+	delete fbo;
+	delete static_fbo;
+}
+
+void ShadowAtlas::init(int size)
+{
+	this->size = size;
+	if (max_tile > size)
+		max_tile = size;
+
+	delete fbo;
+	delete static_fbo;
+	static_fbo = NULL;
+	fbo = new FBO();
+	fbo->setDepthOnly(size, size);
+
+	//the content is lost, force a repack on the next update
+	for (int i = 0; i < (int)packed_lights.size(); ++i)
+		packed_lights[i]->shadow_dirty = true;
+	packed_lights.clear();
+	packed_sizes.clear();
+}
+
+FBO* ShadowAtlas::getStaticFBO()
+{
+	if (!static_fbo)
+	{
+		static_fbo = new FBO();
+		static_fbo->setDepthOnly(size, size);
+	}
+	return static_fbo;
+}
+
+//how much the shadow of the light can be seen, from 0 to 1
+float ShadowAtlas::computeImportance(Light* l, Camera* camera)
+{
+	//the sun covers the whole view
+	if (l->getType() == DIRECTIONAL)
+		return 1.0f;
+
+	//weak lights cast faint shadows
+	float intensity = l->getIntensity();
+	float weight = intensity / (intensity + 1.0f);
+
+	Vector3 pos = l->model.getTranslation();
+	float radius = l->getMaxDist();
+	if (camera->testSphereInFrustum(pos, radius) == CLIP_OUTSIDE)
+		return 0.0f;
+
+	//fraction of the screen covered by the light volume
+	float dist = (float)camera->eye.distance(pos);
+	float coverage = 1.0f;
+	if (dist > radius)
+	{
+		if (camera->type == Camera::PERSPECTIVE)
+			coverage = radius / (dist * tan(camera->fov * 0.5f * DEG2RAD));
+		else
+			coverage = radius / ((camera->right - camera->left) * 0.5f);
+	}
+	return clamp(coverage, 0.0f, 1.0f) * weight;
+}
+
+//smallest power of two that fits the importance
+int ShadowAtlas::getTileSize(float importance)
+{
+	int tile = max_tile;
+	while (tile > min_tile && tile * 0.5f >= importance * max_tile)
+		tile /= 2;
+	return tile;
+}
+
+bool ShadowAtlas::update(const std::vector<Light*>& lights, Camera* camera)
+{
+	if (!fbo)
+		init(size);
+
+	//the vectors keep their capacity, no allocations per frame
+	candidates.clear();
+	candidate_sizes.clear();
+
+	for (int i = 0; i < (int)lights.size(); ++i)
+	{
+		Light* l = lights[i];
+		if (!l->visible || (l->getType() != DIRECTIONAL && l->getType() != SPOT))
+			continue;
+
+		l->shadow_importance = computeImportance(l, camera);
+		int tile = getTileSize(l->shadow_importance);
+
+		//do not shrink until it is clearly smaller, to avoid repacking every frame at the threshold
+		for (int j = 0; j < (int)packed_lights.size(); ++j)
+			if (packed_lights[j] == l && tile < packed_sizes[j] && getTileSize(l->shadow_importance * 1.5f) >= packed_sizes[j])
+				tile = packed_sizes[j];
+
+		candidates.push_back(l);
+		candidate_sizes.push_back(tile);
+	}
+
+	if (candidates == packed_lights && candidate_sizes == packed_sizes)
+		return false;
+
+	pack(candidates, candidate_sizes);
+	repacks++;
+	return true;
+}
+
+//takes the smallest free square that fits and splits it in four until it has the right size
+static bool allocTile(std::vector<sAtlasTile>& free_tiles, int size, sAtlasTile& result)
+{
+	int best = -1;
+	for (int i = 0; i < (int)free_tiles.size(); ++i)
+		if (free_tiles[i].size >= size && (best == -1 || free_tiles[i].size < free_tiles[best].size))
+			best = i;
+	if (best == -1)
+		return false;
+
+	sAtlasTile tile = free_tiles[best];
+	free_tiles.erase(free_tiles.begin() + best);
+	while (tile.size > size)
+	{
+		int half = tile.size / 2;
+		sAtlasTile a = { tile.x + half, tile.y, half };
+		sAtlasTile b = { tile.x, tile.y + half, half };
+		sAtlasTile c = { tile.x + half, tile.y + half, half };
+		free_tiles.push_back(a);
+		free_tiles.push_back(b);
+		free_tiles.push_back(c);
+		tile.size = half;
+	}
+	result = tile;
+	return true;
+}
+
+void ShadowAtlas::pack(const std::vector<Light*>& lights, const std::vector<int>& sizes)
+{
+	//lights that are not in the atlas anymore
+	for (int i = 0; i < (int)packed_lights.size(); ++i)
+		if (std::find(lights.begin(), lights.end(), packed_lights[i]) == lights.end())
+			packed_lights[i]->shadow_tile_size = 0;
+
+	//biggest first, so splitting never leaves holes
+	std::vector<int> order(lights.size());
+	for (int i = 0; i < (int)order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return sizes[a] > sizes[b]; });
+
+	std::vector<sAtlasTile> free_tiles;
+	sAtlasTile whole = { 0, 0, size };
+	free_tiles.push_back(whole);
+
+	for (int i = 0; i < (int)order.size(); ++i)
+	{
+		Light* l = lights[order[i]];
+		sAtlasTile tile = { 0, 0, 0 };
+
+		//atlas full, try smaller tiles before leaving the light without shadows
+		for (int s = sizes[order[i]]; s >= min_tile; s /= 2)
+			if (allocTile(free_tiles, s, tile))
+				break;
+
+		if (tile.x != l->shadow_tile_x || tile.y != l->shadow_tile_y || tile.size != l->shadow_tile_size)
+			l->shadow_dirty = true;
+		if (!tile.size)
+			std::cout << "Shadow atlas full, light " << l->id << " has no shadows" << std::endl;
+
+		l->shadow_tile_x = tile.x;
+		l->shadow_tile_y = tile.y;
+		l->shadow_tile_size = tile.size;
+		l->shadow_tile = Vector4(tile.x / (float)size, tile.y / (float)size, tile.size / (float)size, tile.size / (float)size);
+	}
+
+	packed_lights = lights;
+	packed_sizes = sizes;
+}
+
+void ShadowAtlas::getViewRect(Light* l, int view, int& x, int& y, int& size)
+{
+	x = l->shadow_tile_x;
+	y = l->shadow_tile_y;
+	size = l->shadow_tile_size;
+	if (view < 0 || l->getNumShadowViews() == 1)
+		return;
+	size /= 2;
+	x += (view % 2) * size;
+	y += (view / 2) * size;
+}
+
+Vector4 ShadowAtlas::getViewTile(Light* l, int view)
+{
+	int x, y, s;
+	getViewRect(l, view, x, y, s);
+	return Vector4(x / (float)size, y / (float)size, s / (float)size, s / (float)size);
+}
+
+void ShadowAtlas::setViewport(Light* l, int view)
+{
+	int x, y, s;
+	getViewRect(l, view, x, y, s);
+	glViewport(x, y, s, s);
+	glScissor(x, y, s, s);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+class FBO;
+class Light;
+
+namespace GTR {
+
+	//square region of the atlas, in texels
+	struct sAtlasTile {
+		int x;
+		int y;
+		int size;
+	};
+
+	// All the shadowmaps packed in one depth only texture.
+	// Every light gets a power of two tile sized by how much it matters on screen
+	// (projected size, distance and intensity), so far or weak lights use fewer texels.
+	// Tiles are placed biggest first splitting free squares like a quadtree,
+	// and the atlas is only repacked when the size requested by some light changes.
+	class ShadowAtlas
+	{
+	public:
+		FBO* fbo;			//depth only atlas read by the shaders
+		FBO* static_fbo;	//same layout with only the static casters, used by the shadow cache
+		int size;			//width and height of the atlas
+		int min_tile;
+		int max_tile;
+		int repacks;		//times the layout changed, for stats
+
+		ShadowAtlas();
+		~ShadowAtlas();
+
+		void init(int size); //(re)creates the textures, all the lights are repacked
+		FBO* getStaticFBO(); //created the first time the cache needs it
+
+		//assigns a tile to every light with shadows, marks dirty the ones that moved, returns true if repacked
+		bool update(const std::vector<Light*>& lights, Camera* camera);
+		float computeImportance(Light* l, Camera* camera);
+		int getTileSize(float importance);
+
+		//a light tile holds one view, or its cascades in a 2x2 grid. view -1 is the whole tile
+		void getViewRect(Light* l, int view, int& x, int& y, int& size);
+		Vector4 getViewTile(Light* l, int view); //same rect in uvs, offset in xy and scale in zw
+		void setViewport(Light* l, int view = -1); //viewport and scissor in the bound atlas
+
+	private:
+		std::vector<Light*> packed_lights;
+		std::vector<int> packed_sizes;	//size requested by every light when it was packed
+		std::vector<Light*> candidates;
+		std::vector<int> candidate_sizes;
+
+		void pack(const std::vector<Light*>& lights, const std::vector<int>& sizes);
+	};
+
+};
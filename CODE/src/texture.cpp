@@ -7,6 +7,7 @@
 
 #include "mesh.h"
 #include "shader.h"
+#include "glstate.h"
 #include "extra/picopng.h"
 #include <cassert>
 
@@ -76,8 +77,9 @@ Texture::~Texture()
 
 void Texture::clear()
 {
+	GLState::forgetTexture(texture_id);
 	glDeleteTextures(1, &texture_id);
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	texture_id = 0;
 }
 
@@ -161,7 +163,7 @@ void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** dat
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	uploadCubemap(format, type, mipmaps, data, internal_format);
 }
 
@@ -251,7 +253,7 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_2D && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	if (internal_format == 0)
 	{
@@ -272,7 +274,7 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	if (data && this->mipmaps)
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
@@ -280,7 +282,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
 
@@ -293,7 +295,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	if (data && this->mipmaps)
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
@@ -302,7 +304,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int type, bool mipmaps
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_CUBE_MAP && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	int width = ((int)this->width) >> level;
 	int height = ((int)this->height) >> level;
@@ -330,7 +332,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int type, bool mipmaps
 			generateMipmaps();
 	}
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(glGetError() == GL_NO_ERROR && "Error creating texture");
 }
 
@@ -387,7 +389,7 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 	assert(glGetError() == GL_NO_ERROR);
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-	glBindTexture( this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture( this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	glTexImage3D( this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -408,13 +410,13 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 void Texture::bind()
 {
 	//glEnable(this->texture_type); //enable the textures 
-	glBindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
 }
 
 void Texture::unbind()
 {
 	//glDisable(this->texture_type); //disable the textures 
-	glBindTexture(this->texture_type, 0 );	//disable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, 0 );	//disable the id of the texture we are going to use
 }
 
 void Texture::UnbindAll()
@@ -422,9 +424,9 @@ void Texture::UnbindAll()
 	glDisable( GL_TEXTURE_CUBE_MAP );
 	glDisable( GL_TEXTURE_2D );
 	glDisable(GL_TEXTURE_3D);
-	glBindTexture( GL_TEXTURE_2D, 0 );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, 0 );
-	glBindTexture(GL_TEXTURE_3D, 0);
+	GLState::bindTexture( GL_TEXTURE_2D, 0 );
+	GLState::bindTexture( GL_TEXTURE_CUBE_MAP, 0 );
+	GLState::bindTexture(GL_TEXTURE_3D, 0);
 }
 
 void Texture::generateMipmaps()
@@ -432,7 +434,7 @@ void Texture::generateMipmaps()
 	if(!glGenerateMipmapEXT)
 		return;
 
-	glBindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter ); //set the mag filter
 	glGenerateMipmapEXT(this->texture_type);
 }
@@ -481,29 +483,29 @@ void Texture::copyTo(Texture* destination, Shader* shader)
 {
 	if (!destination)
 	{
-		glDepthFunc(GL_ALWAYS);
-		glEnable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_ALWAYS);
+		GLState::enable(GL_DEPTH_TEST);
 		shader = Shader::getDefaultShader("screen_depth");
 		toViewport(shader);
-		glDisable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LESS);
+		GLState::disable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_LESS);
 		return;
 	}
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_BLEND);
 	FBO* fbo = getGlobalFBO(destination);
 	fbo->bind();
 	if (!shader && format == GL_DEPTH_COMPONENT)
 	{
 		shader = Shader::getDefaultShader("screen_depth");
-		glDepthFunc(GL_ALWAYS);
-		glEnable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_ALWAYS);
+		GLState::enable(GL_DEPTH_TEST);
 	}
 	toViewport(shader);
 	fbo->unbind();
-	glDisable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LESS);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::depthFunc(GL_LESS);
 }
 
 void Image::fromScreen(int width, int height)
@@ -0,0 +1,71 @@
+#include "ubo.h"
+#include <cassert>
+
+UBO::UBO()
+{
+	ubo_id = 0;
+	size = 0;
+	binding = 0;
+}
+
+UBO::~UBO()
+{
+	if (ubo_id)
+		glDeleteBuffers(1, &ubo_id);
+}
+
+void UBO::create(int size, int binding)
+{
+	this->size = size;
+	this->binding = binding;
+
+	if (ubo_id == 0)
+		glGenBuffers(1, &ubo_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	bind();
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void UBO::upload(const void* data, int size, int offset)
+{
+	assert(offset + size <= this->size);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+	glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void UBO::resize(int size)
+{
+	GLuint old_id = ubo_id;
+	glGenBuffers(1, &ubo_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	if (old_id)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, old_id);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, ubo_id);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, this->size < size ? this->size : size);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		glDeleteBuffers(1, &old_id);
+	}
+	this->size = size;
+	bind();
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void UBO::bind()
+{
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo_id);
+}
+
+void UBO::bindRange(int offset, int size)
+{
+	assert(offset + size <= this->size);
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, ubo_id, offset, size);
+}
@@ -0,0 +1,26 @@
+#ifndef UBO_H
+#define UBO_H
+
+#include "includes.h"
+
+//UniformBufferObject
+//a block of uniforms stored in the GPU and shared by all the shaders that declare it,
+//so it is uploaded once instead of setting the same uniforms in every draw call
+
+class UBO {
+public:
+	GLuint ubo_id;
+	int size;
+	int binding; //binding point where the shaders find it
+
+	UBO();
+	~UBO();
+
+	void create(int size, int binding);
+	void upload(const void* data, int size, int offset = 0);
+	void resize(int size); //keeps the content
+	void bind(); //to its binding point
+	void bindRange(int offset, int size); //only a part, offset must be aligned to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+};
+
+#endif
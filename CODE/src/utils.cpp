@@ -10,6 +10,7 @@
 
 #include "application.h"
 #include "camera.h"
+#include "glstate.h"
 #include "shader.h"
 #include "mesh.h"
 
@@ -191,8 +192,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	Matrix44 projection_matrix;
 	projection_matrix.ortho(0, Application::instance->window_width / scale, Application::instance->window_height / scale, 0, -1, 1);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
 
 	glMatrixMode(GL_MODELVIEW);
 	glPushMatrix();
@@ -211,8 +212,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	glMatrixMode(GL_MODELVIEW);
 	glPopMatrix();
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 
 	return true;
 }
@@ -301,9 +302,9 @@ void drawGrid()
 	}
 
 	glLineWidth(1);
-	glEnable(GL_BLEND);
-	glDepthMask(false);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	GLState::enable(GL_BLEND);
+	GLState::depthMask(false);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	Shader* grid_shader = Shader::getDefaultShader("grid");
 	grid_shader->enable();
 	Matrix44 m;
@@ -313,25 +314,29 @@ void drawGrid()
 	grid_shader->setUniform("u_camera_position", Camera::current->eye);
 	grid_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 	grid->render(GL_LINES); //background grid
-	glDisable(GL_BLEND);
-	glDepthMask(true);
+	GLState::disable(GL_BLEND);
+	GLState::depthMask(true);
 	grid_shader->disable();
 }
 
-void ImGuiMatrix44(Matrix44& matrix, const char* text)
+bool ImGuiMatrix44(Matrix44& matrix, const char* text)
 {
+	bool changed = false;
 	#ifndef SKIP_IMGUI
 	if (ImGui::TreeNode((void*)&matrix, "Model"))
 	{
 		float matrixTranslation[3], matrixRotation[3], matrixScale[3];
 		ImGuizmo::DecomposeMatrixToComponents(matrix.m, matrixTranslation, matrixRotation, matrixScale);
-		ImGui::DragFloat3("Position", matrixTranslation, 0.1f);
-		ImGui::DragFloat3("Rotation", matrixRotation, 0.1f);
-		ImGui::DragFloat3("Scale", matrixScale, 0.1f);
-		ImGuizmo::RecomposeMatrixFromComponents(matrixTranslation, matrixRotation, matrixScale, matrix.m);
+		changed |= ImGui::DragFloat3("Position", matrixTranslation, 0.1f);
+		changed |= ImGui::DragFloat3("Rotation", matrixRotation, 0.1f);
+		changed |= ImGui::DragFloat3("Scale", matrixScale, 0.1f);
+		//only recompose when edited, the decompose is not exact and would modify the matrix every frame
+		if (changed)
+			ImGuizmo::RecomposeMatrixFromComponents(matrixTranslation, matrixRotation, matrixScale, matrix.m);
 		ImGui::TreePop();
 	}
 	#endif
+	return changed;
 }
 
 char* fetchWord(char* data, char* word)
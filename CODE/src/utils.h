@@ -32,7 +32,7 @@ std::vector<std::string>& split(const std::string &s, char delim, std::vector<st
 std::vector<std::string> split(const std::string &s, char delim);
 std::string join(std::vector<std::string>& strings, const char* delim);
 
-void ImGuiMatrix44(Matrix44& matrix, const char* text);
+bool ImGuiMatrix44(Matrix44& matrix, const char* text); //returns true if the matrix was edited
 
 std::string getGPUStats();
 void drawGrid();
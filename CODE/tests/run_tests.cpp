@@ -0,0 +1,13 @@
+//checks that need no window nor GL context, "make test" builds and runs them
+//and the exit code is not 0 if any of them fails
+
+#include "../src/framework.h"
+#include "../src/occlusion.h"
+
+int main(int argc, char **argv)
+{
+	bool passed = testSimdMath(); //the SIMD math against the scalar code
+	passed = OcclusionCuller::test() && passed;
+	OcclusionCuller::benchmark(500, 50000);
+	return passed ? 0 : 1;
+}